@@ -0,0 +1,685 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Undefines main function in main.c
+#define UNIT_TEST
+#include "main.c"
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes `size` bytes of lines with varying lengths to a temporary file
+char *bench_file(size_t size)
+{
+    static char path[] = "/tmp/cea_bench_XXXXXX";
+    strcpy(path, "/tmp/cea_bench_XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Unable to create benchmark file.\n");
+        exit(1);
+    }
+
+    char block[1 << 16];
+    srand(3);
+    for (size_t i = 0; i < sizeof(block); ++i) {
+        block[i] = rand() % 60 == 0 ? '\n' : 'a' + rand() % 26;
+    }
+
+    for (size_t written = 0; written < size;) {
+        size_t n = MIN(sizeof(block), size - written);
+        if (write(fd, block, n) != (ssize_t) n) {
+            fprintf(stderr, "ERROR: Unable to write benchmark file.\n");
+            exit(1);
+        }
+        written += n;
+    }
+    close(fd);
+
+    return path;
+}
+
+void bench_report(const char *name, size_t bytes, double seconds)
+{
+    printf("    %-32s %8.3f ms %8.2f GiB/s\n", name, seconds * 1e3, bytes / seconds / (1 << 30));
+}
+
+void bench_load(size_t size)
+{
+    char *path = bench_file(size);
+    printf("  Load %zu MiB\n", size >> 20);
+
+    // Reference for what the memory subsystem can do on this machine
+    char *src = malloc(size);
+    char *dst = malloc(size);
+    memset(src, 'a', size);
+    memset(dst, 'b', size);
+    double start = now();
+    memcpy(dst, src, size);
+    volatile char sink = dst[size / 2];
+    (void) sink;
+    bench_report("memcpy", size, now() - start);
+    free(src);
+    free(dst);
+
+    struct {
+        const char *name;
+        NewlineScanner scanner;
+    } scanners[] = {
+        { "scalar", newline_scan_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+        { "sse2", newline_scan_sse2 },
+        { "avx2", __builtin_cpu_supports("avx2") ? newline_scan_avx2 : NULL },
+#endif
+    };
+
+    for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); ++i) {
+        if (!scanners[i].scanner)
+            continue;
+        newline_scanner = scanners[i].scanner;
+
+        Editor e = {0};
+        start = now();
+        editor_read_from_file(&e, path);
+        pt_index_all(&e.text);
+        double seconds = now() - start;
+
+        char name[64];
+        snprintf(name, sizeof(name), "load %s (%zu lines)", scanners[i].name, pt_line_count(&e.text));
+        bench_report(name, size, seconds);
+        editor_free(&e);
+    }
+
+    newline_scanner = NULL;
+
+    Editor e = {0};
+    start = now();
+    editor_read_from_file(&e, path);
+    pt_index_parallel(&e.text, size, index_threads());
+    char name[64];
+    snprintf(name, sizeof(name), "load parallel (%zu threads)", index_threads());
+    bench_report(name, size, now() - start);
+    editor_free(&e);
+
+    unlink(path);
+}
+
+// The highlighter as it was before keyword_match: every column rescans up
+// to the next whitespace and compares the word against each keyword
+const char *naive_keywords[] = { "if", "else", "for", "while", "return", "#include", "sizeof" };
+
+size_t naive_highlight(Line *line, size_t pos)
+{
+    size_t n = 0;
+    while (pos + n < line->count && line->data[pos + n] != ' ' && line->data[pos + n] != '\t')
+        n++;
+    for (size_t i = 0; i < sizeof(naive_keywords) / sizeof(naive_keywords[0]); ++i) {
+        if (n == strlen(naive_keywords[i]) && memcmp(naive_keywords[i], &line->data[pos], n) == 0)
+            return n;
+    }
+    return 0;
+}
+
+void naive_draw(Screen *s, size_t y, Line *line, size_t width)
+{
+    for (size_t j = 0; j < width && j < line->count; ++j) {
+        size_t n = naive_highlight(line, j);
+        if (n > 0) {
+            n = MIN(n, width - j);
+            screen_puts(s, j, y, &line->data[j], n, STYLE_KEYWORD);
+            j += n - 1;
+            continue;
+        }
+        screen_puts(s, j, y, &line->data[j], 1, STYLE_TEXT);
+    }
+}
+
+// Highlights a full 200 column screen of code-like lines, repeatedly
+void bench_highlight(void)
+{
+    const size_t width = 200, height = 60, frames = 2000;
+    printf("  Highlight %zux%zu screen\n", width, height);
+
+    const char *words[] = {
+        "if", "(x", "==", "y)", "return", "sizeof(buf);", "for", "while", "else",
+        "counter_value", "#include", "<stdio.h>", "a", "long_identifier_name", "{", "}",
+    };
+    Line lines[60] = {0};
+    srand(5);
+    for (size_t y = 0; y < height; ++y) {
+        while (lines[y].count < width + 40) {
+            const char *word = words[rand() % (sizeof(words) / sizeof(words[0]))];
+            line_append_str(&lines[y], word, strlen(word));
+            line_append(&lines[y], ' ');
+        }
+    }
+
+    Screen s = {0};
+    screen_resize(&s, width, height);
+    size_t bytes = frames * width * height;
+
+    double start = now();
+    for (size_t f = 0; f < frames; ++f)
+        for (size_t y = 0; y < height; ++y)
+            naive_draw(&s, y, &lines[y], width);
+    bench_report("per column rescan", bytes, now() - start);
+
+    start = now();
+    for (size_t f = 0; f < frames; ++f)
+        for (size_t y = 0; y < height; ++y)
+            highlight(&s, 0, y, &lines[y], 0, width, LEX_CODE);
+    bench_report("single pass", bytes, now() - start);
+
+    for (size_t y = 0; y < height; ++y)
+        line_free(&lines[y]);
+    screen_free(&s);
+}
+
+// Scatters single byte inserts over a document so every one becomes a
+// piece of its own, then closes it
+void bench_pieces(size_t count)
+{
+    printf("  Pieces %zu\n", count);
+
+    PieceTable pt;
+    pt_init(&pt);
+    srand(9);
+    double start = now();
+    for (size_t i = 0; i < count; ++i) {
+        size_t size = pt.root ? pt.root->sub_count : 0;
+        pt_insert(&pt, size ? (size_t) rand() % size : 0, "x\n" + i % 2, 1);
+    }
+    printf("    %-32s %8.3f ms\n", "insert", (now() - start) * 1e3);
+
+    size_t used, reserved;
+    pt_memory(&pt, &used, &reserved);
+    printf("    %-32s %8zu KiB / %zu KiB\n", "in use / reserved", used >> 10, reserved >> 10);
+
+    start = now();
+    pt_free(&pt);
+    printf("    %-32s %8.3f ms\n", "free", (now() - start) * 1e3);
+}
+
+// Scans a buffer of random lowercase lines for a rare pattern whose first
+// byte is common, with every substring scanner, memmem and the regex engine
+void bench_search(size_t size)
+{
+    printf("  Search %zu MiB\n", size >> 20);
+
+    const char *pat = "ezzq";
+    size_t n = strlen(pat);
+    char *data = malloc(size + n);
+    srand(5);
+    for (size_t i = 0; i < size; ++i)
+        data[i] = rand() % 60 == 0 ? '\n' : 'a' + rand() % 26;
+    memset(data + size, '\n', n);
+
+    struct { const char *name; SubstringScanner scan; } scanners[] = {
+        { "scalar", substring_scan_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+        { "sse2", substring_scan_sse2 },
+        { "avx2", substring_scan_avx2 },
+#endif
+    };
+    for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); ++i) {
+        Matches m = {0};
+        double start = now();
+        scanners[i].scan(data, size, pat, n, 0, &m);
+        bench_report(scanners[i].name, size, now() - start);
+        matches_free(&m);
+    }
+
+    double start = now();
+    for (const char *p = data; (p = memmem(p, data + size - p, pat, n)); ++p)
+        ;
+    bench_report("memmem", size, now() - start);
+
+    // The same rare literal and a few real patterns through the regex DFA
+    const char *patterns[] = { "ezzq", "e[xyz]+q", "^qu.*z$", "(foo|bar)baz" };
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); ++i) {
+        Regex re;
+        const char *error;
+        Matches m = {0};
+        regex_compile(&re, patterns[i], strlen(patterns[i]), &error);
+        start = now();
+        regex_scan(&re, data, size, 0, &m);
+        char name[64];
+        snprintf(name, sizeof(name), "regex /%s/", patterns[i]);
+        bench_report(name, size, now() - start);
+        matches_free(&m);
+        regex_free(&re);
+    }
+
+    free(data);
+}
+
+// Runs a substitute with about one match in 230 bytes over a whole file,
+// then undoes it
+void bench_substitute(size_t size)
+{
+    char *path = bench_file(size);
+    printf("  Substitute %zu MiB\n", size >> 20);
+
+    Editor e = { .mode = NORMAL };
+    editor_read_from_file(&e, path);
+    pt_index_all(&e.text);
+    const char *cmd = "%s/q[a-c]/QQ/g";
+    double start = now();
+    editor_command(&e, cmd, strlen(cmd));
+    char name[64];
+    snprintf(name, sizeof(name), "substitute (%.40s)", e.message);
+    bench_report(name, size, now() - start);
+
+    start = now();
+    editor_undo(&e);
+    bench_report("undo", size, now() - start);
+
+    editor_free(&e);
+    unlink(path);
+}
+
+// A named stream of keys fed to the editor one frame at a time
+typedef struct {
+    const char *name;
+    int *keys;
+    size_t count;
+    size_t capacity;
+} Script;
+
+void script_key(Script *s, int code, size_t times)
+{
+    for (size_t i = 0; i < times; ++i) {
+        if (s->count == s->capacity) {
+            s->capacity = s->capacity ? s->capacity * 2 : 256;
+            s->keys = realloc(s->keys, sizeof(int) * s->capacity);
+            if (!s->keys) {
+                fprintf(stderr, "ERROR: Not enough memory...\n");
+                exit(1);
+            }
+        }
+        s->keys[s->count++] = code;
+    }
+}
+
+void script_str(Script *s, const char *str)
+{
+    for (; *str; ++str)
+        script_key(s, *str, 1);
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Plays each script through the key handler and renders every key into a
+// memory stream, reporting per-key latency percentiles and output bytes.
+// Edits go to a swap file unless `swap` is 0.
+void bench_keys_run(const char *path, Script *scripts, size_t script_count, int swap)
+{
+    Editor e = { .mode = NORMAL, .width = 120, .height = 40 };
+    Viewport v = {0};
+    double start = now();
+    editor_read_from_file(&e, path);
+    printf("    %-12s %8.3f ms\n", "open", (now() - start) * 1e3);
+    if (!swap)
+        swap_close(&e.swap);
+
+    char *frame;
+    size_t frame_len;
+    FILE *out = open_memstream(&frame, &frame_len);
+    editor_frame(&e, &v, out, ' ');
+
+    Input in = {0};
+    for (size_t i = 0; i < script_count; ++i) {
+        Script *script = &scripts[i];
+        double *latency = malloc(sizeof(double) * script->count);
+        size_t bytes = 0;
+        for (size_t k = 0; k < script->count; ++k) {
+            Key key = { .code = script->keys[k] };
+            start = now();
+            editor_handle_key(&e, &key, &in);
+            // Frames overwrite each other so the stream stays one frame long
+            rewind(out);
+            editor_frame(&e, &v, out, key.code);
+            latency[k] = now() - start;
+            bytes += v.screen.frame_bytes;
+        }
+
+        qsort(latency, script->count, sizeof(double), compare_double);
+        printf("    %-12s %6zu keys  p50 %8.1f us  p99 %8.1f us  max %9.1f us  %7zu B/frame\n",
+                script->name, script->count,
+                latency[script->count / 2] * 1e6, latency[script->count * 99 / 100] * 1e6,
+                latency[script->count - 1] * 1e6, bytes / script->count);
+        free(latency);
+    }
+
+    fclose(out);
+    free(frame);
+    line_free(&in.paste);
+    editor_free(&e);
+    viewport_free(&v);
+}
+
+// Drives the editor headlessly over files from 1 KiB up to `max_size` with
+// scripted scrolling, typing, line splits, deletes and saves. Each size runs
+// in its own process so peak RSS belongs to that file alone.
+void bench_keys(size_t max_size)
+{
+    Script scripts[] = {
+        { .name = "scroll" }, { .name = "type" }, { .name = "split" },
+        { .name = "delete" }, { .name = "undo" }, { .name = "save" },
+    };
+    Script *s = scripts;
+    script_key(s, 'j', 2000);
+    script_key(s, KEY_DOWN, 500);
+    script_key(s, 'k', 1000);
+    script_str(s, "Ggg");
+    script_str(s, "1000G");
+
+    script_str(++s, "i");
+    for (size_t i = 0; i < 50; ++i)
+        script_str(s, "the quick brown fox jumps over the lazy dog ");
+    script_key(s, ESCAPE, 1);
+
+    script_str(++s, "o");
+    for (size_t i = 0; i < 500; ++i) {
+        script_str(s, "int x = 0;");
+        script_key(s, ENTER, 1);
+    }
+    script_key(s, ESCAPE, 1);
+
+    ++s;
+    for (size_t i = 0; i < 100; ++i) {
+        script_key(s, 'x', 20);
+        script_key(s, 'j', 1);
+    }
+
+    ++s;
+    script_key(s, 'u', 200);
+    script_key(s, CTRL_R, 100);
+
+    script_str(++s, "sysysy");
+
+    size_t sizes[] = { 1 << 10, 1 << 20, 64 << 20, 1 << 30 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && sizes[i] <= max_size; ++i) {
+        char *path = bench_file(sizes[i]);
+        if (sizes[i] < (1 << 20))
+            printf("  Keys %zu KiB\n", sizes[i] >> 10);
+        else
+            printf("  Keys %zu MiB\n", sizes[i] >> 20);
+        fflush(stdout);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            bench_keys_run(path, scripts, sizeof(scripts) / sizeof(scripts[0]), 1);
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            printf("    %-12s %8.1f MiB\n", "peak rss", usage.ru_maxrss / 1024.0);
+            exit(0);
+        }
+        waitpid(pid, NULL, 0);
+        unlink(path);
+    }
+
+    for (size_t i = 0; i < sizeof(scripts) / sizeof(scripts[0]); ++i)
+        free(scripts[i].keys);
+}
+
+// Same keys over a file that is a single line of code-like words, from
+// 1 MiB up to `max_size`, so every frame draws a window of that line
+void bench_long_line(size_t max_size)
+{
+    Script scripts[] = {
+        { .name = "end" }, { .name = "scroll" }, { .name = "type" },
+        { .name = "delete" }, { .name = "undo" },
+    };
+    Script *s = scripts;
+    script_str(s, "A");
+    script_key(s, ESCAPE, 1);
+
+    script_key(++s, 'h', 2000);
+
+    script_str(++s, "i");
+    for (size_t i = 0; i < 50; ++i)
+        script_str(s, "if (x) /* quick */ \"fox\" ");
+    script_key(s, ESCAPE, 1);
+
+    script_key(++s, 'x', 500);
+
+    script_key(++s, 'u', 200);
+
+    const char *words[] = { "if", "(x", "==", "y)", "return", "/*", "*/", "\"s\"", "'c'", "counter_value", "{", "}" };
+    char block[1 << 16];
+    size_t used = 0;
+    srand(7);
+    while (used < sizeof(block) - 16) {
+        const char *word = words[rand() % (sizeof(words) / sizeof(words[0]))];
+        memcpy(block + used, word, strlen(word));
+        used += strlen(word);
+        block[used++] = ' ';
+    }
+
+    size_t sizes[] = { 1 << 20, 64 << 20 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && sizes[i] <= max_size; ++i) {
+        static char path[] = "/tmp/cea_bench_XXXXXX";
+        strcpy(path, "/tmp/cea_bench_XXXXXX");
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            fprintf(stderr, "ERROR: Unable to create benchmark file.\n");
+            exit(1);
+        }
+        for (size_t written = 0; written < sizes[i]; written += used) {
+            if (write(fd, block, used) != (ssize_t) used) {
+                fprintf(stderr, "ERROR: Unable to write benchmark file.\n");
+                exit(1);
+            }
+        }
+        close(fd);
+
+        printf("  Long line %zu MiB\n", sizes[i] >> 20);
+        fflush(stdout);
+        bench_keys_run(path, scripts, sizeof(scripts) / sizeof(scripts[0]), 1);
+        unlink(path);
+    }
+
+    for (size_t i = 0; i < sizeof(scripts) / sizeof(scripts[0]); ++i)
+        free(scripts[i].keys);
+}
+
+// Same keys with soft-wrap on, over a million lines of which every 64th
+// is 4 KiB long and takes dozens of screen rows. The first key measures
+// every line, the jumps after it go through the wrap index.
+void bench_wrap(void)
+{
+    Script scripts[] = {
+        { .name = "wrap" }, { .name = "scroll" }, { .name = "jump" }, { .name = "split" },
+    };
+    Script *s = scripts;
+    script_str(s, ":set wrap");
+    script_key(s, ENTER, 1);
+    script_str(s, "G");
+
+    script_str(++s, "gg");
+    script_key(s, 'j', 2000);
+    script_key(s, 'k', 1000);
+
+    ++s;
+    for (size_t i = 0; i < 200; ++i)
+        script_str(s, i % 2 ? "250000G" : "750000G");
+
+    script_str(++s, "500000Go");
+    for (size_t i = 0; i < 500; ++i) {
+        script_str(s, "int x = 0;");
+        script_key(s, ENTER, 1);
+    }
+    script_key(s, ESCAPE, 1);
+
+    static char path[] = "/tmp/cea_bench_XXXXXX";
+    int fd = mkstemp(path);
+    FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!file) {
+        fprintf(stderr, "ERROR: Unable to create benchmark file.\n");
+        exit(1);
+    }
+    for (size_t row = 0; row < 1000000; ++row) {
+        if (row % 64 == 0) {
+            for (size_t k = 0; k < 128; ++k)
+                fputs("return counter_value; /* x */ ", file);
+            fputc('\n', file);
+        } else {
+            fprintf(file, "    int value_%zu = counter(%zu);\n", row, row);
+        }
+    }
+    fclose(file);
+
+    printf("  Wrap 1M lines\n");
+    fflush(stdout);
+    bench_keys_run(path, scripts, sizeof(scripts) / sizeof(scripts[0]), 1);
+    unlink(path);
+
+    for (size_t i = 0; i < sizeof(scripts) / sizeof(scripts[0]); ++i)
+        free(scripts[i].keys);
+}
+
+// The editing scripts over a 64 MiB file without and with the swap file,
+// which should cost a key no more than an append to memory
+void bench_swap(void)
+{
+    Script scripts[] = { { .name = "type" }, { .name = "split" }, { .name = "delete" }, { .name = "undo" } };
+    Script *s = scripts;
+    script_str(s, "i");
+    for (size_t i = 0; i < 100; ++i)
+        script_str(s, "the quick brown fox jumps over the lazy dog ");
+    script_key(s, ESCAPE, 1);
+
+    script_str(++s, "o");
+    for (size_t i = 0; i < 1000; ++i) {
+        script_str(s, "int x = 0;");
+        script_key(s, ENTER, 1);
+    }
+    script_key(s, ESCAPE, 1);
+
+    ++s;
+    for (size_t i = 0; i < 200; ++i) {
+        script_key(s, 'x', 20);
+        script_key(s, 'j', 1);
+    }
+
+    ++s;
+    script_key(s, 'u', 200);
+    script_key(s, CTRL_R, 100);
+
+    char *path = bench_file(64 << 20);
+    for (int swap = 0; swap <= 1; ++swap) {
+        printf("  Swap file %s\n", swap ? "on" : "off");
+        bench_keys_run(path, scripts, sizeof(scripts) / sizeof(scripts[0]), swap);
+    }
+
+    // What the swap file adds to an edit on its own
+    Editor e = {0};
+    editor_read_from_file(&e, path);
+    size_t edits = 1000000;
+    double start = now();
+    for (size_t i = 0; i < edits; ++i)
+        swap_record(&e.swap, JOURNAL_INSERT, i, "x", 1);
+    printf("    %-12s %8.1f ns/edit\n", "record", (now() - start) / edits * 1e9);
+    editor_free(&e);
+    unlink(path);
+
+    for (size_t i = 0; i < sizeof(scripts) / sizeof(scripts[0]); ++i)
+        free(scripts[i].keys);
+}
+
+// Follows a log that is appended to at 100 MiB/s, a frame's worth of lines
+// between frames, for `seconds`. Each frame takes in the new bytes and
+// draws the end of the file. The first and last second should cost the same.
+void bench_follow(size_t seconds)
+{
+    size_t fps = 60, chunk = (100 << 20) / fps, frames = seconds * fps;
+    char *path = bench_file(1 << 20);
+    printf("  Follow 100 MiB/s for %zu s\n", seconds);
+
+    char *block = malloc(chunk);
+    for (size_t i = 0; i < chunk; ++i)
+        block[i] = rand() % 80 == 0 ? '\n' : 'a' + rand() % 26;
+    block[chunk - 1] = '\n';
+
+    Editor e = { .mode = NORMAL, .width = 120, .height = 40 };
+    Viewport v = {0};
+    editor_read_from_file(&e, path);
+    editor_command(&e, "set follow", 10);
+    char *frame;
+    size_t frame_len;
+    FILE *out = open_memstream(&frame, &frame_len);
+    editor_frame(&e, &v, out, ' ');
+
+    int fd = open(path, O_WRONLY | O_APPEND);
+    double *latency = malloc(sizeof(double) * frames);
+    size_t bytes = 0;
+    double total = 0;
+    for (size_t k = 0; k < frames; ++k) {
+        // Writers don't line up with frames, a line is cut in two
+        size_t split = chunk / 2 + k % 64;
+        if (write(fd, block + split, chunk - split) < 0 || write(fd, block, split) < 0) {
+            fprintf(stderr, "ERROR: Unable to write benchmark file.\n");
+            exit(1);
+        }
+        double start = now();
+        editor_follow_poll(&e);
+        rewind(out);
+        editor_frame(&e, &v, out, ' ');
+        latency[k] = now() - start;
+        total += latency[k];
+        bytes += v.screen.frame_bytes;
+    }
+    close(fd);
+
+    for (size_t second = 0; second < seconds; second += seconds - 1) {
+        double *window = latency + second * fps;
+        qsort(window, fps, sizeof(double), compare_double);
+        printf("    second %-5zu p50 %8.1f us  p99 %8.1f us  max %9.1f us\n", second + 1,
+                window[fps / 2] * 1e6, window[fps * 99 / 100] * 1e6, window[fps - 1] * 1e6);
+        if (seconds == 1)
+            break;
+    }
+    printf("    %-12s %8.1f%% of the time  %7zu B/frame  %zu lines\n", "busy",
+            total / seconds * 100, bytes / frames, pt_line_count(&e.text));
+
+    fclose(out);
+    free(frame);
+    free(latency);
+    free(block);
+    editor_free(&e);
+    viewport_free(&v);
+    unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+    size_t load_mib = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+    // An optional second argument runs only the benchmark with that name
+    const char *only = argc > 2 ? argv[2] : NULL;
+#define BENCH(name) if (!only || strcmp(only, name) == 0)
+
+    printf("Running benchmarks\n");
+    BENCH("keys") bench_keys(load_mib << 20);
+    BENCH("long") bench_long_line(load_mib << 20);
+    BENCH("wrap") bench_wrap();
+    BENCH("swap") bench_swap();
+    BENCH("follow") bench_follow(5);
+    BENCH("load") bench_load(load_mib << 20);
+    BENCH("highlight") bench_highlight();
+    BENCH("pieces") bench_pieces(1 << 19);
+    BENCH("search") bench_search(256 << 20);
+    BENCH("substitute") bench_substitute(load_mib << 20);
+
+    return 0;
+}
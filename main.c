@@ -1,45 +1,294 @@
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef TRACE
+#include <stdatomic.h>
+#endif
+
 struct termios org_term;
 
 #define INIT_CAP 8
 
+// Pieces of the original file at least this long are copied by the kernel
+// on save, shorter ones go out with the rest
+#define SAVE_COPY_MIN (64 * 1024)
+// Buffers handed to writev at once
+#define SAVE_IOV 1024
+
+// Address space mapped past the end of a file for follow mode to grow into
+#define FOLLOW_RESERVE ((size_t) 64 << 30)
+// How often a followed file that keeps growing is looked at, rather than
+// on every write to it
+#define FOLLOW_POLL_MS 16
+
+// Bytes of the file scanned for newlines per indexing step
+#define INDEX_CHUNK (64 * 1024)
+// Bytes scanned for newlines at a time, which bounds the spare room the
+// scanner needs in the newline table
+#define NEWLINE_BATCH 4096
+// Pieces allocated at once, see PieceArena
+#define PIECE_CHUNK 1024
+// Files with at least this much left to index are scanned on all cores,
+// PARALLEL_STEP bytes per core at a time while idle
+#define PARALLEL_THRESHOLD (32 * 1024 * 1024)
+#define PARALLEL_STEP      (16 * 1024 * 1024)
+
 // UI
 #define SIDEBAR_SZ 5
 #define STATUS_SZ 2
 
 // Settings
 #define TAB_SIZE 4
+// Most frames a second sent to the terminal, 0 sends every frame it keeps up with
+#ifndef RENDER_FPS
+#define RENDER_FPS 60
+#endif
 
 // Colors
 #define FG_COLOR       "38;5;15"
 #define BG_COLOR       "48;5;235"
 #define HL_COLOR       "1;33"
+#define KEYWORD_COLOR  "33"
 #define LINE_NUM_COLOR "38;5;245"
 #define PAD_COLOR      "48;5;234"
+#define STATUS_COLOR   "1;30;42"
+#define COMMENT_COLOR  "38;5;108"
+#define STRING_COLOR   "38;5;180"
+#define PREPROC_COLOR  "38;5;140"
+#define MATCH_COLOR    "38;5;235;48;5;179"
 
 // man(4) console_codes
-#define CLEAR()             printf("\033[2J")
-#define CURSOR_RESET()      printf("\033[H")
-#define CURSOR_MOVE_TO(x,y) printf("\033[%zu;%zuH", (y)+1, (x)+1)
+#define CLEAR_SCREEN  "\033[2J"
+#define ERASE_LINE    "\033[K"
+// Synchronized output, the terminal holds the frame until the end marker
+#define SYNC_BEGIN    "\033[?2026h"
+#define SYNC_END      "\033[?2026l"
+#define SYNC_QUERY    "\033[?2026$p"
+#define INDEX         "\033D"
+#define REVERSE_INDEX "\033M"
+#define RESET_REGION  "\033[r"
+#define PASTE_ENABLE  "\033[?2004h"
+#define PASTE_DISABLE "\033[?2004l"
+#define PASTE_BEGIN   "\033[200~"
+#define PASTE_END     "\033[201~"
+
+// Initial size of the frame output buffer per screen cell
+#define FRAME_BYTES_PER_CELL 4
+#define SYNC_QUERY_TIMEOUT_MS 100
+
+// Input
+#define INPUT_CAP 4096
+// How long to wait for the rest of an escape sequence before taking ESC as a key
+#define ESCAPE_TIMEOUT_MS 25
+
+// Unchanged cells shorter than this between two changes are rewritten
+// rather than skipped with a cursor move
+#define DAMAGE_GAP 8
+
+// Length of the longest keyword, see keyword_match
+#define KEYWORD_MAX 8
+// Lines lexed per step when the syntax cache is filled in while idle
+#define SYNTAX_STEP 4096
+// Bytes past the end of a window the lexer looks at, enough to tell that
+// a word running off the window can't be a keyword
+#define LEX_LOOKAHEAD (KEYWORD_MAX + 2)
+
+// Lines at least this long are drawn a window at a time, see ColumnIndex
+#define LONG_LINE (64 * 1024)
+// Columns between the lexer points of a long line
+#define COLUMN_STRIDE 4096
+// Bytes of a long line read at a time while lexing ahead
+#define COLUMN_WINDOW (64 * 1024)
+// Long lines whose lexer points are kept besides the ones on screen
+#define COLUMN_LINES 16
+// Bytes between the display column points of a line, see CellMap
+#define CELL_STRIDE 1024
+// Lines whose display column points are kept besides the ones on screen
+#define CELL_LINES 16
+// Bytes of UTF-8 a cell holds, a char and the combining marks on it
+#define CELL_BYTES 7
+// Longest UTF-8 sequence
+#define UTF8_MAX 4
+
+// Undo journal bytes kept in memory before the oldest half goes to disk
+#define JOURNAL_CAP (4 * 1024 * 1024)
+// Largest deleted run that backspacing keeps extending in place
+#define JOURNAL_MERGE_MAX 256
+// How often the edits of the last while go out to the swap file and are synced
+#define SWAP_SYNC_MS 1000
+
+// Search works through the document in slices of this size
+#define SEARCH_CHUNK (1024 * 1024)
+// How long a jump waits for the search before it goes on in the background
+#define SEARCH_FRAME_MS 16
+// How often the screen is refreshed while a search runs in the background
+#define SEARCH_POLL_MS 50
+
+// Longest pattern the regex parser takes, which bounds its recursion
+#define REGEX_MAX 1024
+// DFA states a regex keeps before its cache is thrown away and rebuilt
+#define REGEX_CACHE_STATES 1024
+// Bytes the regex prefilter scans for its required run at a time
+#define REGEX_WINDOW (64 * 1024)
+// Offsets between the points where runs of the forward program meet
+#define REGEX_CHECKPOINT 64
+
+// Bytes of whole lines a substitute worker rebuilds at a time
+#define SUBSTITUTE_BLOCK (1024 * 1024)
 
 // ASCII Codes
 #define TAB    9
 #define ENTER  10
+#define CTRL_R 18
 #define ESCAPE 27
 #define BSPACE 127
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
+// Latency tracing, compiled in with -DTRACE (see the trace target). Every
+// phase between a key arriving and its frame reaching the terminal is timed
+// into a ring buffer that keeps the most recent TRACE_RING samples.
+#ifdef TRACE
+#define TRACE_RING (1 << 16)
+// Power of two microsecond buckets, the last one takes everything slower
+#define TRACE_BUCKETS 24
+
+typedef enum {
+    TRACE_KEY,
+    TRACE_EDIT,
+    TRACE_UPDATE,
+    TRACE_WRITE,
+    TRACE_RENDER,
+    TRACE_FLUSH,
+    TRACE_PHASES,
+} TracePhase;
+
+const char *trace_phase_names[TRACE_PHASES] = {
+    [TRACE_KEY]    = "key",
+    [TRACE_EDIT]   = "edit",
+    [TRACE_UPDATE] = "update",
+    [TRACE_WRITE]  = "write",
+    [TRACE_RENDER] = "render",
+    [TRACE_FLUSH]  = "flush",
+};
+
+typedef struct {
+    uint64_t start;
+    uint32_t ns;
+    uint32_t phase;
+} TraceSample;
+
+// Writers claim a slot with a single atomic add, so any thread can record
+// without a lock. The oldest samples are overwritten once the ring is full.
+struct {
+    TraceSample samples[TRACE_RING];
+    atomic_size_t head;
+} trace_ring;
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_record(TracePhase phase, uint64_t start)
+{
+    uint64_t ns = trace_now() - start;
+    size_t i = atomic_fetch_add_explicit(&trace_ring.head, 1, memory_order_relaxed);
+    trace_ring.samples[i & (TRACE_RING - 1)] = (TraceSample) {
+        .start = start,
+        .ns = ns > UINT32_MAX ? UINT32_MAX : ns,
+        .phase = phase,
+    };
+}
+
+int trace_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Writes percentiles and a histogram per phase for the samples in the ring
+void trace_dump(FILE *out)
+{
+    size_t head = atomic_load(&trace_ring.head);
+    size_t count = head < TRACE_RING ? head : TRACE_RING;
+    uint32_t *ns = malloc(sizeof(uint32_t) * (count + 1));
+    if (!ns) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+
+    fprintf(out, "Trace of the last %zu samples\n", count);
+    for (int phase = 0; phase < TRACE_PHASES; ++phase) {
+        size_t n = 0;
+        size_t buckets[TRACE_BUCKETS] = {0};
+        for (size_t i = 0; i < count; ++i) {
+            TraceSample *sample = &trace_ring.samples[(head - count + i) & (TRACE_RING - 1)];
+            if (sample->phase != (uint32_t) phase)
+                continue;
+            ns[n++] = sample->ns;
+            size_t b = 0;
+            for (uint32_t us = sample->ns / 1000; us > 0 && b < TRACE_BUCKETS - 1; us >>= 1)
+                b++;
+            buckets[b]++;
+        }
+        if (n == 0)
+            continue;
+
+        qsort(ns, n, sizeof(uint32_t), trace_compare);
+        fprintf(out, "  %-8s %8zu samples  p50 %10.1f us  p99 %10.1f us  max %10.1f us\n",
+                trace_phase_names[phase], n, ns[n / 2] / 1e3, ns[n * 99 / 100] / 1e3, ns[n - 1] / 1e3);
+
+        size_t most = 0;
+        for (size_t b = 0; b < TRACE_BUCKETS; ++b)
+            most = buckets[b] > most ? buckets[b] : most;
+        for (size_t b = 0; b < TRACE_BUCKETS; ++b) {
+            if (buckets[b] == 0)
+                continue;
+            char bar[41];
+            size_t width = (buckets[b] * 40 + most - 1) / most;
+            memset(bar, '#', width);
+            bar[width] = '\0';
+            fprintf(out, "    %s%8lu us %-40s %8zu\n",
+                    b == TRACE_BUCKETS - 1 ? ">=" : "< ", 1ul << (b == TRACE_BUCKETS - 1 ? b - 1 : b), bar, buckets[b]);
+        }
+    }
+    free(ns);
+}
+
+#define TRACE_BEGIN(name) uint64_t trace_##name = trace_now()
+#define TRACE_END(phase, name) trace_record(phase, trace_##name)
+#else
+#define TRACE_BEGIN(name)
+#define TRACE_END(phase, name)
+#endif
+
 void terminal_disable_raw_mode(void)
 {
+    if (write(STDOUT_FILENO, PASTE_DISABLE, strlen(PASTE_DISABLE)) < 0) {
+        fprintf(stderr, "ERROR: Unable to reset terminal.\n");
+    }
     if ((tcsetattr(STDIN_FILENO, TCSAFLUSH, &org_term)) == -1) {
         fprintf(stderr, "ERROR: Unable to reset terminal.\n");
         exit(1);
@@ -61,6 +310,39 @@ void terminal_enable_raw_mode(void)
         fprintf(stderr, "ERROR: Unable to set terminal to raw mode.\n");
         exit(1);
     }
+
+    // Pastes arrive wrapped in markers instead of as a stream of keys
+    if (write(STDOUT_FILENO, PASTE_ENABLE, strlen(PASTE_ENABLE)) < 0) {
+        fprintf(stderr, "ERROR: Unable to enable bracketed paste.\n");
+        exit(1);
+    }
+}
+
+// Asks the terminal whether it supports synchronized output (DECRQM for
+// mode 2026). Terminals that don't know the query stay silent, so the
+// answer is only awaited for a short while.
+int terminal_query_sync(void)
+{
+    if (write(STDOUT_FILENO, SYNC_QUERY, strlen(SYNC_QUERY)) < 0)
+        return 0;
+
+    char buf[64];
+    size_t count = 0;
+    struct pollfd fds = { .fd = STDIN_FILENO, .events = POLLIN };
+    while (count < sizeof(buf) - 1 && poll(&fds, 1, SYNC_QUERY_TIMEOUT_MS) > 0) {
+        ssize_t n = read(STDIN_FILENO, buf + count, sizeof(buf) - 1 - count);
+        if (n <= 0)
+            break;
+        count += n;
+        buf[count] = '\0';
+        if (strchr(buf, 'y'))
+            break;
+    }
+    buf[count] = '\0';
+
+    // Reply is ESC [ ? 2026 ; Ps $ y, where 1 and 2 mean set and reset
+    char *reply = strstr(buf, "\033[?2026;");
+    return reply && (reply[8] == '1' || reply[8] == '2');
 }
 
 typedef enum {
@@ -81,633 +363,6761 @@ typedef struct {
     size_t capacity;
 } Line;
 
+typedef enum {
+    BUF_ORIGINAL,
+    BUF_ADD,
+} BufferKind;
+
+// Backing storage of a piece table. `newlines` holds the offset of every
+// '\n' in `data` in ascending order.
+typedef struct {
+    char *data;
+    size_t count;
+    size_t capacity;
+    size_t *newlines;
+    size_t nl_count;
+    size_t nl_capacity;
+    int mapped;
+    // Bytes mapped, past `count` when room was left for the file to grow
+    size_t reserved;
+    // File a mapped buffer was read from, kept open for saves to copy from
+    int fd;
+} TextBuffer;
+
+// Treap node, ordered by document position. `sub_count` and `sub_lf` are
+// the bytes and newlines of the whole subtree.
+typedef struct Piece {
+    struct Piece *left, *right;
+    unsigned priority;
+    BufferKind buf;
+    size_t start, count;
+    size_t lf_start, lf_count;
+    size_t sub_count, sub_lf;
+} Piece;
+
+// Pieces are carved out of chunks of PIECE_CHUNK. Freed pieces are kept on
+// a free list threaded through `left`, and the chunks are only released
+// together when the document is closed.
+typedef struct PieceChunk {
+    struct PieceChunk *next;
+    size_t used;
+    Piece pieces[PIECE_CHUNK];
+} PieceChunk;
+
+typedef struct {
+    PieceChunk *chunks;
+    Piece *free;
+    size_t live;
+    size_t chunk_count;
+} PieceArena;
+
+// Newline table of one slice of the original buffer, built on its own thread
+typedef struct {
+    TextBuffer table;
+    size_t start, end;
+    pthread_t thread;
+} IndexJob;
+
+// Threads used to index large files, 0 picks one per online core
+size_t index_thread_count;
+
+// Where the lexer is at the end of a line, which is all a line needs to
+// know about the lines above it
+typedef enum {
+    LEX_CODE,
+    LEX_COMMENT,
+    LEX_STRING,
+    LEX_PREPROC,
+    LEX_LINE_COMMENT,
+    // Only inside a line, a character literal ends with it
+    LEX_CHAR,
+} LexState;
+
+// Lexer state at the start of every line. States [0, valid) are known to be
+// right. After an edit the states from `reuse` on are the ones from before
+// it, shifted to their new lines; they become valid again as soon as
+// relexing reaches one of them with the same state.
+typedef struct {
+    unsigned char *states;
+    size_t count;
+    size_t capacity;
+    size_t valid;
+    size_t reuse;
+} SyntaxCache;
+
+// Where lexing can pick up again inside a line: the state, the state a
+// comment returns to, whether only blanks come before `col` and whether a
+// word too long to be a keyword goes on at `col`
+typedef struct {
+    size_t col;
+    unsigned char state;
+    unsigned char after;
+    unsigned char blank;
+    unsigned char word;
+} LexPoint;
+
+// Lexer points about every COLUMN_STRIDE columns along a long line, so a
+// window of it is lexed from the nearest point instead of from the start.
+// The points sit in a gap buffer, [0, gap) and [gap_end, capacity). An edit
+// moves the gap to its column, and the points past it, whose columns are
+// read with `shift` added, go stale. Like the lines of SyntaxCache they are
+// right again once relexing reaches one of them in the same state.
+typedef struct {
+    size_t row;
+    unsigned char start;
+    LexPoint *points;
+    size_t gap, gap_end;
+    size_t capacity;
+    long shift;
+    int stale;
+    // Last use for eviction, 0 when the slot is free
+    size_t used;
+} ColumnIndex;
+
+// Indexes of the long lines used last. There is room for every line on
+// screen, so drawing a frame never evicts one it needs again.
+typedef struct {
+    ColumnIndex *lines;
+    size_t count;
+    size_t clock;
+    Line window;
+} ColumnCache;
+
+// Byte column of a char boundary and the display column it is drawn at
+typedef struct {
+    size_t col, cell;
+} CellPoint;
+
+// Display columns about every CELL_STRIDE bytes along line `row`, as far
+// as the line has been walked. Tabs and wide chars make the display column
+// of a byte depend on everything before it on the line, so a lookup walks
+// from the nearest point instead of from the start. An edit drops the
+// points past it.
+typedef struct {
+    size_t row;
+    CellPoint *points;
+    size_t count, capacity;
+    // Last use for eviction, 0 when the slot is free
+    size_t used;
+} CellMap;
+
+// Maps of the lines used last, with room for every line on screen
+typedef struct {
+    CellMap *lines;
+    size_t count;
+    size_t clock;
+    Line window;
+} CellCache;
+
+// Where a walk along a line wrapped at some width has got to: the char at
+// byte `col` drawn at display column `cell`, on row `row` of the line,
+// which starts at display column `start`
+typedef struct {
+    size_t col, cell;
+    size_t start, row;
+} WrapPoint;
+
+typedef struct {
+    size_t cells;
+    size_t rows;
+    // Rows of a line with wide chars can't be told from its width alone
+    int wide;
+} WrapLine;
+
+// Display width and screen rows of every line for soft-wrap mode, as far
+// as the lines have been measured. The rows are summed in a Fenwick tree,
+// so the screen row of a line and the line at a screen row take O(log n).
+// The lines sit in a gap buffer like the points of ColumnIndex, [0, gap)
+// and [gap_end, capacity) of `lines`, and the slots of the gap count as no
+// rows. Adding or removing lines moves the gap to them a slot at a time.
+typedef struct {
+    WrapLine *lines;
+    // 1-based, tree[i] sums the rows of slots [i - (i & -i), i)
+    size_t *tree;
+    size_t gap, gap_end;
+    size_t capacity;
+    // Width the rows were counted for, they are counted again on a change
+    size_t width;
+    // Edited lines [dirty, dirty_end), measured again before the next use
+    size_t dirty, dirty_end;
+} WrapIndex;
+
+// Document made of the original file contents and an append-only buffer of
+// inserted text. The document is the in-order concatenation of the pieces.
+// Only original[0, scanned) has been indexed and is part of the tree yet.
+typedef struct {
+    TextBuffer buffers[2];
+    PieceArena arena;
+    Piece *root;
+    Piece *last;
+    size_t last_end;
+    size_t scanned;
+    size_t original_end;
+    SyntaxCache syntax;
+    ColumnCache columns;
+    CellCache cells;
+    WrapIndex wrap;
+    size_t version;
+} PieceTable;
+
+// In-order walk over the pieces. `stack` holds the ancestors still to be
+// visited, so stepping to the next piece is amortized O(1).
 typedef struct {
-    Line *data;
+    PieceTable *pt;
+    Piece *piece;
+    size_t offset;
+    Piece **stack;
     size_t count;
     size_t capacity;
-} Lines;
+} PieceIter;
+
+typedef enum {
+    STYLE_TEXT,
+    STYLE_KEYWORD,
+    STYLE_COMMENT,
+    STYLE_STRING,
+    STYLE_PREPROC,
+    STYLE_MATCH,
+    STYLE_LINE_NUMBER,
+    STYLE_LINE_CURRENT,
+    STYLE_PAD,
+    STYLE_STATUS,
+    STYLE_PROMPT,
+    STYLE_COUNT,
+} Style;
+
+// Every style resets the attributes, so a span never depends on what came before
+const char *style_sgr[STYLE_COUNT] = {
+    [STYLE_TEXT]         = "\033[0;"FG_COLOR";"BG_COLOR"m",
+    [STYLE_KEYWORD]      = "\033[0;"KEYWORD_COLOR";"BG_COLOR"m",
+    [STYLE_COMMENT]      = "\033[0;"COMMENT_COLOR";"BG_COLOR"m",
+    [STYLE_STRING]       = "\033[0;"STRING_COLOR";"BG_COLOR"m",
+    [STYLE_PREPROC]      = "\033[0;"PREPROC_COLOR";"BG_COLOR"m",
+    [STYLE_MATCH]        = "\033[0;"MATCH_COLOR"m",
+    [STYLE_LINE_NUMBER]  = "\033[0;"LINE_NUM_COLOR";"BG_COLOR"m",
+    [STYLE_LINE_CURRENT] = "\033[0;"HL_COLOR";"BG_COLOR"m",
+    [STYLE_PAD]          = "\033[0;"LINE_NUM_COLOR";"PAD_COLOR"m",
+    [STYLE_STATUS]       = "\033[0;"STATUS_COLOR"m",
+    [STYLE_PROMPT]       = "\033[0;"HL_COLOR";"BG_COLOR"m",
+};
+
+// A char as UTF-8 with the combining marks on it, padded with NULs. The
+// right half of a wide char is a cell of its own holding CELL_WIDE.
+typedef struct {
+    char ch[CELL_BYTES];
+    unsigned char style;
+} Cell;
+
+_Static_assert(sizeof(Cell) == sizeof(uint64_t), "cells are copied as words");
+
+#define CELL_WIDE '\xff'
+
+// Double-buffered cell grid. Frames are drawn into `back`, `front` holds
+// what the terminal currently shows, and only the cells that differ are
+// sent out. A frame is assembled in `out` and written with one syscall.
+typedef struct {
+    size_t width, height;
+    Cell *front;
+    Cell *back;
+    Line out;
+    int clear;
+    int sync;
+    size_t scroll_top, scroll_bottom;
+    long scroll;
+    size_t frame_bytes;
+    size_t frame_syscalls;
+} Screen;
+
+// Writes frames to the terminal on a thread of its own so a slow terminal
+// never holds up input. The editor hands over a copy of its back buffer.
+// Only the newest frame waits to be drawn, one that the thread hasn't
+// picked up yet is dropped, and frames are at least `frame_ns` apart.
+typedef struct {
+    Screen screen;
+    FILE *out;
+    Cell *cells;
+    size_t width, height;
+    size_t cx, cy;
+    int clear;
+    size_t scroll_top, scroll_bottom;
+    long scroll;
+    int pending;
+    int stop;
+    long frame_ns;
+    size_t frame_bytes;
+    size_t frame_syscalls;
+    size_t drawn, dropped;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Renderer;
 
 typedef struct {
     size_t top, left;
     size_t height, width;
+    size_t sidebar;
+    size_t drawn_top;
+    int guessed;
+    // Soft-wrap mode draws the lines from row `skip` of line `top` on,
+    // which is screen row `top_row` counting from the top of the document
+    int wrap;
+    size_t skip, top_row;
+    // Display column of the cursor and where it goes on the text area
+    size_t cell;
+    size_t cursor_x, cursor_y;
+    Line line;
+    Line styles;
+    // Line drawn on each screen row, SIZE_MAX where none starts
+    Line numbers;
+    PieceIter iter;
+    Screen screen;
+    // Frames go through the render thread when set
+    Renderer *renderer;
+} Viewport;
+
+// Keys past the byte range, decoded from escape sequences
+typedef enum {
+    KEY_UP = 256,
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+    KEY_PASTE,
+    // A multibyte char, its UTF-8 is in `text`
+    KEY_CHAR,
+    KEY_IGNORED,
+} KeyCode;
+
+typedef struct {
+    int code;
+    char text[UTF8_MAX];
+    unsigned char len;
+} Key;
+
+// Bytes read from the terminal that haven't been decoded into keys yet.
+// The text of the last bracketed paste is kept in `paste`. A wait for input
+// also ends when `watch` becomes readable, 0 watches nothing.
+typedef struct {
+    int fd;
+    int watch;
+    unsigned char data[INPUT_CAP];
+    size_t start, count;
+    Line paste;
+} Input;
+
+typedef enum {
+    JOURNAL_INSERT,
+    JOURNAL_DELETE,
+} JournalKind;
+
+// Header of one edit in the journal. The changed bytes follow it, and a
+// trailer with the size of header and bytes makes the log walkable backwards.
+// `first` marks the first edit of an undo group.
+typedef struct {
+    unsigned char kind;
+    unsigned char first;
+    size_t pos, len;
+} JournalRecord;
+
+// Log of every edit, the records before `cursor` are applied and the ones
+// after it can be redone. Offsets are into the whole log: [start, start +
+// mem.count) is in memory, anything before `start` was spilled to `fd`, or
+// dropped up to `floor` when `drop_oldest` is set.
+typedef struct {
+    Line mem;
+    size_t start;
+    size_t floor;
+    size_t cursor;
+    size_t last;
+    int can_merge;
+    int in_group;
+    int fd;
+    int has_file;
+    int drop_oldest;
+    size_t cap;
+    Line scratch;
+} Journal;
+
+#define SWAP_MAGIC "CEASWAP1"
+
+// Start of a swap file, the file its edits apply to. Edits are only
+// replayed onto a file of the same size and modification time.
+typedef struct {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+} SwapHeader;
+
+// Edits since the file was loaded or saved, in `.<name>.cea` next to it so
+// they outlive a crash or a dropped session. An edit is a kind byte, its
+// position and length as varints and the bytes of an insert. Keys only
+// append to `pending`, the thread writes it out and syncs at most every
+// SWAP_SYNC_MS. The file is locked so a second editor on it stays out.
+typedef struct {
+    char *path;
+    int fd;
+    int running;
+    int failed;
+    Line pending;
+    SwapHeader header;
+    int reset;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Swap;
+
+// Follow mode, like tail -f. The file is watched with inotify and what is
+// written to it is taken in without reading it again, the document is only
+// looked at.
+typedef struct {
+    int fd;
+    int active;
+} Follow;
+
+typedef struct {
+    size_t pos, len;
+} Match;
+
+// Matches in ascending order of offset. They may overlap but their ends
+// are ascending as well.
+typedef struct {
+    Match *data;
     size_t count;
     size_t capacity;
-    char *content;
-} Viewport;
+} Matches;
+
+typedef struct {
+    uint64_t bits[4];
+} ByteSet;
+
+typedef enum {
+    RE_BYTES,
+    RE_SPLIT,
+    RE_BOL,
+    RE_EOL,
+    RE_MATCH,
+} ReOp;
+
+// Instruction of a Thompson NFA. RE_BYTES consumes a byte of `set`,
+// RE_SPLIT branches to `out` and `out1`, the anchors only hold at the
+// beginning or the end of a line.
+typedef struct {
+    ReOp op;
+    int out, out1;
+    ByteSet set;
+} ReInst;
+
+typedef enum {
+    RE_NODE_BYTES,
+    RE_NODE_EMPTY,
+    RE_NODE_BOL,
+    RE_NODE_EOL,
+    RE_NODE_CAT,
+    RE_NODE_ALT,
+    RE_NODE_STAR,
+    RE_NODE_PLUS,
+    RE_NODE_QUEST,
+} ReNodeType;
+
+typedef struct {
+    ReNodeType type;
+    int a, b;
+    ByteSet set;
+} ReNode;
+
+typedef struct {
+    const char *pat;
+    size_t n, i;
+    ReNode *nodes;
+    size_t count;
+    const char *error;
+} ReParser;
+
+// A set of NFA instructions reached after the same input
+typedef struct {
+    size_t set, set_count;
+    char accept, accept_eol;
+} DfaState;
+
+// NFA program run as a lazily built DFA. The instruction sets of the states
+// live in `pool` and `table` finds a state by its set. `next` holds the
+// transitions worked out so far, 256 per state and -1 where there is none
+// yet. Once the cache is full it is flushed and built up again from the
+// input at hand, so the memory stays bounded and no input takes more than
+// linear time.
+typedef struct {
+    ReInst *prog;
+    size_t prog_count;
+    int start;
+    DfaState *states;
+    int *next;
+    size_t count;
+    int *pool;
+    size_t pool_count, pool_capacity;
+    int *table;
+    int starts[2];
+    int *scratch;
+    size_t scratch_count;
+    unsigned *mark;
+    unsigned gen;
+    int *stack;
+    size_t flushes;
+} Dfa;
+
+// State of a run of the forward program at a checkpoint, and the end of
+// the longest match it goes on to from there, or SIZE_MAX
+typedef struct {
+    size_t pos, end, stamp;
+    int state;
+} ReVisit;
+
+// Checkpoints the runs on the current line went through. Runs in the same
+// state at the same offset go on the same way, so a later one takes the end
+// the first worked out. `path` holds those of the run going on and `slots`
+// is a hash table of the others, where slots of another line or an earlier
+// DFA cache have a different `stamp`.
+typedef struct {
+    ReVisit *path;
+    size_t path_count, path_capacity;
+    ReVisit *slots;
+    size_t count, capacity;
+    size_t stamp, flushes, covered;
+} ReMemo;
+
+// The forward program finds the longest match from a given start, the
+// reverse one runs from the end of a line to mark where matches start.
+// `required` is a run of bytes every match contains, lines without it are
+// skipped.
+typedef struct {
+    Dfa forward, reverse;
+    Line required;
+    Matches starts;
+    Matches candidates;
+    ReMemo memo;
+    int allow_empty;
+} Regex;
+
+// Contiguous run of the document as the search worker sees it
+typedef struct {
+    const char *data;
+    size_t pos, len;
+} Span;
+
+// Matches of one slice of the document, all of which start before `reach`.
+// A regex chunk takes the lines that begin in it, so a long line can reach
+// into the chunks that follow. A chunk with no line of its own reaches
+// anywhere.
+typedef struct {
+    Matches matches;
+    size_t reach;
+    int done;
+} SearchChunk;
+
+// Search running on a snapshot of the document. The worker scans it one
+// SEARCH_CHUNK at a time, starting at the chunk of the cursor and going in
+// the search direction, and publishes the matches of each chunk under
+// `lock` as soon as it is done. Published chunks don't change while the
+// worker runs. Patterns without special characters are looked for with the
+// substring scanners, others with `regex`. The main thread has a `painter`
+// of its own for lines the worker hasn't got to.
+typedef struct {
+    Line pattern;
+    int is_regex;
+    Regex regex;
+    Regex painter;
+    Matches visible;
+    int forward;
+    int active;
+    int jump;
+    size_t version;
+    Span *spans;
+    size_t span_count;
+    size_t span_capacity;
+    char *copy;
+    size_t size;
+    SearchChunk *chunks;
+    size_t chunk_count;
+    size_t origin;
+    pthread_t thread;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t chunks_done;
+    int cancel;
+    // Edits since the matches were found, as far as search_edit saw them up
+    // to `edit_version`: bytes [dirty, dirty_end) are new, the ones after
+    // them were at `dirty_old_end` on
+    int edited;
+    size_t dirty, dirty_end, dirty_old_end;
+    size_t edit_version;
+} Search;
+
+// Replaces the run of whole lines [pos, pos + len) with `count` bytes of the
+// rebuilt text at `offset`
+typedef struct {
+    size_t pos, len;
+    size_t offset, count;
+} LineEdit;
+
+// Whole lines [start, end) of the document, rebuilt by a substitute worker
+typedef struct {
+    size_t start, end;
+    Line text;
+    LineEdit *edits;
+    size_t edit_count;
+    size_t edit_capacity;
+    size_t replaced;
+    size_t lines;
+} SubstituteBlock;
+
+// A :s command. Workers take the blocks in turn, find the matches and
+// rebuild each line that has one into the block's text in a single pass.
+// Only the edits are left for the main thread.
+typedef struct {
+    PieceTable *pt;
+    const char *pattern;
+    size_t pattern_len;
+    const char *replacement;
+    size_t replacement_len;
+    int is_regex;
+    int global;
+    SubstituteBlock *blocks;
+    size_t block_count;
+    size_t next;
+    pthread_mutex_t lock;
+} Substitute;
 
 typedef struct {
     size_t cx, cy, cx_mem;
     size_t width, height;
     Mode mode;
-    Lines lines;
+    int wrap;
+    PieceTable text;
+    Journal journal;
+    Swap swap;
+    Follow follow;
+    Search search;
+    Line prompt;
     const char *filename;
+    size_t repeat;
+    char pending;
+    char message[256];
 } Editor;
 
-char *keywords[] = {
-    "if",
-    "else",
-    "for",
-    "while",
-    "return",
-    "#include",
-    "sizeof"
-};
+void line_init(Line *line)
+{
+    line->count = 0;
+    line->capacity = 0;
+    line->data = NULL;
+}
 
-void viewport_insert(Viewport *v, char c) {
-    if (v->capacity < v->count + 1) {
-        v->capacity = v->capacity == 0 ? INIT_CAP : v->capacity * 2;
-        v->content = realloc(v->content, sizeof(char) * v->capacity);
-        if (!v->content) {
+void line_reserve(Line *line, size_t capacity)
+{
+    if (line->capacity < capacity) {
+        while (line->capacity < capacity)
+            line->capacity = line->capacity == 0 ? INIT_CAP : line->capacity * 2;
+        line->data = realloc(line->data, sizeof(char) * line->capacity);
+        if (!line->data) {
             fprintf(stderr, "ERROR: Not enough memory...\n");
             exit(1);
         }
     }
+}
+
+void line_append(Line *line, char c)
+{
+    line_reserve(line, line->count + 1);
+    line->data[line->count++] = c;
+}
+
+void line_append_str(Line *line, const char *str, size_t len)
+{
+    line_reserve(line, line->count + len);
+    memcpy(line->data + line->count, str, len);
+    line->count += len;
+}
+
+void line_free(Line *line)
+{
+    if (line->data) {
+        free(line->data);
+        line->count = 0;
+        line->capacity = 0;
+        line->data = NULL;
+    }
+}
+
+// Code point a byte that doesn't start a valid sequence decodes to
+#define UTF8_INVALID 0xfffd
+
+// Length of the UTF-8 sequence that `lead` starts, 0 when it can't start one
+size_t utf8_length(unsigned char lead)
+{
+    if (lead < 0x80)
+        return 1;
+    if (lead < 0xc2)
+        return 0;
+    if (lead < 0xe0)
+        return 2;
+    if (lead < 0xf0)
+        return 3;
+    if (lead < 0xf5)
+        return 4;
+    return 0;
+}
+
+// Decodes the char at the start of data[0, n) into `cp` and returns its
+// length. A byte that doesn't start a valid sequence is a char of its own.
+size_t utf8_decode(const char *data, size_t n, uint32_t *cp)
+{
+    const unsigned char *s = (const unsigned char *) data;
+    size_t len = utf8_length(s[0]);
+    *cp = UTF8_INVALID;
+    if (len == 1)
+        *cp = s[0];
+    if (len <= 1 || len > n)
+        return 1;
+
+    uint32_t c = s[0] & (0x7f >> len);
+    for (size_t i = 1; i < len; ++i) {
+        if ((s[i] & 0xc0) != 0x80)
+            return 1;
+        c = c << 6 | (s[i] & 0x3f);
+    }
+    // Overlong forms and surrogates
+    static const uint32_t least[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    if (c < least[len] || (c >= 0xd800 && c < 0xe000) || c > 0x10ffff)
+        return 1;
+    *cp = c;
+    return len;
+}
+
+typedef struct {
+    uint32_t first, last;
+} CharRange;
+
+// Combining marks and other chars drawn on top of the one before them
+const CharRange zero_width[] = {
+    { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x05bf, 0x05bf },
+    { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 }, { 0x05c7, 0x05c7 }, { 0x0610, 0x061a },
+    { 0x064b, 0x065f }, { 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+    { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0e31, 0x0e31 }, { 0x0e34, 0x0e3a },
+    { 0x0e47, 0x0e4e }, { 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff }, { 0x200b, 0x200f },
+    { 0x202a, 0x202e }, { 0x2060, 0x2064 }, { 0x20d0, 0x20ff }, { 0xfe00, 0xfe0f },
+    { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0xe0100, 0xe01ef },
+};
+
+// East Asian wide and fullwidth chars, which take two columns
+const CharRange wide[] = {
+    { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x23e9, 0x23ec },
+    { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 }, { 0x25fd, 0x25fe }, { 0x2614, 0x2615 },
+    { 0x2648, 0x2653 }, { 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+    { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 }, { 0x26ce, 0x26ce },
+    { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea }, { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 },
+    { 0x26fa, 0x26fa }, { 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+    { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e }, { 0x2753, 0x2755 },
+    { 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf },
+    { 0x2b1b, 0x2b1c }, { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x303e },
+    { 0x3041, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+    { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 },
+    { 0xfe30, 0xfe6f }, { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 },
+    { 0x17000, 0x18aff }, { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 }, { 0x1f0cf, 0x1f0cf },
+    { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a }, { 0x1f200, 0x1f251 }, { 0x1f300, 0x1f64f },
+    { 0x1f680, 0x1f6ff }, { 0x1f900, 0x1f9ff }, { 0x1fa70, 0x1faff }, { 0x20000, 0x2fffd },
+    { 0x30000, 0x3fffd },
+};
+
+int char_in(const CharRange *ranges, size_t count, uint32_t cp)
+{
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (ranges[mid].last < cp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < count && ranges[lo].first <= cp;
+}
+
+// Columns a char takes on the terminal. Control chars and invalid bytes are
+// drawn as a placeholder, see screen_char.
+size_t char_width(uint32_t cp)
+{
+    if (cp < 0x300)
+        return 1;
+    if (char_in(zero_width, sizeof(zero_width) / sizeof(zero_width[0]), cp))
+        return 0;
+    if (char_in(wide, sizeof(wide) / sizeof(wide[0]), cp))
+        return 2;
+    return 1;
+}
+
+// Moves `*i` past the char at data[*i], which is drawn at display column
+// `cell`, and returns the display column after it. Tabs run up to the next
+// multiple of TAB_SIZE.
+size_t cell_next(const char *data, size_t n, size_t *i, size_t cell)
+{
+    unsigned char c = data[*i];
+    if (c < 0x80) {
+        ++*i;
+        return c == '\t' ? cell + TAB_SIZE - cell % TAB_SIZE : cell + 1;
+    }
+    uint32_t cp;
+    *i += utf8_decode(&data[*i], n - *i, &cp);
+    return cell + char_width(cp);
+}
+
+// Walks data[*i, end), starting at display column `cell`, a char at a time
+// and stops before the first char that runs past byte `col` or display
+// column `to`. Returns the display column it stopped at. Chars are decoded
+// up to byte `n`, so a sequence cut by `end` is still read whole.
+size_t cell_walk(const char *data, size_t n, size_t end, size_t *i, size_t cell, size_t col, size_t to)
+{
+    while (*i < end) {
+        size_t j = *i;
+        size_t next = cell_next(data, n, &j, cell);
+        if (j > col || next > to)
+            break;
+        *i = j;
+        cell = next;
+    }
+    return cell;
+}
 
-    v->content[v->count++] = c;
+// Puts the char at `at`, which ends at display column `next`, on the row it
+// is drawn on when wrapping at `width` columns. A row takes `width` columns
+// from where it starts, but a wide char cut by its end starts the next row.
+// Combining marks stay with the char before them.
+void wrap_place(WrapPoint *at, size_t next, int wide, size_t width)
+{
+    if (next == at->cell)
+        return;
+    while (at->cell >= at->start + width) {
+        at->start += width;
+        at->row++;
+    }
+    if (wide && width > 1 && at->cell + 1 == at->start + width) {
+        at->start = at->cell;
+        at->row++;
+    }
 }
 
-void viewport_insert_cstr(Viewport *v, const char *str) {
-    for (size_t i = 0; i < strlen(str); ++i) {
-        viewport_insert(v, str[i]);
+// Walks data[*i, end) of a line wrapped at `width` columns, decoding chars
+// up to byte `n`, and stops at the first char on row `row` or below it.
+// Returns whether a wide char was passed.
+int wrap_walk(WrapPoint *at, const char *data, size_t n, size_t end, size_t *i, size_t width, size_t row)
+{
+    int wide = 0;
+    while (*i < end) {
+        size_t j = *i;
+        size_t next = cell_next(data, n, &j, at->cell);
+        int two = next == at->cell + 2 && data[*i] != '\t';
+        wrap_place(at, next, two, width);
+        if (at->row >= row)
+            break;
+        wide |= two;
+        at->cell = next;
+        *i = j;
     }
+    return wide;
+}
+
+// Display column row `row` starts at, from a walk that got to `at`. The rows
+// past the last char only hold the rest of a tab.
+size_t wrap_start(WrapPoint *at, size_t row, size_t width)
+{
+    if (at->row >= row)
+        return at->start - (at->row - row) * width;
+    return at->start + (row - at->row) * width;
+}
+
+// Rows of a line walked to its end at `at`
+size_t wrap_rows(WrapPoint *at, size_t width)
+{
+    if (at->cell <= at->start + width)
+        return at->row + 1;
+    return at->row + 1 + (at->cell - at->start - 1) / width;
+}
+
+void matches_push(Matches *m, size_t pos, size_t len)
+{
+    if (m->capacity < m->count + 1) {
+        m->capacity = m->capacity == 0 ? INIT_CAP : m->capacity * 2;
+        m->data = realloc(m->data, sizeof(Match) * m->capacity);
+        if (!m->data) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+    }
+
+    m->data[m->count++] = (Match) { .pos = pos, .len = len };
+}
+
+void matches_free(Matches *m)
+{
+    free(m->data);
+    memset(m, 0, sizeof(*m));
+}
+
+// Writes the offset of every '\n' in data[0, len), shifted by `base`, to
+// `out` and returns how many were found. `out` must have room for `len`
+// entries, which lets the scanners store without bounds checks.
+typedef size_t (*NewlineScanner)(const char *data, size_t len, size_t base, size_t *out);
+
+size_t newline_scan_scalar(const char *data, size_t len, size_t base, size_t *out)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        out[n] = base + i;
+        n += data[i] == '\n';
+    }
+    return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t newline_scan_sse2(const char *data, size_t len, size_t base, size_t *out)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t n = 0, i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+        while (mask) {
+            out[n++] = base + i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + newline_scan_scalar(data + i, len - i, base + i, out + n);
+}
+
+__attribute__((target("avx2")))
+size_t newline_scan_avx2(const char *data, size_t len, size_t base, size_t *out)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t n = 0, i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *) (data + i + 32));
+        unsigned long long mask =
+            (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl)) |
+            (unsigned long long) (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl)) << 32;
+        while (mask) {
+            out[n++] = base + i + __builtin_ctzll(mask);
+            mask &= mask - 1;
+        }
+    }
+    return n + newline_scan_sse2(data + i, len - i, base + i, out + n);
+}
+#endif
+
+NewlineScanner newline_scanner;
+
+// Picks the widest scanner the CPU supports
+NewlineScanner newline_scanner_get(void)
+{
+    if (!newline_scanner) {
+        newline_scanner = newline_scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            newline_scanner = newline_scan_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            newline_scanner = newline_scan_sse2;
+#endif
+    }
+    return newline_scanner;
+}
+
+// Appends base + i to `out` for every i in [0, starts) where the `n` byte
+// pattern occurs in `data`, which must be readable up to starts + n - 1.
+// The vector versions only compare the rest of the pattern at positions
+// where both its first and its last byte match.
+typedef void (*SubstringScanner)(const char *data, size_t starts, const char *pat, size_t n, size_t base, Matches *out);
+
+void substring_scan_scalar(const char *data, size_t starts, const char *pat, size_t n, size_t base, Matches *out)
+{
+    const char *p = data, *end = data + starts;
+    while (p < end && (p = memchr(p, pat[0], end - p))) {
+        if (memcmp(p + 1, pat + 1, n - 1) == 0)
+            matches_push(out, base + (p - data), n);
+        p++;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void substring_scan_sse2(const char *data, size_t starts, const char *pat, size_t n, size_t base, Matches *out)
+{
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[n - 1]);
+    size_t i = 0;
+    for (; i + 16 <= starts; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *) (data + i + n - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        while (mask) {
+            size_t j = i + __builtin_ctz(mask);
+            if (n <= 2 || memcmp(data + j + 1, pat + 1, n - 2) == 0)
+                matches_push(out, base + j, n);
+            mask &= mask - 1;
+        }
+    }
+    substring_scan_scalar(data + i, starts - i, pat, n, base + i, out);
+}
+
+__attribute__((target("avx2")))
+void substring_scan_avx2(const char *data, size_t starts, const char *pat, size_t n, size_t base, Matches *out)
+{
+    const __m256i first = _mm256_set1_epi8(pat[0]);
+    const __m256i last = _mm256_set1_epi8(pat[n - 1]);
+    size_t i = 0;
+    for (; i + 32 <= starts; i += 32) {
+        __m256i head = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *) (data + i + n - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+        while (mask) {
+            size_t j = i + __builtin_ctz(mask);
+            if (n <= 2 || memcmp(data + j + 1, pat + 1, n - 2) == 0)
+                matches_push(out, base + j, n);
+            mask &= mask - 1;
+        }
+    }
+    substring_scan_sse2(data + i, starts - i, pat, n, base + i, out);
+}
+#endif
+
+SubstringScanner substring_scanner;
+
+SubstringScanner substring_scanner_get(void)
+{
+    if (!substring_scanner) {
+        substring_scanner = substring_scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            substring_scanner = substring_scan_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            substring_scanner = substring_scan_sse2;
+#endif
+    }
+    return substring_scanner;
+}
+
+void byteset_add(ByteSet *set, unsigned char c)
+{
+    set->bits[c >> 6] |= (uint64_t) 1 << (c & 63);
+}
+
+int byteset_has(const ByteSet *set, unsigned char c)
+{
+    return (set->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+void byteset_add_range(ByteSet *set, unsigned char lo, unsigned char hi)
+{
+    for (unsigned c = lo; c <= hi; ++c)
+        byteset_add(set, c);
+}
+
+void byteset_union(ByteSet *set, const ByteSet *other)
+{
+    for (size_t i = 0; i < 4; ++i)
+        set->bits[i] |= other->bits[i];
+}
+
+// Complements the set. Newlines stay out, matches never span lines.
+void byteset_negate(ByteSet *set)
+{
+    for (size_t i = 0; i < 4; ++i)
+        set->bits[i] = ~set->bits[i];
+    set->bits['\n' >> 6] &= ~((uint64_t) 1 << ('\n' & 63));
+}
+
+// Whether the pattern has no special characters and can be searched for as is
+int regex_is_literal(const char *pat, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (strchr("\\.^$*+?()[]|", pat[i]))
+            return 0;
+    }
+    return 1;
+}
+
+int re_node(ReParser *p, ReNodeType type, int a, int b)
+{
+    p->nodes[p->count] = (ReNode) { .type = type, .a = a, .b = b };
+    return p->count++;
+}
+
+// The set of an escape such as \d or \w, or the escaped byte itself
+ByteSet re_escape(char c)
+{
+    ByteSet set = {0};
+    switch (c) {
+        case 'd':
+        case 'D':
+            byteset_add_range(&set, '0', '9');
+            break;
+        case 'w':
+        case 'W':
+            byteset_add_range(&set, 'a', 'z');
+            byteset_add_range(&set, 'A', 'Z');
+            byteset_add_range(&set, '0', '9');
+            byteset_add(&set, '_');
+            break;
+        case 's':
+        case 'S':
+            byteset_add(&set, ' ');
+            byteset_add_range(&set, '\t', '\r');
+            break;
+        case 't':
+            byteset_add(&set, '\t');
+            break;
+        default:
+            byteset_add(&set, c);
+            break;
+    }
+    if (c == 'D' || c == 'W' || c == 'S')
+        byteset_negate(&set);
+    return set;
+}
+
+// Parses the inside of [...], the opening bracket already read
+int re_parse_class(ReParser *p)
+{
+    ByteSet set = {0};
+    int negate = p->i < p->n && p->pat[p->i] == '^';
+    p->i += negate;
+    for (size_t first = p->i; p->i < p->n && (p->pat[p->i] != ']' || p->i == first);) {
+        unsigned char lo = p->pat[p->i++];
+        if (lo == '\\' && p->i < p->n) {
+            ByteSet escaped = re_escape(p->pat[p->i++]);
+            byteset_union(&set, &escaped);
+            continue;
+        }
+        if (p->i + 1 < p->n && p->pat[p->i] == '-' && p->pat[p->i + 1] != ']') {
+            unsigned char hi = p->pat[p->i + 1];
+            p->i += 2;
+            if (hi < lo) {
+                p->error = "invalid range";
+                return -1;
+            }
+            byteset_add_range(&set, lo, hi);
+        } else {
+            byteset_add(&set, lo);
+        }
+    }
+    if (p->i >= p->n) {
+        p->error = "missing ]";
+        return -1;
+    }
+    p->i++;
+
+    if (negate)
+        byteset_negate(&set);
+    int node = re_node(p, RE_NODE_BYTES, -1, -1);
+    p->nodes[node].set = set;
+    return node;
+}
+
+int re_parse_alt(ReParser *p);
+
+int re_parse_atom(ReParser *p)
+{
+    char c = p->pat[p->i++];
+    int node;
+    switch (c) {
+        case '(':
+            node = re_parse_alt(p);
+            if (node < 0)
+                return -1;
+            if (p->i >= p->n || p->pat[p->i] != ')') {
+                p->error = "missing )";
+                return -1;
+            }
+            p->i++;
+            return node;
+        case '[':
+            return re_parse_class(p);
+        case '^':
+            return re_node(p, RE_NODE_BOL, -1, -1);
+        case '$':
+            return re_node(p, RE_NODE_EOL, -1, -1);
+        case '*':
+        case '+':
+        case '?':
+            p->error = "nothing to repeat";
+            return -1;
+    }
+
+    node = re_node(p, RE_NODE_BYTES, -1, -1);
+    if (c == '.') {
+        byteset_negate(&p->nodes[node].set);
+    } else if (c == '\\' && p->i < p->n) {
+        p->nodes[node].set = re_escape(p->pat[p->i++]);
+    } else {
+        byteset_add(&p->nodes[node].set, c);
+    }
+    return node;
+}
+
+int re_parse_repeat(ReParser *p)
+{
+    int node = re_parse_atom(p);
+    while (node >= 0 && p->i < p->n && strchr("*+?", p->pat[p->i])) {
+        ReNodeType type = p->nodes[node].type;
+        if (type == RE_NODE_BOL || type == RE_NODE_EOL) {
+            p->error = "nothing to repeat";
+            return -1;
+        }
+        char c = p->pat[p->i++];
+        node = re_node(p, c == '*' ? RE_NODE_STAR : c == '+' ? RE_NODE_PLUS : RE_NODE_QUEST, node, -1);
+    }
+    return node;
+}
+
+int re_parse_cat(ReParser *p)
+{
+    int node = -1;
+    while (p->i < p->n && p->pat[p->i] != '|' && p->pat[p->i] != ')') {
+        int next = re_parse_repeat(p);
+        if (next < 0)
+            return -1;
+        node = node < 0 ? next : re_node(p, RE_NODE_CAT, node, next);
+    }
+    return node < 0 ? re_node(p, RE_NODE_EMPTY, -1, -1) : node;
+}
+
+int re_parse_alt(ReParser *p)
+{
+    int node = re_parse_cat(p);
+    while (node >= 0 && p->i < p->n && p->pat[p->i] == '|') {
+        p->i++;
+        int next = re_parse_cat(p);
+        if (next < 0)
+            return -1;
+        node = re_node(p, RE_NODE_ALT, node, next);
+    }
+    return node;
+}
+
+int dfa_inst(Dfa *d, ReOp op, int out, int out1)
+{
+    d->prog[d->prog_count] = (ReInst) { .op = op, .out = out, .out1 = out1 };
+    return d->prog_count++;
+}
+
+// Emits `node` followed by `next` and returns where it begins. The reverse
+// program matches the reversed text, so sequences run backwards and the
+// anchors trade places.
+int dfa_emit(Dfa *d, ReParser *p, int node, int next, int reverse)
+{
+    ReNode *n = &p->nodes[node];
+    int i;
+    switch (n->type) {
+        case RE_NODE_BYTES:
+            i = dfa_inst(d, RE_BYTES, next, -1);
+            d->prog[i].set = n->set;
+            return i;
+        case RE_NODE_EMPTY:
+            return next;
+        case RE_NODE_BOL:
+            return dfa_inst(d, reverse ? RE_EOL : RE_BOL, next, -1);
+        case RE_NODE_EOL:
+            return dfa_inst(d, reverse ? RE_BOL : RE_EOL, next, -1);
+        case RE_NODE_CAT:
+            if (reverse)
+                return dfa_emit(d, p, n->b, dfa_emit(d, p, n->a, next, reverse), reverse);
+            return dfa_emit(d, p, n->a, dfa_emit(d, p, n->b, next, reverse), reverse);
+        case RE_NODE_ALT:
+            i = dfa_emit(d, p, n->a, next, reverse);
+            return dfa_inst(d, RE_SPLIT, i, dfa_emit(d, p, n->b, next, reverse));
+        case RE_NODE_QUEST:
+            return dfa_inst(d, RE_SPLIT, dfa_emit(d, p, n->a, next, reverse), next);
+        case RE_NODE_STAR:
+        case RE_NODE_PLUS:
+            i = dfa_inst(d, RE_SPLIT, -1, next);
+            d->prog[i].out = dfa_emit(d, p, n->a, i, reverse);
+            return n->type == RE_NODE_STAR ? i : d->prog[i].out;
+    }
+    return next;
+}
+
+void dfa_flush(Dfa *d)
+{
+    d->count = 0;
+    d->pool_count = 0;
+    memset(d->table, 0xff, sizeof(int) * 2 * REGEX_CACHE_STATES);
+    d->starts[0] = d->starts[1] = -1;
+    d->flushes++;
+}
+
+// Compiles the parsed pattern. The reverse program may start anywhere
+// before the end of the line, so it loops over any byte first.
+void dfa_init(Dfa *d, ReParser *p, int root, int reverse)
+{
+    memset(d, 0, sizeof(*d));
+    d->prog = malloc(sizeof(ReInst) * (2 * p->count + 3));
+    d->states = malloc(sizeof(DfaState) * REGEX_CACHE_STATES);
+    d->next = malloc(sizeof(int) * 256 * REGEX_CACHE_STATES);
+    d->table = malloc(sizeof(int) * 2 * REGEX_CACHE_STATES);
+    if (!d->prog || !d->states || !d->next || !d->table) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+
+    d->start = dfa_emit(d, p, root, dfa_inst(d, RE_MATCH, -1, -1), reverse);
+    if (reverse) {
+        int loop = dfa_inst(d, RE_SPLIT, -1, d->start);
+        d->prog[loop].out = dfa_inst(d, RE_BYTES, loop, -1);
+        memset(&d->prog[d->prog[loop].out].set, 0xff, sizeof(ByteSet));
+        d->start = loop;
+    }
+
+    d->scratch = malloc(sizeof(int) * d->prog_count);
+    d->mark = calloc(d->prog_count, sizeof(unsigned));
+    d->stack = malloc(sizeof(int) * (2 * d->prog_count + 1));
+    if (!d->scratch || !d->mark || !d->stack) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    dfa_flush(d);
+    d->flushes = 0;
+}
+
+void dfa_free(Dfa *d)
+{
+    free(d->prog);
+    free(d->states);
+    free(d->next);
+    free(d->pool);
+    free(d->table);
+    free(d->scratch);
+    free(d->mark);
+    free(d->stack);
+    memset(d, 0, sizeof(*d));
+}
+
+#define AT_BOL 1
+#define AT_EOL 2
+
+// Adds the instructions reachable from `pc` without consuming input to the
+// scratch set. Anchors that don't hold here are dropped, except for $ which
+// is kept in case the line ends next.
+void dfa_closure(Dfa *d, int pc, int flags)
+{
+    size_t top = 0;
+    d->stack[top++] = pc;
+    while (top > 0) {
+        pc = d->stack[--top];
+        if (d->mark[pc] == d->gen)
+            continue;
+        d->mark[pc] = d->gen;
+
+        ReInst *inst = &d->prog[pc];
+        switch (inst->op) {
+            case RE_SPLIT:
+                d->stack[top++] = inst->out1;
+                d->stack[top++] = inst->out;
+                break;
+            case RE_BOL:
+                if (flags & AT_BOL)
+                    d->stack[top++] = inst->out;
+                break;
+            case RE_EOL:
+                if (flags & AT_EOL) {
+                    d->stack[top++] = inst->out;
+                    break;
+                }
+                d->scratch[d->scratch_count++] = pc;
+                break;
+            case RE_BYTES:
+            case RE_MATCH:
+                d->scratch[d->scratch_count++] = pc;
+                break;
+        }
+    }
+}
+
+int compare_ints(const void *a, const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+// Finds or adds the state of the scratch set
+int dfa_intern(Dfa *d)
+{
+    int *set = d->scratch;
+    size_t n = d->scratch_count;
+    qsort(set, n, sizeof(int), compare_ints);
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; ++i)
+        hash = (hash ^ (unsigned) set[i]) * 1099511628211ULL;
+    size_t mask = 2 * REGEX_CACHE_STATES - 1;
+    size_t slot = hash & mask;
+    for (; d->table[slot] >= 0; slot = (slot + 1) & mask) {
+        DfaState *st = &d->states[d->table[slot]];
+        if (st->set_count == n && memcmp(d->pool + st->set, set, sizeof(int) * n) == 0)
+            return d->table[slot];
+    }
+
+    if (d->count == REGEX_CACHE_STATES) {
+        dfa_flush(d);
+        for (slot = hash & mask; d->table[slot] >= 0; slot = (slot + 1) & mask)
+            ;
+    }
+    if (d->pool_capacity < d->pool_count + n) {
+        while (d->pool_capacity < d->pool_count + n)
+            d->pool_capacity = d->pool_capacity == 0 ? INIT_CAP : d->pool_capacity * 2;
+        d->pool = realloc(d->pool, sizeof(int) * d->pool_capacity);
+        if (!d->pool) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+    }
+
+    int index = d->count++;
+    DfaState *st = &d->states[index];
+    memset(d->next + ((size_t) index << 8), 0xff, sizeof(int) * 256);
+    st->set = d->pool_count;
+    st->set_count = n;
+    memcpy(d->pool + d->pool_count, set, sizeof(int) * n);
+    d->pool_count += n;
+
+    // Whether the state matches here, or would if the line ended here
+    st->accept = 0;
+    d->gen++;
+    d->scratch_count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        ReInst *inst = &d->prog[d->pool[st->set + i]];
+        if (inst->op == RE_MATCH)
+            st->accept = 1;
+        else if (inst->op == RE_EOL)
+            dfa_closure(d, inst->out, AT_EOL);
+    }
+    st->accept_eol = st->accept;
+    for (size_t i = 0; i < d->scratch_count; ++i)
+        st->accept_eol |= d->prog[d->scratch[i]].op == RE_MATCH;
+
+    d->table[slot] = index;
+    return index;
+}
+
+// State before any input, at the beginning of a line or in the middle of one
+int dfa_start(Dfa *d, int bol)
+{
+    if (d->starts[bol] < 0) {
+        d->gen++;
+        d->scratch_count = 0;
+        dfa_closure(d, d->start, bol ? AT_BOL : 0);
+        int index = dfa_intern(d);
+        d->starts[bol] = index;
+    }
+    return d->starts[bol];
+}
+
+// Works out the transition of state `from` on byte `c` and caches it
+int dfa_transition(Dfa *d, int from, unsigned char c)
+{
+    DfaState *st = &d->states[from];
+    d->gen++;
+    d->scratch_count = 0;
+    for (size_t i = 0; i < st->set_count; ++i) {
+        ReInst *inst = &d->prog[d->pool[st->set + i]];
+        if (inst->op == RE_BYTES && byteset_has(&inst->set, c))
+            dfa_closure(d, inst->out, 0);
+    }
+
+    size_t flushes = d->flushes;
+    int to = dfa_intern(d);
+    // After a flush `from` is gone
+    if (d->flushes == flushes)
+        d->next[((size_t) from << 8) | c] = to;
+    return to;
+}
+
+int dfa_step(Dfa *d, int from, unsigned char c)
+{
+    int to = d->next[((size_t) from << 8) | c];
+    return to >= 0 ? to : dfa_transition(d, from, c);
+}
+
+// Finds the longest run of single bytes in the sequence at the top of the
+// pattern. `run` holds the one that is still going.
+void re_required(ReParser *p, int node, Line *run, Line *best)
+{
+    ReNode *n = &p->nodes[node];
+    if (n->type == RE_NODE_CAT) {
+        re_required(p, n->a, run, best);
+        re_required(p, n->b, run, best);
+        return;
+    }
+
+    int c = -1;
+    if (n->type == RE_NODE_BYTES) {
+        for (int b = 0; b < 256; ++b) {
+            if (!byteset_has(&n->set, b))
+                continue;
+            c = c < 0 ? b : 256;
+        }
+    }
+    if (c >= 0 && c < 256) {
+        line_append(run, c);
+        if (run->count > best->count) {
+            best->count = 0;
+            line_append_str(best, run->data, run->count);
+        }
+    } else if (n->type != RE_NODE_EMPTY) {
+        run->count = 0;
+    }
+}
+
+// Compiles `pat`. Returns 0, or -1 with a description of what is wrong
+// with the pattern in `error`.
+int regex_compile(Regex *re, const char *pat, size_t n, const char **error)
+{
+    memset(re, 0, sizeof(*re));
+    if (n > REGEX_MAX) {
+        *error = "pattern too long";
+        return -1;
+    }
+
+    // Every byte of the pattern adds at most two nodes
+    ReParser p = { .pat = pat, .n = n };
+    p.nodes = calloc(2 * n + 1, sizeof(ReNode));
+    if (!p.nodes) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    int root = re_parse_alt(&p);
+    if (!p.error && p.i < n)
+        p.error = "unmatched )";
+    if (p.error) {
+        *error = p.error;
+        free(p.nodes);
+        return -1;
+    }
+
+    dfa_init(&re->forward, &p, root, 0);
+    dfa_init(&re->reverse, &p, root, 1);
+    Line run = {0};
+    re_required(&p, root, &run, &re->required);
+    line_free(&run);
+    free(p.nodes);
+    return 0;
+}
+
+void regex_free(Regex *re)
+{
+    dfa_free(&re->forward);
+    dfa_free(&re->reverse);
+    line_free(&re->required);
+    matches_free(&re->starts);
+    matches_free(&re->candidates);
+    free(re->memo.path);
+    free(re->memo.slots);
+}
+
+// Forgets the checkpoints, which were taken on another line or with the
+// states of an earlier DFA cache
+void re_memo_reset(ReMemo *m, size_t flushes)
+{
+    m->stamp++;
+    m->count = 0;
+    m->covered = 0;
+    m->flushes = flushes;
+}
+
+size_t re_memo_slot(ReMemo *m, size_t pos, int state)
+{
+    uint64_t hash = ((uint64_t) pos * 1099511628211ULL) ^ (unsigned) state;
+    return (hash * 11400714819323198485ULL >> 32) & (m->capacity - 1);
+}
+
+ReVisit *re_memo_find(ReMemo *m, size_t pos, int state)
+{
+    if (m->capacity == 0)
+        return NULL;
+    for (size_t i = re_memo_slot(m, pos, state);; i = (i + 1) & (m->capacity - 1)) {
+        ReVisit *v = &m->slots[i];
+        if (v->stamp != m->stamp)
+            return NULL;
+        if (v->pos == pos && v->state == state)
+            return v;
+    }
+}
+
+void re_memo_add(ReMemo *m, ReVisit v)
+{
+    if (2 * (m->count + 1) > m->capacity) {
+        ReVisit *old = m->slots;
+        size_t capacity = m->capacity;
+        m->capacity = capacity == 0 ? 64 : capacity * 2;
+        m->slots = calloc(m->capacity, sizeof(ReVisit));
+        if (!m->slots) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+        m->count = 0;
+        for (size_t i = 0; i < capacity; ++i)
+            if (old[i].stamp == m->stamp)
+                re_memo_add(m, old[i]);
+        free(old);
+    }
+
+    size_t i = re_memo_slot(m, v.pos, v.state);
+    while (m->slots[i].stamp == m->stamp)
+        i = (i + 1) & (m->capacity - 1);
+    v.stamp = m->stamp;
+    m->slots[i] = v;
+    m->count++;
+    if (m->covered <= v.pos)
+        m->covered = v.pos + 1;
+}
+
+void re_memo_push(ReMemo *m, size_t pos, int state)
+{
+    if (m->path_capacity < m->path_count + 1) {
+        m->path_capacity = m->path_capacity == 0 ? INIT_CAP : m->path_capacity * 2;
+        m->path = realloc(m->path, sizeof(ReVisit) * m->path_capacity);
+        if (!m->path) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+    }
+    m->path[m->path_count++] = (ReVisit) { .pos = pos, .end = SIZE_MAX, .state = state };
+}
+
+// Returns the end of the longest match from `s`, where a match starts.
+// Checkpoints from `keep` on are noted for the runs still to come, so each
+// offset is only run over again in states no run was in there before.
+size_t regex_longest(Regex *re, const char *line, size_t len, size_t s, size_t keep)
+{
+    Dfa *f = &re->forward;
+    ReMemo *m = &re->memo;
+    int st = dfa_start(f, s == 0);
+    size_t flushes = f->flushes;
+    if (m->flushes != flushes)
+        re_memo_reset(m, flushes);
+
+    m->path_count = 0;
+    size_t last = s, end = SIZE_MAX;
+    for (size_t i = s;; ++i) {
+        DfaState *ds = &f->states[st];
+        if (i % REGEX_CHECKPOINT == 0 && f->flushes == flushes) {
+            ReVisit *v = i < m->covered ? re_memo_find(m, i, st) : NULL;
+            if (v) {
+                end = v->end;
+                break;
+            }
+            if (i >= keep)
+                re_memo_push(m, i, st);
+        }
+        if (ds->accept || (i == len && ds->accept_eol)) {
+            last = i;
+            if (m->path_count > 0)
+                m->path[m->path_count - 1].end = i;
+        }
+        if (i == len || ds->set_count == 0)
+            break;
+        st = dfa_step(f, st, line[i]);
+    }
+    if (end != SIZE_MAX)
+        last = end;
+
+    // The states on the path are gone if the cache was flushed on the way
+    if (f->flushes != flushes)
+        return last;
+    for (size_t j = m->path_count; j-- > 0;) {
+        ReVisit *v = &m->path[j];
+        if (end != SIZE_MAX)
+            v->end = end;
+        else
+            end = v->end;
+        re_memo_add(m, *v);
+    }
+    return last;
+}
+
+// Appends the leftmost longest matches on the line data[0, len) at `base`.
+// Empty matches are left out unless `allow_empty` is set, and never follow
+// right after another match. The reverse program marks every offset a
+// match starts at in one pass over the line, then the forward one takes the
+// longest match from each mark past the end of the one before. Runs that
+// meet share the rest of the way, which keeps a line linear in its length
+// however far each run goes.
+void regex_scan_line(Regex *re, const char *line, size_t len, size_t base, Matches *out)
+{
+    Dfa *f = &re->forward, *r = &re->reverse;
+    re->starts.count = 0;
+    int st = dfa_start(r, 1);
+    for (size_t i = len; i > 0; --i) {
+        if (r->states[st].accept)
+            matches_push(&re->starts, i, 0);
+        st = dfa_step(r, st, line[i - 1]);
+    }
+    if (r->states[st].accept_eol)
+        matches_push(&re->starts, 0, 0);
+
+    re_memo_reset(&re->memo, f->flushes);
+    size_t done = 0, found = 0;
+    for (size_t k = re->starts.count; k-- > 0;) {
+        size_t s = re->starts.data[k].pos;
+        if (s < done)
+            continue;
+
+        // Runs still to come start at the next mark or past it
+        size_t keep = k > 0 ? re->starts.data[k - 1].pos : SIZE_MAX;
+        size_t last = regex_longest(re, line, len, s, keep);
+        if (last > s || (re->allow_empty && (found == 0 || s > done))) {
+            matches_push(out, base + s, last - s);
+            done = last;
+            found++;
+        }
+    }
+}
+
+// Appends the matches on each line of data[0, len), which holds whole
+// lines, shifted by `base`. With a required run of two bytes or more, the
+// substring scanner picks out the lines worth running the DFAs on.
+void regex_scan(Regex *re, const char *data, size_t len, size_t base, Matches *out)
+{
+    size_t n = re->required.count;
+    if (n < 2) {
+        for (const char *line = data, *end = data + len;;) {
+            const char *eol = memchr(line, '\n', end - line);
+            regex_scan_line(re, line, (eol ? eol : end) - line, base + (line - data), out);
+            if (!eol)
+                break;
+            line = eol + 1;
+        }
+        return;
+    }
+
+    SubstringScanner scan = substring_scanner_get();
+    // Lines before `done` are searched already
+    size_t done = 0;
+    for (size_t pos = 0; pos + n <= len;) {
+        size_t window = MIN(REGEX_WINDOW, len - n + 1 - pos);
+        re->candidates.count = 0;
+        scan(data + pos, window, re->required.data, n, pos, &re->candidates);
+        pos += window;
+        for (size_t i = 0; i < re->candidates.count; ++i) {
+            size_t c = re->candidates.data[i].pos;
+            if (c < done)
+                continue;
+            const char *bol = memrchr(data + done, '\n', c - done);
+            const char *eol = memchr(data + c, '\n', len - c);
+            size_t a = bol ? (size_t) (bol - data) + 1 : done;
+            size_t b = eol ? (size_t) (eol - data) : len;
+            regex_scan_line(re, data + a, b - a, base + a, out);
+            done = b + 1;
+        }
+        if (pos < done)
+            pos = done;
+    }
+}
+
+// Indexes the newlines of data[start, start + len)
+void text_buffer_scan_newlines(TextBuffer *b, size_t start, size_t len)
+{
+    NewlineScanner scan = newline_scanner_get();
+    for (size_t done = 0; done < len;) {
+        size_t n = MIN(NEWLINE_BATCH, len - done);
+        // Room for the worst case of a batch so the scanner can store
+        // offsets in bulk, the table only grows with what it finds
+        if (b->nl_capacity < b->nl_count + n) {
+            while (b->nl_capacity < b->nl_count + n)
+                b->nl_capacity = b->nl_capacity == 0 ? INIT_CAP : b->nl_capacity * 2;
+            b->newlines = realloc(b->newlines, sizeof(size_t) * b->nl_capacity);
+            if (!b->newlines) {
+                fprintf(stderr, "ERROR: Not enough memory...\n");
+                exit(1);
+            }
+        }
+        b->nl_count += scan(b->data + start + done, n, start + done, b->newlines + b->nl_count);
+        done += n;
+    }
+}
+
+void text_buffer_append(TextBuffer *b, const char *str, size_t len)
+{
+    if (b->capacity < b->count + len) {
+        while (b->capacity < b->count + len)
+            b->capacity = b->capacity == 0 ? INIT_CAP : b->capacity * 2;
+        b->data = realloc(b->data, sizeof(char) * b->capacity);
+        if (!b->data) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+    }
+
+    memcpy(b->data + b->count, str, len);
+    text_buffer_scan_newlines(b, b->count, len);
+    b->count += len;
+}
+
+// Index of the first newline at or after `offset`
+size_t text_buffer_newline_index(TextBuffer *b, size_t offset)
+{
+    size_t lo = 0, hi = b->nl_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (b->newlines[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void text_buffer_free(TextBuffer *b)
+{
+    if (b->mapped) {
+        munmap(b->data, b->reserved);
+        close(b->fd);
+    } else
+        free(b->data);
+    free(b->newlines);
+    memset(b, 0, sizeof(*b));
+}
+
+void syntax_reserve(SyntaxCache *c, size_t capacity)
+{
+    if (c->capacity >= capacity)
+        return;
+
+    size_t new_capacity = c->capacity ? c->capacity : INIT_CAP;
+    while (new_capacity < capacity)
+        new_capacity *= 2;
+    c->states = realloc(c->states, new_capacity);
+    if (!c->states) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    c->capacity = new_capacity;
+}
+
+// Lines (row, row + removed] were replaced by (row, row + added]. The states
+// past them move along with their lines and the ones in between are relexed.
+void syntax_edit(SyntaxCache *c, size_t row, size_t removed, size_t added)
+{
+    if (row + 1 >= c->count)
+        return;
+
+    size_t old_end = row + 1 + removed;
+    size_t new_end = row + 1 + added;
+    // States reused from an earlier edit are only right if the line above
+    // them still ends the same way, which hasn't been checked yet
+    size_t reuse = new_end;
+    if (c->valid < c->count && c->reuse > old_end)
+        reuse = c->reuse - old_end + new_end;
+    if (c->valid > row + 1)
+        c->valid = row + 1;
+    if (old_end >= c->count) {
+        c->count = c->reuse = row + 1;
+        return;
+    }
+
+    size_t tail = c->count - old_end;
+    if (new_end != old_end) {
+        syntax_reserve(c, new_end + tail);
+        memmove(&c->states[new_end], &c->states[old_end], tail);
+    }
+    c->count = new_end + tail;
+    c->reuse = reuse;
+}
+
+// Forgets the states past `row`, so a batch of edits below it doesn't shift
+// them around one edit at a time
+void syntax_truncate(SyntaxCache *c, size_t row)
+{
+    if (c->count > row + 1)
+        c->count = c->reuse = row + 1;
+    if (c->valid > c->count)
+        c->valid = c->count;
+}
+
+void syntax_free(SyntaxCache *c)
+{
+    free(c->states);
+    memset(c, 0, sizeof(*c));
+}
+
+size_t column_count(ColumnIndex *ci)
+{
+    return ci->gap + ci->capacity - ci->gap_end;
+}
+
+// Point `k` in column order
+LexPoint column_at(ColumnIndex *ci, size_t k)
+{
+    if (k < ci->gap)
+        return ci->points[k];
+    LexPoint p = ci->points[ci->gap_end + k - ci->gap];
+    p.col += ci->shift;
+    return p;
+}
+
+// Number of points among the first `count` at or before `col`
+size_t column_find(ColumnIndex *ci, size_t count, size_t col)
+{
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (column_at(ci, mid).col <= col)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Points that are known to be right
+size_t column_right(ColumnIndex *ci)
+{
+    return ci->stale ? ci->gap : column_count(ci);
+}
+
+void column_move_gap(ColumnIndex *ci, size_t k)
+{
+    while (ci->gap > k) {
+        LexPoint p = ci->points[--ci->gap];
+        p.col -= ci->shift;
+        ci->points[--ci->gap_end] = p;
+    }
+    while (ci->gap < k) {
+        LexPoint p = ci->points[ci->gap_end++];
+        p.col += ci->shift;
+        ci->points[ci->gap++] = p;
+    }
+}
+
+void column_insert(ColumnIndex *ci, LexPoint p)
+{
+    if (ci->gap == ci->gap_end) {
+        size_t tail = ci->capacity - ci->gap_end;
+        size_t capacity = ci->capacity ? ci->capacity * 2 : INIT_CAP;
+        ci->points = realloc(ci->points, sizeof(LexPoint) * capacity);
+        if (!ci->points) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+        memmove(&ci->points[capacity - tail], &ci->points[ci->gap_end], sizeof(LexPoint) * tail);
+        ci->gap_end = capacity - tail;
+        ci->capacity = capacity;
+    }
+    ci->points[ci->gap++] = p;
+}
+
+// Called by the lexer at every token boundary `at` while it extends the
+// index. Stale points it has passed are dropped and one every
+// COLUMN_STRIDE columns is recorded. Returns 1 when `at` matches a stale
+// point, which makes every point past the gap right again.
+int column_visit(ColumnIndex *ci, LexPoint *at, int end_of_line)
+{
+    while (ci->stale) {
+        LexPoint old = column_at(ci, ci->gap);
+        if (old.col > at->col)
+            break;
+        if (old.col == at->col && old.state == at->state && old.after == at->after &&
+                old.blank == at->blank && old.word == at->word) {
+            // The point just recorded would sit right before this one
+            if (ci->gap > 1 && old.col < ci->points[ci->gap - 2].col + 2 * COLUMN_STRIDE)
+                --ci->gap;
+            ci->stale = 0;
+            return 1;
+        }
+        ci->stale = ++ci->gap_end < ci->capacity;
+    }
+
+    size_t last = ci->points[ci->gap - 1].col;
+    if (at->col >= last + COLUMN_STRIDE || (end_of_line && at->col > last))
+        column_insert(ci, *at);
+    return 0;
+}
+
+// Makes room for the indexes of `lines` long lines
+void columns_reserve(ColumnCache *c, size_t lines)
+{
+    if (c->count >= lines)
+        return;
+    c->lines = realloc(c->lines, sizeof(ColumnIndex) * lines);
+    if (!c->lines) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    memset(c->lines + c->count, 0, sizeof(ColumnIndex) * (lines - c->count));
+    c->count = lines;
+}
+
+void columns_free(ColumnCache *c)
+{
+    for (size_t k = 0; k < c->count; ++k)
+        free(c->lines[k].points);
+    free(c->lines);
+    line_free(&c->window);
+    memset(c, 0, sizeof(*c));
+}
+
+void cells_push(CellMap *m, CellPoint p)
+{
+    if (m->capacity < m->count + 1) {
+        m->capacity = m->capacity == 0 ? INIT_CAP : m->capacity * 2;
+        m->points = realloc(m->points, sizeof(CellPoint) * m->capacity);
+        if (!m->points) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+    }
+    m->points[m->count++] = p;
+}
+
+// Makes room for the maps of `lines` lines
+void cells_reserve(CellCache *c, size_t lines)
+{
+    if (c->count >= lines)
+        return;
+    c->lines = realloc(c->lines, sizeof(CellMap) * lines);
+    if (!c->lines) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    memset(c->lines + c->count, 0, sizeof(CellMap) * (lines - c->count));
+    c->count = lines;
+}
+
+void cells_free(CellCache *c)
+{
+    for (size_t k = 0; k < c->count; ++k)
+        free(c->lines[k].points);
+    free(c->lines);
+    line_free(&c->window);
+    memset(c, 0, sizeof(*c));
+}
+
+// Lines measured so far
+size_t wrap_count(WrapIndex *w)
+{
+    return w->gap + w->capacity - w->gap_end;
+}
+
+size_t wrap_slot(WrapIndex *w, size_t row)
+{
+    return row < w->gap ? row : row + w->gap_end - w->gap;
+}
+
+// Adds `delta` to the rows of `slot`, wrapping around to take rows away
+void wrap_add(WrapIndex *w, size_t slot, size_t delta)
+{
+    for (size_t i = slot + 1; i <= w->capacity; i += i & -i)
+        w->tree[i] += delta;
+}
+
+// Rows of the slots before `slot`
+size_t wrap_prefix(WrapIndex *w, size_t slot)
+{
+    size_t rows = 0;
+    for (size_t i = slot; i > 0; i -= i & -i)
+        rows += w->tree[i];
+    return rows;
+}
+
+void wrap_set(WrapIndex *w, size_t slot, WrapLine line)
+{
+    wrap_add(w, slot, line.rows - w->lines[slot].rows);
+    w->lines[slot] = line;
+}
+
+// Sums the rows of every slot again, in O(capacity)
+void wrap_rebuild(WrapIndex *w)
+{
+    for (size_t i = 1; i <= w->capacity; ++i)
+        w->tree[i] = w->lines[i - 1].rows;
+    for (size_t i = 1; i <= w->capacity; ++i) {
+        size_t parent = i + (i & -i);
+        if (parent <= w->capacity)
+            w->tree[parent] += w->tree[i];
+    }
+}
+
+// Makes room for `n` more lines in the gap
+void wrap_reserve(WrapIndex *w, size_t n)
+{
+    if (w->gap_end - w->gap >= n)
+        return;
+
+    size_t count = wrap_count(w), tail = w->capacity - w->gap_end;
+    size_t new_capacity = w->capacity ? w->capacity * 2 : INIT_CAP;
+    while (new_capacity < count + n)
+        new_capacity *= 2;
+    w->lines = realloc(w->lines, sizeof(WrapLine) * new_capacity);
+    w->tree = realloc(w->tree, sizeof(size_t) * (new_capacity + 1));
+    if (!w->lines || !w->tree) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    memmove(&w->lines[new_capacity - tail], &w->lines[w->gap_end], sizeof(WrapLine) * tail);
+    memset(&w->lines[w->gap], 0, sizeof(WrapLine) * (new_capacity - tail - w->gap));
+    w->gap_end = new_capacity - tail;
+    w->capacity = new_capacity;
+    wrap_rebuild(w);
+}
+
+// Moves the gap to line `row`. Each line that moves is two updates of the
+// tree, so a long way the tree is summed again instead.
+void wrap_move_gap(WrapIndex *w, size_t row)
+{
+    size_t n = w->gap_end - w->gap;
+    if (n == 0) {
+        w->gap = w->gap_end = row;
+        return;
+    }
+    size_t distance = row < w->gap ? w->gap - row : row - w->gap;
+    if (distance * 32 < w->capacity) {
+        WrapLine empty = {0};
+        while (w->gap > row) {
+            w->gap--;
+            w->gap_end--;
+            wrap_set(w, w->gap_end, w->lines[w->gap]);
+            wrap_set(w, w->gap, empty);
+        }
+        while (w->gap < row) {
+            wrap_set(w, w->gap, w->lines[w->gap_end]);
+            wrap_set(w, w->gap_end, empty);
+            w->gap++;
+            w->gap_end++;
+        }
+        return;
+    }
+
+    if (row < w->gap)
+        memmove(&w->lines[row + n], &w->lines[row], sizeof(WrapLine) * distance);
+    else
+        memmove(&w->lines[w->gap], &w->lines[w->gap_end], sizeof(WrapLine) * distance);
+    w->gap = row;
+    w->gap_end = row + n;
+    memset(&w->lines[w->gap], 0, sizeof(WrapLine) * n);
+    wrap_rebuild(w);
+}
+
+// Forgets the lines from `row` on, they are measured again when needed
+void wrap_truncate(WrapIndex *w, size_t row)
+{
+    if (row >= wrap_count(w))
+        return;
+    wrap_move_gap(w, row);
+    memset(&w->lines[w->gap_end], 0, sizeof(WrapLine) * (w->capacity - w->gap_end));
+    w->gap_end = w->capacity;
+    wrap_rebuild(w);
+    if (w->dirty_end > row)
+        w->dirty_end = row;
+}
+
+// Lines (row, row + removed] were replaced by (row, row + added]. The rows
+// past them move along with their lines, line `row` and the new lines are
+// measured again.
+void wrap_edit(WrapIndex *w, size_t row, size_t removed, size_t added)
+{
+    size_t count = wrap_count(w);
+    if (row >= count)
+        return;
+    if (row + removed >= count) {
+        wrap_truncate(w, row);
+        return;
+    }
+
+    wrap_move_gap(w, row + 1);
+    for (size_t k = 0; k < removed; ++k)
+        wrap_set(w, w->gap_end++, (WrapLine) {0});
+    wrap_reserve(w, added);
+    for (size_t k = 0; k < added; ++k)
+        wrap_set(w, w->gap++, (WrapLine) { .rows = 1 });
+
+    size_t end = row + added + 1;
+    if (w->dirty < w->dirty_end) {
+        if (w->dirty_end > row + removed + 1)
+            end = w->dirty_end - removed + added;
+        if (w->dirty < row)
+            row = w->dirty;
+    }
+    w->dirty = row;
+    w->dirty_end = end;
+}
+
+void wrap_free(WrapIndex *w)
+{
+    free(w->lines);
+    free(w->tree);
+    memset(w, 0, sizeof(*w));
+}
+
+unsigned piece_priority(void)
+{
+    // xorshift32, priorities only need to be well spread, not secure
+    static unsigned state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+Piece *piece_alloc(PieceArena *a)
+{
+    Piece *p = a->free;
+    if (p) {
+        a->free = p->left;
+    } else {
+        if (!a->chunks || a->chunks->used == PIECE_CHUNK) {
+            PieceChunk *chunk = malloc(sizeof(PieceChunk));
+            if (!chunk) {
+                fprintf(stderr, "ERROR: Not enough memory...\n");
+                exit(1);
+            }
+            chunk->next = a->chunks;
+            chunk->used = 0;
+            a->chunks = chunk;
+            a->chunk_count++;
+        }
+        p = &a->chunks->pieces[a->chunks->used++];
+    }
+    a->live++;
+
+    return p;
+}
+
+void piece_arena_free(PieceArena *a)
+{
+    while (a->chunks) {
+        PieceChunk *next = a->chunks->next;
+        free(a->chunks);
+        a->chunks = next;
+    }
+    memset(a, 0, sizeof(*a));
+}
+
+Piece *piece_new(PieceTable *pt, int buf, size_t start, size_t count)
+{
+    Piece *p = piece_alloc(&pt->arena);
+
+    TextBuffer *b = &pt->buffers[buf];
+    p->left = p->right = NULL;
+    p->priority = piece_priority();
+    p->buf = buf;
+    p->start = start;
+    p->count = count;
+    p->lf_start = text_buffer_newline_index(b, start);
+    p->lf_count = text_buffer_newline_index(b, start + count) - p->lf_start;
+    p->sub_count = count;
+    p->sub_lf = p->lf_count;
+
+    return p;
+}
+
+void piece_update(Piece *p)
+{
+    p->sub_count = p->count;
+    p->sub_lf = p->lf_count;
+    if (p->left) {
+        p->sub_count += p->left->sub_count;
+        p->sub_lf += p->left->sub_lf;
+    }
+    if (p->right) {
+        p->sub_count += p->right->sub_count;
+        p->sub_lf += p->right->sub_lf;
+    }
+}
+
+// Splits `p` so that the first `pos` bytes end up in `l` and the rest in `r`.
+// A piece straddling `pos` is cut in two.
+void piece_split(PieceTable *pt, Piece *p, size_t pos, Piece **l, Piece **r)
+{
+    if (!p) {
+        *l = *r = NULL;
+        return;
+    }
+
+    size_t left = p->left ? p->left->sub_count : 0;
+    if (pos <= left) {
+        piece_split(pt, p->left, pos, l, &p->left);
+        piece_update(p);
+        *r = p;
+    } else if (pos >= left + p->count) {
+        piece_split(pt, p->right, pos - left - p->count, &p->right, r);
+        piece_update(p);
+        *l = p;
+    } else {
+        size_t offset = pos - left;
+        TextBuffer *b = &pt->buffers[p->buf];
+        size_t lf_head = text_buffer_newline_index(b, p->start + offset) - p->lf_start;
+
+        Piece *tail = piece_new(pt, p->buf, p->start + offset, p->count - offset);
+        // Keeps the heap property, p->right has a priority lower than p
+        tail->priority = p->priority;
+        tail->right = p->right;
+        piece_update(tail);
+
+        p->count = offset;
+        p->lf_count = lf_head;
+        p->right = NULL;
+        piece_update(p);
+
+        *l = p;
+        *r = tail;
+    }
+}
+
+Piece *piece_merge(Piece *a, Piece *b)
+{
+    if (!a) return b;
+    if (!b) return a;
+
+    if (a->priority > b->priority) {
+        a->right = piece_merge(a->right, b);
+        piece_update(a);
+        return a;
+    } else {
+        b->left = piece_merge(a, b->left);
+        piece_update(b);
+        return b;
+    }
+}
+
+// Returns the pieces of a subtree to the free list
+void piece_free(PieceTable *pt, Piece *p)
+{
+    if (p) {
+        piece_free(pt, p->left);
+        piece_free(pt, p->right);
+        p->left = pt->arena.free;
+        pt->arena.free = p;
+        pt->arena.live--;
+    }
+}
+
+void pt_init(PieceTable *pt)
+{
+    memset(pt, 0, sizeof(*pt));
+}
+
+// Takes ownership of `data`, which becomes the original buffer. Nothing is
+// scanned yet, newlines are indexed on demand by pt_index_chunk.
+void pt_load(PieceTable *pt, char *data, size_t size, int mapped)
+{
+    TextBuffer *b = &pt->buffers[BUF_ORIGINAL];
+    b->data = data;
+    b->count = size;
+    b->capacity = size;
+    b->mapped = mapped;
+    b->reserved = size;
+
+    // The final newline terminates the last line, it is not an empty line of its own
+    pt->original_end = size > 0 && data[size - 1] == '\n' ? size - 1 : size;
+    pt->scanned = 0;
+}
+
+int pt_indexed(PieceTable *pt)
+{
+    return pt->scanned == pt->buffers[BUF_ORIGINAL].count;
+}
+
+// Appends original[start, start + len) to the end of the document. The
+// rightmost piece is grown when it already ends at `start`.
+void pt_append_original(PieceTable *pt, size_t start, size_t len)
+{
+    TextBuffer *b = &pt->buffers[BUF_ORIGINAL];
+    Piece *p = pt->root;
+    while (p && p->right)
+        p = p->right;
+
+    if (p && p->buf == BUF_ORIGINAL && p->start + p->count == start) {
+        size_t lf = text_buffer_newline_index(b, start + len) - text_buffer_newline_index(b, start);
+        for (Piece *q = pt->root; q; q = q->right) {
+            q->sub_count += len;
+            q->sub_lf += lf;
+        }
+        p->count += len;
+        p->lf_count += lf;
+    } else {
+        pt->root = piece_merge(pt->root, piece_new(pt, BUF_ORIGINAL, start, len));
+    }
+}
+
+// Makes original[scanned, end) part of the document once its newlines are indexed
+void pt_index_commit(PieceTable *pt, size_t end)
+{
+    size_t start = pt->scanned;
+    pt->scanned = end;
+
+    size_t piece_end = MIN(end, pt->original_end);
+    if (piece_end > start)
+        pt_append_original(pt, start, piece_end - start);
+}
+
+// Scans the next chunk of the original buffer for newlines and makes it part
+// of the document
+void pt_index_chunk(PieceTable *pt)
+{
+    TextBuffer *b = &pt->buffers[BUF_ORIGINAL];
+    size_t start = pt->scanned;
+    size_t end = MIN(start + INDEX_CHUNK, b->count);
+
+    text_buffer_scan_newlines(b, start, end - start);
+    pt_index_commit(pt, end);
+}
+
+void *index_job_run(void *arg)
+{
+    IndexJob *job = arg;
+    for (size_t start = job->start; start < job->end; start += INDEX_CHUNK) {
+        text_buffer_scan_newlines(&job->table, start, MIN(INDEX_CHUNK, job->end - start));
+    }
+    return NULL;
+}
+
+size_t index_threads(void)
+{
+    if (index_thread_count == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        index_thread_count = n > 0 ? n : 1;
+    }
+    return index_thread_count;
+}
+
+// Indexes the next `len` bytes of the original buffer on `threads` threads.
+// Every thread builds a newline table for its own slice, the tables are
+// then concatenated in order, which gives the same table as scanning
+// sequentially.
+void pt_index_parallel(PieceTable *pt, size_t len, size_t threads)
+{
+    TextBuffer *b = &pt->buffers[BUF_ORIGINAL];
+    size_t start = pt->scanned;
+    len = MIN(len, b->count - start);
+    threads = MIN(threads, len / INDEX_CHUNK + 1);
+
+    IndexJob *jobs = calloc(threads, sizeof(IndexJob));
+    if (!jobs) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+
+    // Resolved up front so the threads don't race on picking a scanner
+    newline_scanner_get();
+
+    size_t slice = len / threads;
+    for (size_t i = 0; i < threads; ++i) {
+        IndexJob *job = &jobs[i];
+        job->table.data = b->data;
+        job->start = start + i * slice;
+        job->end = i + 1 == threads ? start + len : job->start + slice;
+        // The calling thread takes the first slice itself
+        if (i > 0 && pthread_create(&job->thread, NULL, index_job_run, job) != 0) {
+            fprintf(stderr, "ERROR: Unable to start indexing thread.\n");
+            exit(1);
+        }
+    }
+    index_job_run(&jobs[0]);
+
+    size_t total = b->nl_count;
+    for (size_t i = 0; i < threads; ++i) {
+        if (i > 0)
+            pthread_join(jobs[i].thread, NULL);
+        total += jobs[i].table.nl_count;
+    }
+
+    if (b->nl_capacity < total) {
+        b->nl_capacity = total;
+        b->newlines = realloc(b->newlines, sizeof(size_t) * b->nl_capacity);
+        if (!b->newlines) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        IndexJob *job = &jobs[i];
+        memcpy(b->newlines + b->nl_count, job->table.newlines, sizeof(size_t) * job->table.nl_count);
+        b->nl_count += job->table.nl_count;
+        free(job->table.newlines);
+    }
+    free(jobs);
+
+    pt_index_commit(pt, start + len);
+}
+
+// One unit of background indexing. Large remainders are split across all
+// cores, the rest goes chunk by chunk so input is never held up for long.
+void pt_index_step(PieceTable *pt)
+{
+    size_t remaining = pt->buffers[BUF_ORIGINAL].count - pt->scanned;
+    if (remaining >= PARALLEL_THRESHOLD)
+        pt_index_parallel(pt, index_threads() * PARALLEL_STEP, index_threads());
+    else
+        pt_index_chunk(pt);
+}
+
+// Indexes until the first `rows` lines are complete or the file is exhausted
+void pt_index_lines(PieceTable *pt, size_t rows)
+{
+    while (!pt_indexed(pt) && (pt->root ? pt->root->sub_lf : 0) < rows)
+        pt_index_chunk(pt);
+}
+
+// Indexes until the document holds at least `size` bytes or the file is exhausted
+void pt_index_bytes(PieceTable *pt, size_t size)
+{
+    while (!pt_indexed(pt) && (pt->root ? pt->root->sub_count : 0) < size)
+        pt_index_chunk(pt);
+}
+
+void pt_index_all(PieceTable *pt)
+{
+    size_t remaining = pt->buffers[BUF_ORIGINAL].count - pt->scanned;
+    if (remaining >= PARALLEL_THRESHOLD)
+        pt_index_parallel(pt, remaining, index_threads());
+    while (!pt_indexed(pt))
+        pt_index_chunk(pt);
+}
+
+size_t pt_size(PieceTable *pt)
+{
+    pt_index_all(pt);
+    return pt->root ? pt->root->sub_count : 0;
+}
+
+size_t pt_line_count(PieceTable *pt)
+{
+    pt_index_all(pt);
+    return (pt->root ? pt->root->sub_lf : 0) + 1;
+}
+
+// Whether line `row` exists, only indexing as far as needed to tell
+int pt_has_line(PieceTable *pt, size_t row)
+{
+    pt_index_lines(pt, row);
+    return row <= (pt->root ? pt->root->sub_lf : 0);
+}
+
+// Document offset of the `k`th newline
+size_t pt_newline_offset(PieceTable *pt, size_t k)
+{
+    pt_index_lines(pt, k + 1);
+
+    Piece *p = pt->root;
+    size_t base = 0;
+    while (p) {
+        size_t left_lf = p->left ? p->left->sub_lf : 0;
+        size_t left_count = p->left ? p->left->sub_count : 0;
+        if (k < left_lf) {
+            p = p->left;
+            continue;
+        }
+
+        k -= left_lf;
+        if (k < p->lf_count) {
+            TextBuffer *b = &pt->buffers[p->buf];
+            return base + left_count + b->newlines[p->lf_start + k] - p->start;
+        }
+
+        k -= p->lf_count;
+        base += left_count + p->count;
+        p = p->right;
+    }
+
+    fprintf(stderr, "ERROR: Newline '%zu' out of bounds.\n", k);
+    exit(1);
+}
+
+size_t pt_line_start(PieceTable *pt, size_t row)
+{
+    return row == 0 ? 0 : pt_newline_offset(pt, row - 1) + 1;
+}
+
+size_t pt_line_length(PieceTable *pt, size_t row)
+{
+    pt_index_lines(pt, row + 1);
+    size_t end = row < (pt->root ? pt->root->sub_lf : 0)
+        ? pt_newline_offset(pt, row)
+        : pt_size(pt);
+    return end - pt_line_start(pt, row);
+}
+
+// Number of newlines before `pos`, which is the row `pos` is on
+size_t pt_line_at(PieceTable *pt, size_t pos)
+{
+    size_t row = 0;
+    Piece *p = pt->root;
+    while (p) {
+        size_t left = p->left ? p->left->sub_count : 0;
+        if (pos < left) {
+            p = p->left;
+            continue;
+        }
+        row += p->left ? p->left->sub_lf : 0;
+        pos -= left;
+        if (pos <= p->count) {
+            TextBuffer *b = &pt->buffers[p->buf];
+            return row + text_buffer_newline_index(b, p->start + pos) - p->lf_start;
+        }
+        row += p->lf_count;
+        pos -= p->count;
+        p = p->right;
+    }
+    return row;
+}
+
+// Moves the long line indexes along with an edit at `pos` on line `row`
+// that replaced `removed` bytes and `lines_removed` lines by `added` bytes
+// and `lines_added` lines. The points before the edit stay right and the
+// rest go stale, an index whose line was split or joined is dropped.
+void columns_edit(PieceTable *pt, size_t row, size_t pos, size_t removed, size_t added,
+        size_t lines_removed, size_t lines_added)
+{
+    for (size_t k = 0; k < pt->columns.count; ++k) {
+        ColumnIndex *ci = &pt->columns.lines[k];
+        if (!ci->used || ci->row < row)
+            continue;
+        if (ci->row > row + lines_removed) {
+            ci->row = ci->row - lines_removed + lines_added;
+            continue;
+        }
+        if (ci->row != row || lines_removed > 0 || lines_added > 0) {
+            ci->used = 0;
+            continue;
+        }
+
+        size_t col = pos - pt_line_start(pt, row);
+        column_move_gap(ci, column_find(ci, column_count(ci), col));
+        while (ci->gap_end < ci->capacity && column_at(ci, ci->gap).col < col + removed)
+            ci->gap_end++;
+        ci->shift += (long) added - (long) removed;
+        ci->stale = ci->gap_end < ci->capacity;
+    }
+}
+
+// Moves the display column maps along with an edit at `pos` on line `row`
+// that replaced `lines_removed` lines by `lines_added`. Only the points
+// before the edit stay, a char ending right before it may take in bytes
+// that follow, and a map whose line was split or joined is dropped.
+void cells_edit(PieceTable *pt, size_t row, size_t pos, size_t lines_removed, size_t lines_added)
+{
+    for (size_t k = 0; k < pt->cells.count; ++k) {
+        CellMap *m = &pt->cells.lines[k];
+        if (!m->used || m->row < row)
+            continue;
+        if (m->row > row + lines_removed) {
+            m->row = m->row - lines_removed + lines_added;
+            continue;
+        }
+        if (m->row != row || lines_removed > 0 || lines_added > 0) {
+            m->used = 0;
+            continue;
+        }
+
+        size_t col = pos - pt_line_start(pt, row);
+        while (m->count > 1 && m->points[m->count - 1].col + UTF8_MAX > col)
+            m->count--;
+    }
+}
+
+void pt_insert(PieceTable *pt, size_t pos, const char *str, size_t len)
+{
+    pt_index_bytes(pt, pos);
+    if (pos > (pt->root ? pt->root->sub_count : 0)) {
+        fprintf(stderr, "ERROR: Insert '%zu' out of bounds.\n", pos);
+        exit(1);
+    }
+    if (len == 0)
+        return;
+
+    TextBuffer *add = &pt->buffers[BUF_ADD];
+    size_t row = pt_line_at(pt, pos);
+    size_t lf_added = add->nl_count;
+    Piece *last = pt->last;
+    if (last && pt->last_end == pos && last->start + last->count == add->count) {
+        // Typing extends the piece of the previous insert instead of adding a new one
+        size_t lf_before = add->nl_count;
+        text_buffer_append(add, str, len);
+        size_t lf = add->nl_count - lf_before;
+
+        Piece *p = pt->root;
+        size_t offset = pos - 1;
+        while (p != last) {
+            size_t left = p->left ? p->left->sub_count : 0;
+            p->sub_count += len;
+            p->sub_lf += lf;
+            if (offset < left) {
+                p = p->left;
+            } else {
+                offset -= left + p->count;
+                p = p->right;
+            }
+        }
+        last->count += len;
+        last->lf_count += lf;
+        last->sub_count += len;
+        last->sub_lf += lf;
+    } else {
+        size_t start = add->count;
+        text_buffer_append(add, str, len);
+
+        Piece *p = piece_new(pt, BUF_ADD, start, len);
+        Piece *l, *r;
+        piece_split(pt, pt->root, pos, &l, &r);
+        pt->root = piece_merge(piece_merge(l, p), r);
+        pt->last = p;
+    }
+    pt->last_end = pos + len;
+    pt->version++;
+    syntax_edit(&pt->syntax, row, 0, add->nl_count - lf_added);
+    columns_edit(pt, row, pos, 0, len, 0, add->nl_count - lf_added);
+    cells_edit(pt, row, pos, 0, add->nl_count - lf_added);
+    wrap_edit(&pt->wrap, row, 0, add->nl_count - lf_added);
+}
+
+void pt_delete(PieceTable *pt, size_t pos, size_t len)
+{
+    pt_index_bytes(pt, pos + len);
+    if (pos + len > (pt->root ? pt->root->sub_count : 0)) {
+        fprintf(stderr, "ERROR: Remove '%zu' out of bounds.\n", pos);
+        exit(1);
+    }
+    if (len == 0)
+        return;
+
+    Piece *l, *m, *r;
+    piece_split(pt, pt->root, pos, &l, &r);
+    piece_split(pt, r, len, &m, &r);
+    size_t row = l ? l->sub_lf : 0;
+    size_t lines = m->sub_lf;
+    syntax_edit(&pt->syntax, row, lines, 0);
+    piece_free(pt, m);
+    pt->root = piece_merge(l, r);
+    pt->last = NULL;
+    pt->version++;
+    columns_edit(pt, row, pos, len, 0, lines, 0);
+    cells_edit(pt, row, pos, lines, 0);
+    wrap_edit(&pt->wrap, row, lines, 0);
+}
+
+// The file of the original buffer grew to `size` bytes, which its mapping
+// has room for. The new bytes are indexed on demand like the rest and join
+// the end of the document. The last line may take some in, so what is kept
+// about it goes as for an insert at its end. Positions don't move, but it
+// is a new version of the text all the same.
+void pt_grow(PieceTable *pt, size_t size)
+{
+    TextBuffer *b = &pt->buffers[BUF_ORIGINAL];
+    pt->version++;
+    if (pt_indexed(pt)) {
+        size_t pos = pt->root ? pt->root->sub_count : 0;
+        size_t row = pt->root ? pt->root->sub_lf : 0;
+        syntax_edit(&pt->syntax, row, 0, 0);
+        columns_edit(pt, row, pos, 0, 0, 0, 0);
+        cells_edit(pt, row, pos, 0, 0);
+        wrap_edit(&pt->wrap, row, 0, 0);
+    }
+
+    size_t end = pt->original_end;
+    b->count = size;
+    pt->original_end = b->data[size - 1] == '\n' ? size - 1 : size;
+    // The newline held back at the end of the file ends a line now
+    if (pt->scanned > end)
+        pt_append_original(pt, end, MIN(pt->scanned, pt->original_end) - end);
+}
+
+size_t piece_read(PieceTable *pt, Piece *p, size_t pos, char *dst, size_t len)
+{
+    size_t read = 0;
+    while (p && len > 0) {
+        size_t left = p->left ? p->left->sub_count : 0;
+        if (pos < left) {
+            size_t n = piece_read(pt, p->left, pos, dst, len);
+            dst += n;
+            len -= n;
+            read += n;
+            pos = left;
+        }
+        if (len == 0)
+            break;
+
+        if (pos < left + p->count) {
+            size_t offset = pos - left;
+            size_t n = MIN(p->count - offset, len);
+            memcpy(dst, pt->buffers[p->buf].data + p->start + offset, n);
+            dst += n;
+            len -= n;
+            read += n;
+            pos += n;
+        }
+
+        pos -= left + p->count;
+        p = p->right;
+    }
+
+    return read;
+}
+
+// Copies up to `len` bytes starting at `pos` into `dst`
+size_t pt_read(PieceTable *pt, size_t pos, char *dst, size_t len)
+{
+    pt_index_bytes(pt, pos + len);
+    return piece_read(pt, pt->root, pos, dst, len);
+}
+
+// Replaces the contents of `line` with line `row` of the document
+void pt_line(PieceTable *pt, size_t row, Line *line)
+{
+    size_t start = pt_line_start(pt, row);
+    size_t len = pt_line_length(pt, row);
+
+    line->count = 0;
+    line_reserve(line, len);
+    line->count = pt_read(pt, start, line->data, len);
+}
+
+void pt_iter_push(PieceIter *it, Piece *p)
+{
+    if (it->capacity < it->count + 1) {
+        it->capacity = it->capacity == 0 ? INIT_CAP : it->capacity * 2;
+        it->stack = realloc(it->stack, sizeof(Piece*) * it->capacity);
+        if (!it->stack) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+    }
+
+    it->stack[it->count++] = p;
+}
+
+// Positions the iterator at document offset `pos`
+void pt_iter_seek(PieceIter *it, PieceTable *pt, size_t pos)
+{
+    it->pt = pt;
+    it->piece = NULL;
+    it->offset = 0;
+    it->count = 0;
+
+    Piece *p = pt->root;
+    while (p) {
+        size_t left = p->left ? p->left->sub_count : 0;
+        if (pos < left) {
+            pt_iter_push(it, p);
+            p = p->left;
+        } else if (pos < left + p->count) {
+            it->piece = p;
+            it->offset = pos - left;
+            return;
+        } else {
+            pos -= left + p->count;
+            p = p->right;
+        }
+    }
+}
+
+void pt_iter_next_piece(PieceIter *it)
+{
+    Piece *p = it->piece->right;
+    it->offset = 0;
+    if (p) {
+        while (p->left) {
+            pt_iter_push(it, p);
+            p = p->left;
+        }
+        it->piece = p;
+    } else {
+        it->piece = it->count > 0 ? it->stack[--it->count] : NULL;
+    }
+}
+
+// Reads up to the next newline into `line` and steps past it
+void pt_iter_read_line(PieceIter *it, Line *line)
+{
+    line->count = 0;
+    while (it->piece) {
+        Piece *p = it->piece;
+        const char *data = it->pt->buffers[p->buf].data + p->start + it->offset;
+        size_t n = p->count - it->offset;
+        const char *nl = memchr(data, '\n', n);
+        if (nl) {
+            line_append_str(line, data, nl - data);
+            it->offset += nl - data + 1;
+            if (it->offset == p->count)
+                pt_iter_next_piece(it);
+            return;
+        }
+
+        line_append_str(line, data, n);
+        pt_iter_next_piece(it);
+    }
+}
+
+// Like pt_iter_read_line, but gives up on lines of `max` bytes or more,
+// returning 0 with the iterator left inside the line
+int pt_iter_read_short_line(PieceIter *it, Line *line, size_t max)
+{
+    line->count = 0;
+    while (it->piece) {
+        Piece *p = it->piece;
+        const char *data = it->pt->buffers[p->buf].data + p->start + it->offset;
+        size_t left = p->count - it->offset;
+        size_t n = MIN(left, max - line->count);
+        const char *nl = memchr(data, '\n', n);
+        if (nl) {
+            line_append_str(line, data, nl - data);
+            it->offset += nl - data + 1;
+            if (it->offset == p->count)
+                pt_iter_next_piece(it);
+            return 1;
+        }
+
+        line_append_str(line, data, n);
+        if (line->count == max)
+            return 0;
+        pt_iter_next_piece(it);
+    }
+    return 1;
+}
+
+void pt_iter_free(PieceIter *it)
+{
+    free(it->stack);
+    it->stack = NULL;
+    it->count = 0;
+    it->capacity = 0;
+}
+
+// Writes out iov[0, count) whole, returns -1 on an error
+int save_flush(int fd, struct iovec *iov, size_t count)
+{
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (; count > 0 && (size_t) n >= iov->iov_len; ++iov, --count)
+            n -= iov->iov_len;
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Writes the document to `fd`, returns -1 on an error. The pieces go out
+// in batches of writev straight from the buffers. Long pieces of a mapped
+// original are copied from its file by the kernel instead, which file
+// systems that share extents do without copying at all.
+int pt_save(PieceTable *pt, int fd)
+{
+    pt_index_all(pt);
+    TextBuffer *original = &pt->buffers[BUF_ORIGINAL];
+    int copy = original->mapped;
+    struct iovec iov[SAVE_IOV];
+    size_t count = 0;
+    int result = 0;
+
+    PieceIter it = {0};
+    pt_iter_seek(&it, pt, 0);
+    for (; it.piece && result == 0; pt_iter_next_piece(&it)) {
+        Piece *p = it.piece;
+        size_t done = 0;
+        if (copy && p->buf == BUF_ORIGINAL && p->count >= SAVE_COPY_MIN) {
+            result = save_flush(fd, iov, count);
+            count = 0;
+            loff_t offset = p->start;
+            while (result == 0 && done < p->count) {
+                ssize_t n = copy_file_range(original->fd, &offset, fd, NULL, p->count - done, 0);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                // Not supported between these files, the rest is written
+                if (n <= 0) {
+                    copy = 0;
+                    break;
+                }
+                done += n;
+            }
+        }
+        if (done < p->count) {
+            if (count == SAVE_IOV) {
+                result = save_flush(fd, iov, count);
+                count = 0;
+            }
+            iov[count++] = (struct iovec) { pt->buffers[p->buf].data + p->start + done, p->count - done };
+        }
+    }
+    pt_iter_free(&it);
+
+    if (result == 0 && pt_size(pt) > 0) {
+        if (count == SAVE_IOV) {
+            result = save_flush(fd, iov, count);
+            count = 0;
+        }
+        iov[count++] = (struct iovec) { "\n", 1 };
+    }
+    if (result == 0)
+        result = save_flush(fd, iov, count);
+    return result;
+}
+
+void pt_free(PieceTable *pt)
+{
+    // Every piece goes at once, the tree doesn't need to be walked
+    piece_arena_free(&pt->arena);
+    text_buffer_free(&pt->buffers[BUF_ORIGINAL]);
+    text_buffer_free(&pt->buffers[BUF_ADD]);
+    syntax_free(&pt->syntax);
+    columns_free(&pt->columns);
+    cells_free(&pt->cells);
+    wrap_free(&pt->wrap);
+    pt->root = NULL;
+    pt->last = NULL;
+    pt->scanned = 0;
+    pt->original_end = 0;
+}
+
+// The file of the original buffer was cut to `size` bytes. Its pages past
+// that are gone and the ones before may hold other text by now, so the
+// document starts over as the file is, keeping the mapping. Everything
+// kept about the old text, the edits included, goes.
+void pt_restart(PieceTable *pt, size_t size)
+{
+    TextBuffer *b = &pt->buffers[BUF_ORIGINAL];
+    TextBuffer mapping = *b;
+    b->mapped = 0;
+    b->data = NULL;
+    size_t version = pt->version;
+    pt_free(pt);
+    pt_init(pt);
+    pt_load(pt, mapping.data, size, 1);
+    b->fd = mapping.fd;
+    b->reserved = mapping.reserved;
+    pt->version = version + 1;
+}
+
+// Bytes the document holds against the bytes allocated for it. The gap is
+// what is lost to spare capacity, freed pieces and partly used chunks.
+void pt_memory(PieceTable *pt, size_t *used, size_t *reserved)
+{
+    *used = *reserved = 0;
+    for (size_t i = 0; i < 2; ++i) {
+        TextBuffer *b = &pt->buffers[i];
+        *used += b->count + b->nl_count * sizeof(size_t);
+        *reserved += b->capacity + b->nl_capacity * sizeof(size_t);
+    }
+    *used += pt->arena.live * sizeof(Piece);
+    *reserved += pt->arena.chunk_count * sizeof(PieceChunk);
+    *used += pt->syntax.count;
+    *reserved += pt->syntax.capacity;
+    *used += wrap_count(&pt->wrap) * (sizeof(WrapLine) + sizeof(size_t));
+    *reserved += pt->wrap.capacity * (sizeof(WrapLine) + sizeof(size_t));
+}
+
+// Display column map of line `row`, made afresh when the line has none yet
+CellMap *cells_get(PieceTable *pt, size_t row)
+{
+    CellCache *c = &pt->cells;
+    cells_reserve(c, CELL_LINES);
+    CellMap *m = NULL, *oldest = &c->lines[0];
+    for (size_t k = 0; k < c->count; ++k) {
+        if (c->lines[k].used && c->lines[k].row == row)
+            m = &c->lines[k];
+        if (c->lines[k].used < oldest->used)
+            oldest = &c->lines[k];
+    }
+
+    if (!m) {
+        m = oldest;
+        m->row = row;
+        m->count = 0;
+        cells_push(m, (CellPoint) {0});
+    }
+    m->used = ++c->clock;
+    return m;
+}
+
+// Walks line `row`, `len` bytes at `start`, from its nearest point up to the
+// char holding byte `col` or display column `to`, whichever comes first,
+// and returns where that char starts. Points are added on the way when the
+// walk goes past the last one.
+CellPoint cells_seek(PieceTable *pt, size_t row, size_t start, size_t len, size_t col, size_t to)
+{
+    CellMap *m = cells_get(pt, row);
+    size_t lo = 1, hi = m->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (m->points[mid].col <= col && m->points[mid].cell <= to)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    CellPoint p = m->points[lo - 1];
+    int extend = lo == m->count;
+
+    Line *window = &pt->cells.window;
+    while (p.col < len) {
+        size_t end = MIN(len, p.col + CELL_STRIDE);
+        size_t n = MIN(len, end + UTF8_MAX - 1);
+        line_reserve(window, n - p.col);
+        pt_read(pt, start + p.col, window->data, n - p.col);
+
+        size_t i = 0;
+        p.cell = cell_walk(window->data, n - p.col, end - p.col, &i, p.cell, col - p.col, to);
+        p.col += i;
+        if (p.col < end)
+            break;
+        if (extend && p.col < len)
+            cells_push(m, p);
+    }
+    return p;
+}
+
+// Where the char after the one at `p` on the line at `start`, `len` bytes
+// long, starts. The combining marks on the char are skipped along with it.
+// Past the end of the line a char is one column wide.
+CellPoint cells_next(PieceTable *pt, size_t start, size_t len, CellPoint p)
+{
+    if (p.col >= len)
+        return (CellPoint) { p.col, p.cell + 1 };
+
+    char buf[64];
+    size_t n = pt_read(pt, start + p.col, buf, MIN(sizeof(buf), len - p.col));
+    size_t i = 0;
+    size_t cell = cell_next(buf, n, &i, p.cell);
+    cell_walk(buf, n, n, &i, cell, SIZE_MAX, cell);
+    return (CellPoint) { p.col + i, cell };
+}
+
+// Walks line `len` bytes at `start` wrapped at `width` columns on from `at`
+// up to the first char on row `row`, a window at a time
+void wrap_seek(PieceTable *pt, size_t start, size_t len, size_t width, WrapPoint *at, size_t row, int *wide)
+{
+    Line *window = &pt->cells.window;
+    while (at->col < len && at->row < row) {
+        size_t end = MIN(len, at->col + COLUMN_WINDOW);
+        size_t n = MIN(len, end + UTF8_MAX - 1);
+        line_reserve(window, n - at->col);
+        pt_read(pt, start + at->col, window->data, n - at->col);
+
+        size_t i = 0;
+        *wide |= wrap_walk(at, window->data, n - at->col, end - at->col, &i, width, row);
+        at->col += i;
+        if (at->col < end)
+            break;
+    }
+}
+
+WrapLine wrap_measure(PieceTable *pt, size_t row, size_t width)
+{
+    WrapPoint at = {0};
+    int wide = 0;
+    wrap_seek(pt, pt_line_start(pt, row), pt_line_length(pt, row), width, &at, SIZE_MAX, &wide);
+    return (WrapLine) { at.cell, wrap_rows(&at, width), wide };
+}
+
+// Gets the index ready for `width` columns. Only lines with wide chars are
+// walked again for a new width, the rows of the others follow from their
+// display width.
+WrapIndex *wrap_prepare(PieceTable *pt, size_t width)
+{
+    WrapIndex *w = &pt->wrap;
+    if (w->width != width) {
+        w->width = width;
+        for (size_t row = 0; row < wrap_count(w); ++row) {
+            WrapLine *line = &w->lines[wrap_slot(w, row)];
+            if (line->wide)
+                line->rows = wrap_measure(pt, row, width).rows;
+            else
+                line->rows = line->cells > 0 ? (line->cells + width - 1) / width : 1;
+        }
+        wrap_rebuild(w);
+    }
+
+    size_t end = MIN(w->dirty_end, wrap_count(w));
+    for (size_t row = w->dirty; row < end; ++row)
+        wrap_set(w, wrap_slot(w, row), wrap_measure(pt, row, width));
+    w->dirty = w->dirty_end = 0;
+    return w;
+}
+
+// Measures the lines past the last one in the index, until line `row` is
+// in it or the rows add up to more than `rows`
+void wrap_extend(PieceTable *pt, WrapIndex *w, size_t row, size_t rows)
+{
+    size_t count = wrap_count(w);
+    size_t total = wrap_prefix(w, w->capacity);
+    if (count > row || total > rows || !pt_has_line(pt, count))
+        return;
+
+    wrap_move_gap(w, count);
+    size_t start = pt_line_start(pt, count);
+    PieceIter it = {0};
+    Line line = {0};
+    pt_iter_seek(&it, pt, start);
+    for (; count <= row && total <= rows && pt_has_line(pt, count); ++count) {
+        // The line is read whole, indexing more of the file changes the tree
+        // under the iterator
+        size_t scanned = pt->scanned;
+        pt_index_lines(pt, count + 1);
+        if (pt->scanned != scanned)
+            pt_iter_seek(&it, pt, start);
+
+        WrapPoint at = {0};
+        int wide = 0;
+        size_t len;
+        if (pt_iter_read_short_line(&it, &line, LONG_LINE)) {
+            size_t i = 0;
+            len = line.count;
+            wide = wrap_walk(&at, line.data, len, len, &i, w->width, SIZE_MAX);
+        } else {
+            len = pt_line_length(pt, count);
+            wrap_seek(pt, start, len, w->width, &at, SIZE_MAX, &wide);
+            pt_iter_seek(&it, pt, start + len + 1);
+        }
+        WrapLine measured = { at.cell, wrap_rows(&at, w->width), wide };
+        wrap_reserve(w, 1);
+        wrap_set(w, w->gap++, measured);
+        total += measured.rows;
+        start += len + 1;
+    }
+    line_free(&line);
+    pt_iter_free(&it);
+}
+
+// Display width and rows of line `row` wrapped at `width` columns
+WrapLine wrap_info(PieceTable *pt, size_t width, size_t row)
+{
+    WrapIndex *w = wrap_prepare(pt, width);
+    wrap_extend(pt, w, row, SIZE_MAX);
+    if (row >= wrap_count(w))
+        return (WrapLine) { .rows = 1 };
+    return w->lines[wrap_slot(w, row)];
+}
+
+// Screen row line `row` starts at with lines wrapped at `width` columns,
+// counting from the top of the document
+size_t wrap_row(PieceTable *pt, size_t width, size_t row)
+{
+    WrapIndex *w = wrap_prepare(pt, width);
+    wrap_extend(pt, w, row, SIZE_MAX);
+    return wrap_prefix(w, wrap_slot(w, MIN(row, wrap_count(w))));
+}
+
+// Line at screen row `rows` with lines wrapped at `width` columns, counting
+// from the top of the document, and the rows of it above that. Past the
+// end it is the last row of the last line.
+size_t wrap_line(PieceTable *pt, size_t width, size_t rows, size_t *skip)
+{
+    WrapIndex *w = wrap_prepare(pt, width);
+    wrap_extend(pt, w, SIZE_MAX, rows);
+    size_t total = wrap_prefix(w, w->capacity);
+    if (total == 0) {
+        *skip = 0;
+        return 0;
+    }
+    if (rows >= total)
+        rows = total - 1;
+
+    // Goes down the tree taking in every subtree that ends at or above the
+    // row, the slots of the gap have no rows so it never stops in there
+    size_t slot = 0, step = 1;
+    while (step * 2 <= w->capacity)
+        step *= 2;
+    for (; step > 0; step /= 2) {
+        if (slot + step <= w->capacity && w->tree[slot + step] <= rows) {
+            slot += step;
+            rows -= w->tree[slot];
+        }
+    }
+    *skip = rows;
+    return slot < w->gap ? slot : slot - (w->gap_end - w->gap);
+}
+
+// Row of line `row` wrapped at `width` columns that display column `cell` is
+// drawn on, and the display column that row starts at
+size_t wrap_cursor(PieceTable *pt, size_t width, size_t row, size_t cell, size_t *left)
+{
+    WrapLine line = wrap_info(pt, width, row);
+    size_t r = MIN(cell / width, line.rows - 1);
+    *left = r * width;
+    if (!line.wide)
+        return r;
+
+    size_t start = pt_line_start(pt, row), len = pt_line_length(pt, row);
+    WrapPoint at = {0};
+    int wide = 0;
+    *left = 0;
+    for (r = 0; r + 1 < line.rows; ++r) {
+        wrap_seek(pt, start, len, width, &at, r + 1, &wide);
+        size_t next = wrap_start(&at, r + 1, width);
+        if (next > cell)
+            break;
+        *left = next;
+    }
+    return r;
+}
+
+// Forgets what the terminal shows, the next frame clears and redraws everything
+void screen_invalidate(Screen *s)
+{
+    // No drawn cell is ever NUL, so everything compares as changed
+    memset(s->front, 0, sizeof(Cell) * s->width * s->height);
+    s->clear = 1;
+}
+
+void screen_resize(Screen *s, size_t width, size_t height)
+{
+    if (s->width == width && s->height == height)
+        return;
+
+    s->width = width;
+    s->height = height;
+    line_reserve(&s->out, width * height * FRAME_BYTES_PER_CELL);
+    s->front = realloc(s->front, sizeof(Cell) * width * height);
+    s->back = realloc(s->back, sizeof(Cell) * width * height);
+    if ((!s->front || !s->back) && width * height > 0) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    screen_invalidate(s);
+}
+
+void screen_fill(Screen *s, size_t x, size_t y, size_t n, char ch, Style style)
+{
+    if (y >= s->height)
+        return;
+
+    Cell *row = &s->back[y * s->width];
+    Cell cell = { .ch = { ch }, .style = style };
+    // Copied as one word, a cell put together a byte at a time inside the
+    // loop makes every copy wait on the bytes just stored
+    uint64_t bits;
+    memcpy(&bits, &cell, sizeof(bits));
+    for (size_t i = x; i < x + n && i < s->width; ++i)
+        memcpy(&row[i], &bits, sizeof(bits));
+}
+
+// Puts `len` bytes of UTF-8 into cell c
+void cell_set(Cell *c, const char *data, size_t len, Style style)
+{
+    memset(c, 0, sizeof(Cell));
+    memcpy(c->ch, data, len);
+    c->style = style;
+}
+
+// Draws the char data[0, len) at column x of row y and returns the columns
+// it takes. Anything that would move the terminal cursor is shown as a
+// placeholder, a wide char that doesn't fit as a blank and a combining mark
+// goes into the cell before it, as long as there is room.
+size_t screen_char(Screen *s, size_t x, size_t y, const char *data, size_t len, Style style)
+{
+    if (y >= s->height || x >= s->width)
+        return 0;
+
+    Cell *row = &s->back[y * s->width];
+    uint32_t cp;
+    utf8_decode(data, len, &cp);
+    size_t width = char_width(cp);
+    if (cp < 32 || cp == 127 || (cp >= 0x80 && cp < 0xa0) || (cp == UTF8_INVALID && len == 1)) {
+        data = "?";
+        len = width = 1;
+    }
+
+    if (width == 0) {
+        if (x > 0 && row[x - 1].ch[0] == CELL_WIDE)
+            x--;
+        if (x == 0)
+            return 0;
+        Cell *c = &row[x - 1];
+        size_t used = strnlen(c->ch, CELL_BYTES);
+        if (used > 0 && used + len <= CELL_BYTES)
+            memcpy(c->ch + used, data, len);
+        return 0;
+    }
+    if (width == 2 && x + 1 >= s->width) {
+        screen_fill(s, x, y, 1, ' ', style);
+        return 1;
+    }
+
+    cell_set(&row[x], data, len, style);
+    if (width == 2)
+        cell_set(&row[x + 1], (char[]) { CELL_WIDE }, 1, style);
+    return width;
+}
+
+void screen_puts(Screen *s, size_t x, size_t y, const char *str, size_t len, Style style)
+{
+    for (size_t i = 0; i < len && x < s->width;) {
+        uint32_t cp;
+        size_t n = utf8_decode(&str[i], len - i, &cp);
+        // Tabs take a single column here, there are no tab stops to line up with
+        x += screen_char(s, x, y, cp == '\t' ? " " : &str[i], n, style);
+        i += n;
+    }
+}
+
+// Draws data[0, n), whose first char starts at display column `cell` and
+// whose bytes are styled by `styles`, as the display columns [from, to) at
+// column x of row y. Tabs and the parts of wide chars cut off by the edges
+// are drawn as blanks. Returns the display column drawing stopped at.
+size_t screen_text(Screen *s, size_t x, size_t y, const char *data, size_t n, const unsigned char *styles,
+        size_t cell, size_t from, size_t to)
+{
+    if (y >= s->height)
+        return cell;
+
+    Cell *row = &s->back[y * s->width];
+    size_t i = 0;
+    while (i < n) {
+        // Printable ASCII is one byte to a column
+        unsigned char c = data[i];
+        if (c >= 32 && c < 127 && cell >= from && cell < to && x + cell - from < s->width) {
+            cell_set(&row[x + cell - from], &data[i], 1, styles[i]);
+            cell++;
+            i++;
+            continue;
+        }
+
+        size_t j = i;
+        size_t next = cell_next(data, n, &j, cell);
+        if (cell > to || (cell == to && next > cell))
+            break;
+        if (data[i] == '\t' || cell < from || next > to) {
+            size_t a = cell > from ? cell : from, b = MIN(next, to);
+            if (a < b)
+                screen_fill(s, x + a - from, y, b - a, ' ', styles[i]);
+        } else if (next > cell || cell > from) {
+            screen_char(s, x + cell - from, y, &data[i], j - i, styles[i]);
+        }
+        cell = next;
+        i = j;
+    }
+    return cell;
+}
+
+int cell_equal(Cell a, Cell b)
+{
+    return memcmp(&a, &b, sizeof(Cell)) == 0;
+}
+
+// Scrolls rows [top, bottom) by `delta` rows, positive moving the contents
+// up. The terminal is told to do the same with a scroll region, so only
+// the rows that scroll into view have to be drawn.
+void screen_scroll(Screen *s, size_t top, size_t bottom, long delta)
+{
+    size_t n = delta < 0 ? -delta : delta;
+    if (s->clear || s->scroll != 0 || n == 0 || n >= bottom - top)
+        return;
+
+    s->scroll_top = top;
+    s->scroll_bottom = bottom;
+    s->scroll = delta;
+
+    size_t kept = (bottom - top - n) * s->width;
+    Cell *first = &s->front[top * s->width];
+    if (delta > 0) {
+        memmove(first, first + n * s->width, sizeof(Cell) * kept);
+        memset(first + kept, 0, sizeof(Cell) * n * s->width);
+    } else {
+        memmove(first + n * s->width, first, sizeof(Cell) * kept);
+        memset(first, 0, sizeof(Cell) * n * s->width);
+    }
+}
+
+void screen_emit(Screen *s, const char *str)
+{
+    line_append_str(&s->out, str, strlen(str));
+}
+
+void screen_emit_move(Screen *s, size_t x, size_t y)
+{
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "\033[%zu;%zuH", y + 1, x + 1);
+    line_append_str(&s->out, buf, n);
+}
+
+// Writes the assembled frame to `out`, counting bytes and syscalls
+void screen_write(Screen *s, FILE *out)
+{
+    s->frame_bytes = s->out.count;
+    s->frame_syscalls = 0;
+
+    int fd = fileno(out);
+    if (fd < 0) {
+        // In-memory streams used by the tests and benchmarks
+        fwrite(s->out.data, sizeof(char), s->out.count, out);
+        fflush(out);
+        s->frame_syscalls = 1;
+        return;
+    }
+
+    size_t written = 0;
+    while (written < s->out.count) {
+        ssize_t n = write(fd, s->out.data + written, s->out.count - written);
+        s->frame_syscalls++;
+        if (n < 0)
+            return;
+        written += n;
+    }
+}
+
+// Sends the cells of `back` that differ from `front` to `out` and leaves
+// the cursor at (cx, cy)
+void screen_flush(Screen *s, FILE *out, size_t cx, size_t cy)
+{
+    s->out.count = 0;
+    if (s->sync)
+        screen_emit(s, SYNC_BEGIN);
+    if (s->clear) {
+        screen_emit(s, CLEAR_SCREEN);
+        s->clear = 0;
+    }
+
+    int style = -1;
+    if (s->scroll != 0) {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "\033[%zu;%zur", s->scroll_top + 1, s->scroll_bottom);
+        line_append_str(&s->out, buf, n);
+        // Rows scrolling in are cleared with the current background
+        style = STYLE_TEXT;
+        screen_emit(s, style_sgr[style]);
+        if (s->scroll > 0) {
+            screen_emit_move(s, 0, s->scroll_bottom - 1);
+            for (long i = 0; i < s->scroll; ++i)
+                screen_emit(s, INDEX);
+        } else {
+            screen_emit_move(s, 0, s->scroll_top);
+            for (long i = 0; i < -s->scroll; ++i)
+                screen_emit(s, REVERSE_INDEX);
+        }
+        screen_emit(s, RESET_REGION);
+        s->scroll = 0;
+    }
+
+    for (size_t y = 0; y < s->height; ++y) {
+        Cell *front = &s->front[y * s->width];
+        Cell *back = &s->back[y * s->width];
+
+        // Trailing run of blanks that can be drawn with a single erase
+        size_t blank = s->width;
+        while (blank > 0 && back[blank - 1].ch[0] == ' ' && !back[blank - 1].ch[1] &&
+                back[blank - 1].style == back[s->width - 1].style)
+            blank--;
+
+        size_t x = 0;
+        while (x < s->width) {
+            if (cell_equal(front[x], back[x])) {
+                x++;
+                continue;
+            }
+
+            screen_emit_move(s, x, y);
+            size_t same = 0;
+            while (x < s->width && same < DAMAGE_GAP) {
+                if (x >= blank) {
+                    if (style != back[x].style) {
+                        style = back[x].style;
+                        screen_emit(s, style_sgr[style]);
+                    }
+                    screen_emit(s, ERASE_LINE);
+                    x = s->width;
+                    break;
+                }
+
+                same = cell_equal(front[x], back[x]) ? same + 1 : 0;
+                if (style != back[x].style) {
+                    style = back[x].style;
+                    screen_emit(s, style_sgr[style]);
+                }
+                // The terminal moves past both halves of a wide char at once
+                if (back[x].ch[0] != CELL_WIDE)
+                    line_append_str(&s->out, back[x].ch, back[x].ch[1] ? strnlen(back[x].ch, CELL_BYTES) : 1);
+                x++;
+            }
+        }
+    }
+
+    memcpy(s->front, s->back, sizeof(Cell) * s->width * s->height);
+    screen_emit_move(s, cx, cy);
+    if (s->sync)
+        screen_emit(s, SYNC_END);
+    screen_write(s, out);
+}
+
+void screen_free(Screen *s)
+{
+    free(s->front);
+    free(s->back);
+    line_free(&s->out);
+    memset(s, 0, sizeof(*s));
+}
+
+void *renderer_run(void *arg)
+{
+    Renderer *r = arg;
+    Screen *s = &r->screen;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->pending && !r->stop)
+            pthread_cond_wait(&r->changed, &r->lock);
+        if (!r->pending)
+            break;
+
+        screen_resize(s, r->width, r->height);
+        memcpy(s->back, r->cells, sizeof(Cell) * r->width * r->height);
+        if (r->clear)
+            screen_invalidate(s);
+        else if (r->scroll != 0)
+            screen_scroll(s, r->scroll_top, r->scroll_bottom, r->scroll);
+        size_t cx = r->cx, cy = r->cy;
+        r->clear = 0;
+        r->scroll = 0;
+        r->pending = 0;
+        pthread_mutex_unlock(&r->lock);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += r->frame_ns;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        TRACE_BEGIN(flush);
+        screen_flush(s, r->out, cx, cy);
+        TRACE_END(TRACE_FLUSH, flush);
+
+        pthread_mutex_lock(&r->lock);
+        r->drawn++;
+        r->frame_bytes = s->frame_bytes;
+        r->frame_syscalls = s->frame_syscalls;
+        // Frames handed over meanwhile replace each other until the frame
+        // time is up
+        while (r->frame_ns > 0 && !r->stop && pthread_cond_timedwait(&r->changed, &r->lock, &deadline) == 0)
+            ;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// Starts drawing frames to `out` at most `fps` times a second (0 for no
+// limit). Returns 0 when no thread could be started.
+int renderer_start(Renderer *r, FILE *out, int fps)
+{
+    r->out = out;
+    r->frame_ns = fps > 0 ? 1000000000L / fps : 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->changed, NULL);
+    if (pthread_create(&r->thread, NULL, renderer_run, r) != 0) {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->changed);
+        return 0;
+    }
+    return 1;
+}
+
+// Hands the frame in the back buffer of `s` to the render thread. A clear
+// or scroll recorded on `s` moves along with it, and the scrolls of frames
+// that were dropped add up.
+void renderer_submit(Renderer *r, Screen *s, size_t cx, size_t cy)
+{
+    pthread_mutex_lock(&r->lock);
+    if (r->width != s->width || r->height != s->height) {
+        r->cells = realloc(r->cells, sizeof(Cell) * s->width * s->height);
+        if (!r->cells && s->width * s->height > 0) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+        r->width = s->width;
+        r->height = s->height;
+    }
+    memcpy(r->cells, s->back, sizeof(Cell) * s->width * s->height);
+
+    if (s->clear) {
+        r->clear = 1;
+        r->scroll = 0;
+    } else if (s->scroll != 0 && !r->clear) {
+        if (r->scroll != 0 && (r->scroll_top != s->scroll_top || r->scroll_bottom != s->scroll_bottom)) {
+            // Different regions don't combine, the frame is diffed in full
+            r->scroll = 0;
+        } else {
+            r->scroll_top = s->scroll_top;
+            r->scroll_bottom = s->scroll_bottom;
+            r->scroll += s->scroll;
+        }
+    }
+    s->clear = 0;
+    s->scroll = 0;
+
+    if (r->pending)
+        r->dropped++;
+    r->pending = 1;
+    r->cx = cx;
+    r->cy = cy;
+    // The status line shows the cost of the last frame that went out
+    s->frame_bytes = r->frame_bytes;
+    s->frame_syscalls = r->frame_syscalls;
+    pthread_cond_signal(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Draws the frame still waiting, if any, and stops the thread
+void renderer_stop(Renderer *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->changed);
+    free(r->cells);
+    screen_free(&r->screen);
+}
+
+int is_word(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Returns n when str[0, n) is a keyword and 0 otherwise. Switching on the
+// length and then the first byte narrows the keyword set down to at most
+// one candidate, so a lookup is a single memcmp
+size_t keyword_match(const char *str, size_t n)
+{
+    const char *keyword = NULL;
+    switch (n) {
+    case 2: keyword = "if"; break;
+    case 3: keyword = "for"; break;
+    case 4: keyword = "else"; break;
+    case 5: keyword = "while"; break;
+    case 6:
+        switch (str[0]) {
+        case 'r': keyword = "return"; break;
+        case 's': keyword = "sizeof"; break;
+        }
+        break;
+    case 8: keyword = "#include"; break;
+    }
+
+    if (!keyword || memcmp(keyword, str, n) != 0)
+        return 0;
+
+    return n;
+}
+
+// Styles the bytes of columns [a, b) that fall inside the window [from, to),
+// `styles` holds the window
+void highlight_span(unsigned char *styles, size_t from, size_t to, size_t a, size_t b, Style style)
+{
+    if (a < from)
+        a = from;
+    if (b > to)
+        b = to;
+    if (!styles || a >= b)
+        return;
+
+    memset(&styles[a - from], style, b - a);
+}
+
+// Whether only blanks come before data[i], given whether they did before
+// data[*checked]
+int lex_blank(const char *data, size_t *checked, size_t i, int blank)
+{
+    for (; blank && *checked < i; ++*checked)
+        blank = data[*checked] == ' ' || data[*checked] == '\t';
+    return blank;
+}
+
+// Lexes data[0, n), column `p->col` onwards of a line, from the state in
+// `p` and leaves `p` at the token boundary it stopped at, the first one at
+// or past `end`. Bytes past `end` are only looked ahead at unless `eol` says
+// the data runs to the end of the line, which makes `end` equal to `n`.
+// The styles of columns [from, to) go into `styles`, which may be NULL when
+// only the state is wanted. Keywords are looked up only inside the window.
+// Returns 1 when lexing for `index` caught up with its stale points.
+int lex(unsigned char *styles, const char *data, size_t n, size_t end, int eol,
+        size_t from, size_t to, LexPoint *p, ColumnIndex *index)
+{
+    size_t base = p->col;
+    LexState state = p->state;
+    LexState after_comment = p->after;
+    int blank = p->blank;
+    size_t checked = 0;
+    highlight_span(styles, from, to, base, base + n, STYLE_TEXT);
+
+    size_t i = 0;
+    int cut = 0;
+    if (p->word && state == LEX_CODE) {
+        while (i < n && is_word(data[i]))
+            i++;
+        cut = i == n && !eol;
+    }
+    for (;;) {
+        if (index) {
+            blank = lex_blank(data, &checked, i, blank);
+            LexPoint at = { base + i, state, after_comment, blank, cut };
+            if (column_visit(index, &at, eol && i == n)) {
+                *p = at;
+                return 1;
+            }
+        }
+        if (i >= end)
+            break;
+
+        size_t start = i;
+        cut = 0;
+        switch (state) {
+        case LEX_CODE: {
+            char c = data[i];
+            if (c == '/' && i + 1 < n && (data[i + 1] == '*' || data[i + 1] == '/')) {
+                state = data[i + 1] == '*' ? LEX_COMMENT : LEX_LINE_COMMENT;
+                after_comment = LEX_CODE;
+                i += 2;
+                highlight_span(styles, from, to, base + start, base + i, STYLE_COMMENT);
+                continue;
+            }
+            if (c == '"') {
+                state = LEX_STRING;
+                i++;
+                highlight_span(styles, from, to, base + start, base + i, STYLE_STRING);
+                continue;
+            }
+            if (c == '#') {
+                blank = lex_blank(data, &checked, i, blank);
+                if (blank) {
+                    state = LEX_PREPROC;
+                    continue;
+                }
+            }
+            if (c == '\'') {
+                state = LEX_CHAR;
+                i++;
+                highlight_span(styles, from, to, base + start, base + i, STYLE_STRING);
+                continue;
+            }
+            if (!is_word(c)) {
+                i++;
+                continue;
+            }
+            while (i < n && is_word(data[i]))
+                i++;
+            // A word running off the data is longer than any keyword
+            cut = i == n && !eol;
+            if (!cut && base + i > from && base + start < to && i - start <= KEYWORD_MAX &&
+                    keyword_match(&data[start], i - start))
+                highlight_span(styles, from, to, base + start, base + i, STYLE_KEYWORD);
+            break;
+        }
+        case LEX_COMMENT:
+            while (i < end && !(data[i] == '*' && i + 1 < n && data[i + 1] == '/'))
+                i++;
+            if (i < end) {
+                i += 2;
+                state = after_comment;
+            }
+            highlight_span(styles, from, to, base + start, base + i, STYLE_COMMENT);
+            break;
+        case LEX_STRING:
+        case LEX_CHAR: {
+            char quote = state == LEX_STRING ? '"' : '\'';
+            while (i < end && data[i] != quote)
+                i += data[i] == '\\' ? 2 : 1;
+            if (i < end) {
+                i++;
+                state = LEX_CODE;
+            } else {
+                i = MIN(i, n);
+            }
+            highlight_span(styles, from, to, base + start, base + i, STYLE_STRING);
+        } break;
+        case LEX_PREPROC:
+            while (i < end && !(data[i] == '/' && i + 1 < n && (data[i + 1] == '*' || data[i + 1] == '/')))
+                i++;
+            highlight_span(styles, from, to, base + start, base + i, STYLE_PREPROC);
+            if (i < end) {
+                state = data[i + 1] == '*' ? LEX_COMMENT : LEX_LINE_COMMENT;
+                after_comment = LEX_PREPROC;
+                i += 2;
+                highlight_span(styles, from, to, base + i - 2, base + i, STYLE_COMMENT);
+            }
+            break;
+        case LEX_LINE_COMMENT:
+            i = end;
+            highlight_span(styles, from, to, base + start, base + i, STYLE_COMMENT);
+            break;
+        }
+    }
+
+    blank = lex_blank(data, &checked, i, blank);
+    *p = (LexPoint) { base + i, state, after_comment, blank, cut };
+    return 0;
+}
+
+// Where lexing starts on a line that begins in `state`
+LexPoint lex_start(LexState state)
+{
+    return (LexPoint) {
+        .state = state,
+        .after = state == LEX_PREPROC ? LEX_PREPROC : LEX_CODE,
+        .blank = 1,
+    };
+}
+
+// State the next line starts in, from where lexing stopped at the end of a
+// line whose last byte is `last`
+LexState lex_end(LexPoint *p, char last)
+{
+    // Comments go on until they are closed, everything else only while the
+    // newline is escaped
+    LexState state = p->state == LEX_CHAR ? LEX_CODE : p->state;
+    if (state == LEX_COMMENT)
+        return state;
+    if (last == '\\' && state != LEX_CODE)
+        return state;
+    return LEX_CODE;
+}
+
+// Most bytes of a line drawn in a window `width` display columns wide. Every
+// char but a combining mark takes a column, with room for the marks on the
+// last one.
+size_t text_window(size_t width)
+{
+    return width * UTF8_MAX + CELL_BYTES;
+}
+
+// Lexes a line that starts in `state` and returns the state it ends in. The
+// display columns [from, to) are drawn at column x of row y, `s` may be NULL
+// when only the end state is wanted.
+LexState highlight(Screen *s, size_t x, size_t y, Line *line, size_t from, size_t to, LexState state)
+{
+    LexPoint p = lex_start(state);
+    size_t a = 0, b = 0, cell = 0;
+    unsigned char *styles = NULL;
+    if (s) {
+        cell = cell_walk(line->data, line->count, line->count, &a, 0, SIZE_MAX, from);
+        b = MIN(line->count, a + text_window(to - from));
+        styles = malloc(b - a + 1);
+    }
+    lex(styles, line->data, line->count, line->count, 1, a, b, &p, NULL);
+    if (s)
+        screen_text(s, x, y, &line->data[a], b - a, styles, cell, from, to);
+    free(styles);
+    return lex_end(&p, line->count > 0 ? line->data[line->count - 1] : '\0');
+}
+
+// Index of long line `row` lexed from `state`, made afresh when the line
+// has none yet or the line above now ends differently
+ColumnIndex *column_get(PieceTable *pt, size_t row, LexState state)
+{
+    ColumnCache *c = &pt->columns;
+    columns_reserve(c, COLUMN_LINES);
+    ColumnIndex *ci = NULL, *oldest = &c->lines[0];
+    for (size_t k = 0; k < c->count; ++k) {
+        if (c->lines[k].used && c->lines[k].row == row)
+            ci = &c->lines[k];
+        if (c->lines[k].used < oldest->used)
+            oldest = &c->lines[k];
+    }
+
+    if (!ci || ci->start != state) {
+        ci = ci ? ci : oldest;
+        ci->row = row;
+        ci->start = state;
+        ci->gap = 0;
+        ci->gap_end = ci->capacity;
+        ci->shift = 0;
+        ci->stale = 0;
+        column_insert(ci, lex_start(state));
+    }
+    ci->used = ++c->clock;
+    return ci;
+}
+
+// Lexes the line at `start`, `len` bytes long, on from its last right point
+// until a right point at or past column `col` or at the end of the line
+void column_extend(PieceTable *pt, ColumnIndex *ci, size_t start, size_t len, size_t col)
+{
+    Line *window = &pt->columns.window;
+    for (;;) {
+        size_t right = column_right(ci);
+        LexPoint p = column_at(ci, right - 1);
+        if (p.col >= col || p.col == len)
+            return;
+        // Lexing goes on past every point there is
+        if (!ci->stale)
+            column_move_gap(ci, right);
+
+        size_t end = MIN(len, p.col + COLUMN_WINDOW);
+        size_t n = MIN(len, end + LEX_LOOKAHEAD);
+        int eol = n == len;
+        line_reserve(window, n - p.col);
+        pt_read(pt, start + p.col, window->data, n - p.col);
+        lex(NULL, window->data, n - p.col, (eol ? n : end) - p.col, eol, 0, 0, &p, ci);
+    }
+}
+
+// Last lexer point at or before column `col` of long line `row`
+LexPoint column_seek(PieceTable *pt, size_t row, LexState state, size_t start, size_t len, size_t col)
+{
+    ColumnIndex *ci = column_get(pt, row, state);
+    column_extend(pt, ci, start, len, col);
+    return column_at(ci, column_find(ci, column_right(ci), col) - 1);
+}
+
+// State the line after long line `row` starts in
+LexState column_end_state(PieceTable *pt, size_t row, LexState state, size_t start, size_t len)
+{
+    LexPoint p = column_seek(pt, row, state, start, len, len);
+    char last = '\0';
+    if (len > 0)
+        pt_read(pt, start + len - 1, &last, 1);
+    return lex_end(&p, last);
+}
+
+// Lexes line `row` from the iterator at its start and leaves the iterator
+// at the next line. Long lines go through their column index, so only the
+// part after an edit is lexed again.
+LexState syntax_lex_line(PieceTable *pt, PieceIter *it, size_t row, Line *line, LexState state)
+{
+    if (pt_iter_read_short_line(it, line, LONG_LINE))
+        return highlight(NULL, 0, 0, line, 0, 0, state);
+
+    size_t start = pt_line_start(pt, row);
+    size_t len = pt_line_length(pt, row);
+    pt_iter_seek(it, pt, start + len + 1);
+    return column_end_state(pt, row, state, start, len);
+}
+
+// Makes sure the state at the start of every line up to `row` is cached.
+// Lines are lexed from the first unknown one, and once one ends in the state
+// that was cached for the next line before an edit, the rest is reused.
+void syntax_update(PieceTable *pt, size_t row)
+{
+    SyntaxCache *c = &pt->syntax;
+    if (c->count == 0) {
+        syntax_reserve(c, INIT_CAP);
+        c->states[0] = LEX_CODE;
+        c->count = c->valid = c->reuse = 1;
+    }
+    if (c->valid > row || !pt_has_line(pt, c->valid))
+        return;
+
+    Line line = {0};
+    PieceIter it = {0};
+    pt_iter_seek(&it, pt, pt_line_start(pt, c->valid - 1));
+    while (c->valid <= row && pt_has_line(pt, c->valid)) {
+        size_t i = c->valid - 1;
+        LexState state = syntax_lex_line(pt, &it, i, &line, c->states[i]);
+        if (i + 1 >= c->reuse && i + 1 < c->count && c->states[i + 1] == state) {
+            c->valid = c->reuse = c->count;
+            if (c->valid <= row && pt_has_line(pt, c->valid))
+                pt_iter_seek(&it, pt, pt_line_start(pt, c->valid - 1));
+            continue;
+        }
+
+        syntax_reserve(c, i + 2);
+        c->states[i + 1] = state;
+        c->valid = i + 2;
+        if (c->count < c->valid)
+            c->count = c->valid;
+    }
+    // Lexing stopped short of the stale states, which are of no use any more
+    if (c->reuse < c->valid)
+        c->reuse = c->valid;
+    line_free(&line);
+    pt_iter_free(&it);
+}
+
+// Caches the states of the next SYNTAX_STEP lines, returns 0 once every line
+// of the document is cached
+int syntax_step(PieceTable *pt)
+{
+    syntax_update(pt, pt->syntax.valid + SYNTAX_STEP);
+    return pt_has_line(pt, pt->syntax.valid);
+}
+
+// State at the start of `row`. Rows further than `reach` lines past the
+// cache are guessed by lexing the `reach` lines above them from scratch,
+// which keeps a jump into a large file in proportion to the screen.
+LexState syntax_state(PieceTable *pt, size_t row, size_t reach, int *guessed)
+{
+    SyntaxCache *c = &pt->syntax;
+    *guessed = 0;
+    if (row < c->valid)
+        return c->states[row];
+    if (row <= c->valid + reach) {
+        syntax_update(pt, row);
+        return row < c->valid ? c->states[row] : LEX_CODE;
+    }
+
+    *guessed = 1;
+    Line line = {0};
+    PieceIter it = {0};
+    LexState state = LEX_CODE;
+    pt_iter_seek(&it, pt, pt_line_start(pt, row - reach));
+    for (size_t i = row - reach; i < row; ++i)
+        state = syntax_lex_line(pt, &it, i, &line, state);
+    line_free(&line);
+    pt_iter_free(&it);
+    return state;
+}
+
+void search_push_span(Search *s, const char *data, size_t len)
+{
+    if (s->span_capacity < s->span_count + 1) {
+        s->span_capacity = s->span_capacity == 0 ? INIT_CAP : s->span_capacity * 2;
+        s->spans = realloc(s->spans, sizeof(Span) * s->span_capacity);
+        if (!s->spans) {
+            fprintf(stderr, "ERROR: Not enough memory...\n");
+            exit(1);
+        }
+    }
+
+    s->spans[s->span_count++] = (Span) { .data = data, .pos = s->size, .len = len };
+    s->size += len;
+}
+
+// Lists the document as spans for the worker. The original buffer stays put
+// while the editor runs, the add buffer moves when it grows, so the worker
+// gets a copy of that one.
+void search_snapshot(Search *s, PieceTable *pt)
+{
+    TextBuffer *add = &pt->buffers[BUF_ADD];
+    s->copy = malloc(add->count + 1);
+    if (!s->copy) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    if (add->count > 0)
+        memcpy(s->copy, add->data, add->count);
+
+    s->span_count = 0;
+    s->size = 0;
+    PieceIter it = {0};
+    for (pt_iter_seek(&it, pt, 0); it.piece; pt_iter_next_piece(&it)) {
+        Piece *p = it.piece;
+        const char *data = p->buf == BUF_ADD ? s->copy : pt->buffers[BUF_ORIGINAL].data;
+        search_push_span(s, data + p->start, p->count);
+    }
+    pt_iter_free(&it);
+
+    // The part of the file that isn't indexed yet follows the pieces as it is
+    if (pt->scanned < pt->original_end)
+        search_push_span(s, pt->buffers[BUF_ORIGINAL].data + pt->scanned, pt->original_end - pt->scanned);
+}
+
+// Document bytes [pos, pos + len), in place when a single span holds them
+const char *search_range(Search *s, size_t pos, size_t len, Line *buf)
+{
+    size_t lo = 0, hi = s->span_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->spans[mid].pos <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    Span *span = &s->spans[lo];
+    if (pos + len <= span->pos + span->len)
+        return span->data + (pos - span->pos);
+
+    buf->count = 0;
+    for (size_t i = lo; buf->count < len; ++i) {
+        size_t offset = pos + buf->count - s->spans[i].pos;
+        line_append_str(buf, s->spans[i].data + offset, MIN(s->spans[i].len - offset, len - buf->count));
+    }
+    return buf->data;
+}
+
+// Offset of the first newline at or after `pos`, or the size of the document
+size_t search_next_newline(Search *s, size_t pos)
+{
+    size_t lo = 0, hi = s->span_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->spans[mid].pos <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    for (size_t i = lo; i < s->span_count; ++i) {
+        Span *span = &s->spans[i];
+        size_t offset = pos > span->pos ? pos - span->pos : 0;
+        const char *nl = memchr(span->data + offset, '\n', span->len - offset);
+        if (nl)
+            return span->pos + (nl - span->data);
+    }
+    return s->size;
+}
+
+// Runs the regex over the lines that begin in chunk `k`
+void search_regex_chunk(Search *s, size_t k, SearchChunk *chunk, Line *buf)
+{
+    size_t pos = k * SEARCH_CHUNK;
+    size_t end = MIN(pos + SEARCH_CHUNK, s->size);
+    size_t first = pos == 0 ? 0 : search_next_newline(s, pos - 1) + 1;
+    if (first >= end) {
+        chunk->reach = SIZE_MAX;
+        return;
+    }
+
+    size_t last = search_next_newline(s, end - 1);
+    chunk->reach = last;
+    regex_scan(&s->regex, search_range(s, first, last - first, buf), last - first, first, &chunk->matches);
+}
+
+void *search_run(void *arg)
+{
+    Search *s = arg;
+    SubstringScanner scan = substring_scanner_get();
+    size_t n = s->pattern.count;
+    Line buf = {0};
+
+    for (size_t i = 0; i < s->chunk_count; ++i) {
+        size_t k = s->forward
+            ? (s->origin + i) % s->chunk_count
+            : (s->origin + s->chunk_count - i) % s->chunk_count;
+        pthread_mutex_lock(&s->lock);
+        int cancel = s->cancel;
+        pthread_mutex_unlock(&s->lock);
+        if (cancel)
+            break;
+
+        SearchChunk found = {0};
+        if (!s->is_regex) {
+            size_t pos = k * SEARCH_CHUNK;
+            size_t starts = MIN(SEARCH_CHUNK, s->size - n + 1 - pos);
+            scan(search_range(s, pos, starts + n - 1, &buf), starts, s->pattern.data, n, pos, &found.matches);
+            found.reach = pos + starts;
+        } else {
+            search_regex_chunk(s, k, &found, &buf);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        s->chunks[k] = found;
+        s->chunks[k].done = 1;
+        s->chunks_done++;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    line_free(&buf);
+    return NULL;
+}
+
+// Cancels the worker and waits for it. The chunks it finished are kept.
+void search_stop(Search *s)
+{
+    if (!s->running)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    s->cancel = 1;
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    s->running = 0;
+}
+
+// Drops the matches, the pattern stays for the next search
+void search_clear(Search *s)
+{
+    search_stop(s);
+    if (s->chunks) {
+        for (size_t k = 0; k < s->chunk_count; ++k)
+            matches_free(&s->chunks[k].matches);
+        free(s->chunks);
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->changed);
+    }
+    free(s->spans);
+    free(s->copy);
+    s->spans = NULL;
+    s->span_count = s->span_capacity = 0;
+    s->copy = NULL;
+    s->chunks = NULL;
+    s->chunk_count = s->chunks_done = 0;
+    s->active = 0;
+    s->jump = 0;
+    s->edited = 0;
+}
+
+// Searches the document for the pattern in the background, starting at `pos`
+void search_start(Search *s, PieceTable *pt, size_t pos)
+{
+    search_clear(s);
+    search_snapshot(s, pt);
+    s->version = pt->version;
+    s->active = 1;
+    s->cancel = 0;
+
+    size_t n = s->is_regex ? 1 : s->pattern.count;
+    s->chunk_count = n > 0 && s->size >= n ? (s->size - n) / SEARCH_CHUNK + 1 : 0;
+    s->chunks = calloc(s->chunk_count + 1, sizeof(SearchChunk));
+    if (!s->chunks) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->changed, NULL);
+    if (s->chunk_count == 0)
+        return;
+
+    s->origin = MIN(pos / SEARCH_CHUNK, s->chunk_count - 1);
+    if (pthread_create(&s->thread, NULL, search_run, s) == 0)
+        s->running = 1;
+    else
+        search_run(s);
+}
+
+// Whether the worker is still scanning
+int search_busy(Search *s)
+{
+    if (!s->running)
+        return 0;
+
+    pthread_mutex_lock(&s->lock);
+    int busy = s->chunks_done < s->chunk_count;
+    pthread_mutex_unlock(&s->lock);
+    return busy;
+}
+
+// Waits until the worker finishes another chunk or `deadline` passes.
+// Returns 0 once there is nothing left to wait for.
+int search_wait(Search *s, struct timespec *deadline)
+{
+    if (!s->running)
+        return 0;
+
+    pthread_mutex_lock(&s->lock);
+    size_t done = s->chunks_done;
+    int waiting = done < s->chunk_count;
+    while (waiting && s->chunks_done == done)
+        waiting = pthread_cond_timedwait(&s->changed, &s->lock, deadline) == 0;
+    pthread_mutex_unlock(&s->lock);
+    return waiting;
+}
+
+// Chunk `k`, or NULL while the worker hasn't got to it
+SearchChunk *search_chunk(Search *s, size_t k)
+{
+    pthread_mutex_lock(&s->lock);
+    int done = s->chunks[k].done;
+    pthread_mutex_unlock(&s->lock);
+    return done ? &s->chunks[k] : NULL;
+}
+
+// Index of the first match in `m` at or past `pos`
+size_t matches_lower_bound(Matches *m, size_t pos)
+{
+    size_t lo = 0, hi = m->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (m->data[mid].pos < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Index of the first match in `m` that ends past `pos`
+size_t matches_ending_after(Matches *m, size_t pos)
+{
+    size_t lo = 0, hi = m->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (m->data[mid].pos + m->data[mid].len <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Notes an edit that replaced `removed` bytes at `pos` with `added`, the
+// matches are brought up to date only when they are next looked up
+void search_edit(Search *s, PieceTable *pt, size_t pos, size_t removed, size_t added)
+{
+    if (!s->active)
+        return;
+    if (!s->edited) {
+        s->edited = 1;
+        s->dirty = pos;
+        s->dirty_end = pos + added;
+        s->dirty_old_end = pos + removed;
+    } else {
+        s->dirty = MIN(s->dirty, pos);
+        if (pos + removed <= s->dirty_end) {
+            s->dirty_end = s->dirty_end - removed + added;
+        } else {
+            s->dirty_old_end += pos + removed - s->dirty_end;
+            s->dirty_end = pos + added;
+        }
+    }
+    s->edit_version = pt->version;
+}
+
+// Brings the matches up to date with the document. After edits that went
+// through search_edit and stay within a chunk, only the lines they touched
+// are searched again, here, and the other matches move along with them.
+// Otherwise the worker starts over from `pos`.
+void search_refresh(Search *s, PieceTable *pt, size_t pos)
+{
+    if (s->active && s->version == pt->version && (s->running || s->chunks_done == s->chunk_count))
+        return;
+    if (!s->active || !s->edited || s->edit_version != pt->version || search_busy(s)
+        || s->dirty_end - s->dirty > SEARCH_CHUNK) {
+        search_start(s, pt, pos);
+        return;
+    }
+    search_stop(s);
+    if (s->chunks_done < s->chunk_count) {
+        search_start(s, pt, pos);
+        return;
+    }
+
+    size_t size = pt_size(pt);
+    size_t lo = pt_line_start(pt, pt_line_at(pt, s->dirty));
+    size_t row = pt_line_at(pt, s->dirty_end);
+    size_t hi = pt_line_start(pt, row) + pt_line_length(pt, row);
+    size_t old_hi = hi - s->dirty_end + s->dirty_old_end;
+
+    // Matches don't cross lines, so the ones before `lo` and after `hi`
+    // are as they were
+    Matches all = {0};
+    for (size_t k = 0; k < s->chunk_count; ++k) {
+        Matches *m = &s->chunks[k].matches;
+        for (size_t j = 0; j < m->count && m->data[j].pos < lo; ++j)
+            matches_push(&all, m->data[j].pos, m->data[j].len);
+    }
+    Line text = {0};
+    line_reserve(&text, hi - lo);
+    text.count = pt_read(pt, lo, text.data, hi - lo);
+    size_t n = s->pattern.count;
+    if (s->is_regex)
+        regex_scan(&s->regex, text.data, text.count, lo, &all);
+    else if (text.count >= n)
+        substring_scanner_get()(text.data, text.count - n + 1, s->pattern.data, n, lo, &all);
+    for (size_t k = 0; k < s->chunk_count; ++k) {
+        Matches *m = &s->chunks[k].matches;
+        for (size_t j = matches_lower_bound(m, old_hi); j < m->count; ++j)
+            matches_push(&all, m->data[j].pos - old_hi + hi, m->data[j].len);
+        matches_free(m);
+    }
+    line_free(&text);
+
+    n = s->is_regex ? 1 : n;
+    s->chunk_count = n > 0 && size >= n ? (size - n) / SEARCH_CHUNK + 1 : 0;
+    free(s->chunks);
+    s->chunks = calloc(s->chunk_count + 1, sizeof(SearchChunk));
+    if (!s->chunks) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    // Each chunk holds the matches that start in it
+    for (size_t j = 0; j < all.count && s->chunk_count > 0; ++j) {
+        size_t k = MIN(all.data[j].pos / SEARCH_CHUNK, s->chunk_count - 1);
+        matches_push(&s->chunks[k].matches, all.data[j].pos, all.data[j].len);
+    }
+    for (size_t k = 0; k < s->chunk_count; ++k) {
+        s->chunks[k].reach = MIN((k + 1) * SEARCH_CHUNK, size);
+        s->chunks[k].done = 1;
+    }
+    matches_free(&all);
+
+    // The snapshot is only there for the worker
+    free(s->copy);
+    s->copy = NULL;
+    s->span_count = 0;
+    s->size = size;
+    s->chunks_done = s->chunk_count;
+    s->version = pt->version;
+    s->edited = 0;
+}
+
+// Finds the nearest match after `pos`, or before it going backwards, and
+// wraps around the ends of the document. Returns 1 with the match in `out`,
+// 0 when there is none and -1 when a chunk on the way isn't scanned yet.
+int search_find(Search *s, size_t pos, int forward, size_t *out)
+{
+    size_t count = s->chunk_count;
+    if (count == 0)
+        return 0;
+
+    size_t k0 = MIN(pos / SEARCH_CHUNK, count - 1);
+    // The line `pos` is on may begin in an earlier chunk
+    for (SearchChunk *c; k0 > 0; --k0) {
+        if (!(c = search_chunk(s, k0 - 1)))
+            return -1;
+        if (c->reach <= pos)
+            break;
+    }
+
+    for (size_t i = 0; i <= count; ++i) {
+        size_t k = forward ? (k0 + i) % count : (k0 + count - i) % count;
+        SearchChunk *c = search_chunk(s, k);
+        if (!c)
+            return -1;
+
+        Matches *m = &c->matches;
+        if (i == 0) {
+            // Only the matches on the right side of `pos` count here
+            size_t j = matches_lower_bound(m, forward ? pos + 1 : pos);
+            if (forward && j < m->count) {
+                *out = m->data[j].pos;
+                return 1;
+            }
+            if (!forward && j > 0) {
+                *out = m->data[j - 1].pos;
+                return 1;
+            }
+        } else if (m->count > 0) {
+            *out = (forward ? m->data[0] : m->data[m->count - 1]).pos;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void search_paint_matches(Matches *m, size_t j, unsigned char *styles, size_t start, size_t end, size_t from, size_t to)
+{
+    for (; j < m->count && m->data[j].pos < end; ++j) {
+        size_t col = m->data[j].pos - start;
+        highlight_span(styles, from, to, col, col + m->data[j].len, STYLE_MATCH);
+    }
+}
+
+// Paints the matches in columns [from, to) of the line at document offset
+// `start` into `styles`, which holds the window. `line` holds the columns
+// from `offset` on. The matches are looked up once the worker has been
+// through the line in `version` of the document, until then the line is
+// searched here.
+void search_paint(Search *s, size_t version, unsigned char *styles, size_t start, Line *line, size_t offset,
+        size_t from, size_t to)
+{
+    size_t end = start + MIN(offset + line->count, to);
+    size_t first = start / SEARCH_CHUNK, last = first;
+    while (last + 1 < s->chunk_count && (last + 1) * SEARCH_CHUNK < end)
+        last++;
+    int done = first < s->chunk_count && s->version == version;
+    for (size_t k = first; done && k <= last; ++k)
+        done = search_chunk(s, k) != NULL;
+
+    if (!done) {
+        size_t n = s->pattern.count;
+        s->visible.count = 0;
+        // A window of a long line is scanned as if it were the whole line
+        if (s->is_regex)
+            regex_scan(&s->painter, line->data, line->count, start + offset, &s->visible);
+        else if (line->count >= n)
+            substring_scanner_get()(line->data, line->count - n + 1, s->pattern.data, n, start + offset, &s->visible);
+        search_paint_matches(&s->visible, matches_ending_after(&s->visible, start + from), styles, start, end, from, to);
+        return;
+    }
+
+    for (size_t k = first; k <= last; ++k) {
+        Matches *m = &s->chunks[k].matches;
+        search_paint_matches(m, matches_ending_after(m, start + from), styles, start, end, from, to);
+    }
+}
+
+// Takes a new pattern. Returns NULL, or what is wrong with it and keeps the
+// old one.
+const char *search_compile(Search *s, const char *pattern, size_t n)
+{
+    int is_regex = !regex_is_literal(pattern, n);
+    Regex regex, painter;
+    const char *error = NULL;
+    if (is_regex) {
+        if (regex_compile(&regex, pattern, n, &error) < 0)
+            return error;
+        regex_compile(&painter, pattern, n, &error);
+    }
+
+    search_clear(s);
+    if (s->is_regex) {
+        regex_free(&s->regex);
+        regex_free(&s->painter);
+    }
+    s->is_regex = is_regex;
+    if (is_regex) {
+        s->regex = regex;
+        s->painter = painter;
+    }
+    s->pattern.count = 0;
+    line_append_str(&s->pattern, pattern, n);
+    return NULL;
+}
+
+// Styles for a window of `n` bytes of a line
+unsigned char *viewport_styles(Viewport *v, size_t n)
+{
+    line_reserve(&v->styles, n);
+    return (unsigned char *) v->styles.data;
+}
+
+// Line drawn on each screen row
+size_t *viewport_numbers(Viewport *v)
+{
+    line_reserve(&v->numbers, sizeof(size_t) * v->height);
+    return (size_t *) v->numbers.data;
+}
+
+// Pads row y of the text area with blanks from display column `cell` on,
+// where drawing from display column `left` stopped
+void viewport_pad(Viewport *v, size_t y, size_t cell, size_t left)
+{
+    size_t x = v->sidebar;
+    if (cell > left)
+        x += MIN(cell - left, v->width);
+    screen_fill(&v->screen, x, y, v->screen.width - x, ' ', STYLE_TEXT);
+}
+
+// Draws the window of long line `row` of the document, `len` bytes at
+// `start`, from display column `left` on, lexed from the nearest point of
+// its column index. Returns the display column drawing stopped at.
+size_t viewport_write_long(Viewport *v, PieceTable *pt, Search *search, int matches, size_t row, size_t y,
+        size_t start, size_t len, LexState state, size_t left)
+{
+    CellPoint first = cells_seek(pt, row, start, len, SIZE_MAX, left);
+    size_t from = first.col, to = MIN(len, from + text_window(v->width));
+    LexPoint p = column_seek(pt, row, state, start, len, from);
+    size_t col = p.col;
+    size_t n = MIN(len, to + LEX_LOOKAHEAD);
+    int eol = n == len;
+
+    Line *line = &v->line;
+    line_reserve(line, n - col);
+    line->count = pt_read(pt, start + col, line->data, n - col);
+    unsigned char *styles = viewport_styles(v, to - from);
+    lex(styles, line->data, line->count, (eol ? n : to) - col, eol, from, to, &p, NULL);
+    if (matches)
+        search_paint(search, pt->version, styles, start, line, col, from, to);
+    return screen_text(&v->screen, v->sidebar, y, &line->data[from - col], to - from, styles,
+            first.cell, left, left + v->width);
+}
+
+// Draws the visible text into the back buffer, rows past the end of the
+// file are padded with '~'. Matches of a search are painted over the text.
+void viewport_write(Viewport *v, PieceTable *pt, Search *search)
+{
+    Screen *s = &v->screen;
+    size_t *numbers = viewport_numbers(v);
+    // Only the visible lines need to be indexed
+    pt_index_lines(pt, v->top + v->height);
+    // Every line on screen keeps its points from one frame to the next
+    columns_reserve(&pt->columns, v->height + COLUMN_LINES);
+    cells_reserve(&pt->cells, v->height + CELL_LINES);
+    LexState state = LEX_CODE;
+    size_t start = 0;
+    int matches = search->active;
+    v->guessed = 0;
+    if (pt_has_line(pt, v->top)) {
+        state = syntax_state(pt, v->top, v->height, &v->guessed);
+        start = pt_line_start(pt, v->top);
+        pt_iter_seek(&v->iter, pt, start);
+    }
+    for (size_t row = 0; row < v->height; ++row) {
+        size_t i = v->top + row;
+        if (!pt_has_line(pt, i)) {
+            numbers[row] = SIZE_MAX;
+            screen_puts(s, 0, row, "~", 1, STYLE_PAD);
+            screen_fill(s, 1, row, s->width - 1, ' ', STYLE_PAD);
+            continue;
+        }
+        numbers[row] = i;
+
+        Line *line = &v->line;
+        size_t len, cell;
+        if (pt_iter_read_short_line(&v->iter, line, LONG_LINE)) {
+            len = line->count;
+            size_t from = 0;
+            size_t first = cell_walk(line->data, len, len, &from, 0, SIZE_MAX, v->left);
+            size_t to = MIN(len, from + text_window(v->width));
+            unsigned char *styles = viewport_styles(v, to - from);
+            LexPoint p = lex_start(state);
+            lex(styles, line->data, len, len, 1, from, to, &p, NULL);
+            state = lex_end(&p, len > 0 ? line->data[len - 1] : '\0');
+            if (matches)
+                search_paint(search, pt->version, styles, start, line, 0, from, to);
+            cell = screen_text(s, v->sidebar, row, &line->data[from], to - from, styles,
+                    first, v->left, v->left + v->width);
+        } else {
+            // Only the window of a long line is read, and lexed from a point
+            // near it
+            len = pt_line_length(pt, i);
+            cell = viewport_write_long(v, pt, search, matches, i, row, start, len, state, v->left);
+            if (row + 1 < v->height && pt_has_line(pt, i + 1))
+                state = column_end_state(pt, i, state, start, len);
+            pt_iter_seek(&v->iter, pt, start + len + 1);
+        }
+        start += len + 1;
+        viewport_pad(v, row, cell, v->left);
+    }
+}
+
+// Draws the visible text wrapped at the width of the viewport, from row
+// `skip` of line `top` on. Only the first row of a line has its number.
+void viewport_write_wrapped(Viewport *v, PieceTable *pt, Search *search)
+{
+    Screen *s = &v->screen;
+    size_t *numbers = viewport_numbers(v);
+    size_t width = v->width;
+    // A line takes at least a row, and measuring one reads it whole
+    pt_index_lines(pt, v->top + v->height + 1);
+    columns_reserve(&pt->columns, v->height + COLUMN_LINES);
+    cells_reserve(&pt->cells, v->height + CELL_LINES);
+    LexState state = LEX_CODE;
+    size_t start = 0;
+    int matches = search->active;
+    v->guessed = 0;
+    if (pt_has_line(pt, v->top)) {
+        state = syntax_state(pt, v->top, v->height, &v->guessed);
+        start = pt_line_start(pt, v->top);
+        pt_iter_seek(&v->iter, pt, start);
+    }
+    size_t y = 0;
+    for (size_t i = v->top, skip = v->skip; y < v->height; ++i, skip = 0) {
+        if (!pt_has_line(pt, i)) {
+            numbers[y] = SIZE_MAX;
+            screen_puts(s, 0, y, "~", 1, STYLE_PAD);
+            screen_fill(s, 1, y, s->width - 1, ' ', STYLE_PAD);
+            y++;
+            continue;
+        }
+
+        WrapLine wrapped = wrap_info(pt, width, i);
+        if (skip >= wrapped.rows)
+            skip = wrapped.rows - 1;
+        size_t rows = MIN(wrapped.rows - skip, v->height - y);
+        Line *line = &v->line;
+        size_t len;
+        if (pt_iter_read_short_line(&v->iter, line, LONG_LINE)) {
+            len = line->count;
+            WrapPoint at = {0};
+            size_t a = 0;
+            wrap_walk(&at, line->data, len, len, &a, width, skip);
+            size_t from = a, to = MIN(len, from + text_window(width * rows));
+            unsigned char *styles = viewport_styles(v, to - from);
+            LexPoint p = lex_start(state);
+            lex(styles, line->data, len, len, 1, from, to, &p, NULL);
+            state = lex_end(&p, len > 0 ? line->data[len - 1] : '\0');
+            if (matches)
+                search_paint(search, pt->version, styles, start, line, 0, from, to);
+
+            for (size_t k = 0; k < rows; ++k) {
+                wrap_walk(&at, line->data, len, len, &a, width, skip + k);
+                size_t left = wrap_start(&at, skip + k, width);
+                // The rest of a tab from the row above
+                if (at.cell > left)
+                    screen_fill(s, v->sidebar, y + k, MIN(at.cell - left, width), ' ', STYLE_TEXT);
+                size_t b = MIN(a, to);
+                size_t cell = screen_text(s, v->sidebar, y + k, &line->data[b], to - b, &styles[b - from],
+                        at.cell, left, left + width);
+                viewport_pad(v, y + k, cell, left);
+            }
+        } else {
+            len = pt_line_length(pt, i);
+            WrapPoint at = {0};
+            int wide = 0;
+            for (size_t k = 0; k < rows; ++k) {
+                size_t left = (skip + k) * width;
+                if (wrapped.wide) {
+                    wrap_seek(pt, start, len, width, &at, skip + k, &wide);
+                    left = wrap_start(&at, skip + k, width);
+                }
+                size_t cell = viewport_write_long(v, pt, search, matches, i, y + k, start, len, state, left);
+                viewport_pad(v, y + k, cell, left);
+            }
+            if (y + rows < v->height && pt_has_line(pt, i + 1))
+                state = column_end_state(pt, i, state, start, len);
+            pt_iter_seek(&v->iter, pt, start + len + 1);
+        }
+
+        numbers[y] = i;
+        for (size_t k = 1; k < rows; ++k) {
+            numbers[y + k] = SIZE_MAX;
+            screen_fill(s, 0, y + k, v->sidebar, ' ', STYLE_LINE_NUMBER);
+        }
+        start += len + 1;
+        y += rows;
+    }
+}
+
+size_t digits(size_t n)
+{
+    size_t d = 1;
+    while (n >= 10) {
+        n /= 10;
+        d++;
+    }
+    return d;
+}
+
+void viewport_update(Viewport *v, Editor *e)
+{
+    TRACE_BEGIN(update);
+    screen_resize(&v->screen, e->width, e->height);
+    v->height = e->height - STATUS_SZ;
+    // Room for the widest line number on screen and a space
+    v->sidebar = digits(v->top + v->height) + 1;
+    if (v->sidebar < SIDEBAR_SZ)
+        v->sidebar = SIDEBAR_SZ;
+    v->width = e->width - v->sidebar;
+
+    // The display columns the char under the cursor takes
+    PieceTable *pt = &e->text;
+    size_t start = 0, len = 0;
+    if (pt_has_line(pt, e->cy)) {
+        start = pt_line_start(pt, e->cy);
+        len = pt_line_length(pt, e->cy);
+    }
+    CellPoint cursor = cells_seek(pt, e->cy, start, len, e->cx, SIZE_MAX);
+    v->cell = cursor.cell;
+    v->wrap = e->wrap && v->width > 0;
+    if (v->wrap) {
+        // Scrolls by screen rows, the cursor row counted through the wrap index
+        size_t left;
+        size_t cursor_row = wrap_row(pt, v->width, e->cy) + wrap_cursor(pt, v->width, e->cy, cursor.cell, &left);
+        size_t top = wrap_row(pt, v->width, v->top) + v->skip;
+        if (cursor_row < top)
+            top = cursor_row;
+        if (cursor_row >= top + v->height)
+            top = cursor_row - v->height + 1;
+        v->top = wrap_line(pt, v->width, top, &v->skip);
+        v->top_row = top;
+        v->left = 0;
+        v->cursor_x = MIN(cursor.cell - left, v->width - 1);
+        v->cursor_y = cursor_row - top;
+    } else {
+        size_t end = cells_next(pt, start, len, cursor).cell;
+        if (cursor.cell <= v->left) {
+            v->left = cursor.cell;
+        }
+        if (end >= v->left + v->width) {
+            v->left = end - v->width;
+        }
+        if (e->cy <= v->top) {
+            v->top = e->cy;
+        }
+        if (e->cy >= v->top + v->height - 1) {
+            v->top = e->cy - v->height + 1;
+        }
+        v->skip = 0;
+        v->top_row = v->top;
+        v->cursor_x = cursor.cell - v->left;
+        v->cursor_y = e->cy - v->top;
+    }
+
+    TRACE_BEGIN(write);
+    if (v->wrap)
+        viewport_write_wrapped(v, &e->text, &e->search);
+    else
+        viewport_write(v, &e->text, &e->search);
+    TRACE_END(TRACE_WRITE, write);
+    TRACE_END(TRACE_UPDATE, update);
+}
+
+void viewport_free(Viewport *v)
+{
+    line_free(&v->line);
+    line_free(&v->styles);
+    line_free(&v->numbers);
+    pt_iter_free(&v->iter);
+    screen_free(&v->screen);
+}
+
+size_t journal_end(Journal *j)
+{
+    return j->start + j->mem.count;
+}
+
+// Copies log bytes [off, off + n), reading the spilled part back from disk
+void journal_read(Journal *j, size_t off, void *dst, size_t n)
+{
+    char *out = dst;
+    if (off < j->start) {
+        size_t disk = MIN(n, j->start - off);
+        if (pread(j->fd, out, disk, off) != (ssize_t) disk) {
+            fprintf(stderr, "ERROR: Unable to read the undo journal.\n");
+            exit(1);
+        }
+        out += disk;
+        off += disk;
+        n -= disk;
+    }
+    if (n > 0)
+        memcpy(out, &j->mem.data[off - j->start], n);
+}
+
+// The changed bytes of a record, straight from memory when they are there
+const char *journal_bytes(Journal *j, size_t off, size_t n)
+{
+    if (off >= j->start)
+        return &j->mem.data[off - j->start];
+
+    line_reserve(&j->scratch, n);
+    journal_read(j, off, j->scratch.data, n);
+    return j->scratch.data;
+}
+
+// Keeps the log in memory under its cap by moving the oldest half out. It
+// goes to an unlinked temporary file, or with `drop_oldest` (or no file)
+// whole groups are forgotten and can't be undone any more.
+void journal_spill(Journal *j)
+{
+    size_t cap = j->cap ? j->cap : JOURNAL_CAP;
+    if (j->mem.count <= cap)
+        return;
+
+    if (!j->drop_oldest && !j->has_file) {
+        char path[] = "/tmp/cea_undo_XXXXXX";
+        j->fd = mkstemp(path);
+        if (j->fd >= 0) {
+            unlink(path);
+            j->has_file = 1;
+        } else {
+            j->drop_oldest = 1;
+        }
+    }
+
+    size_t n = j->mem.count / 2;
+    if (j->drop_oldest) {
+        size_t off = 0;
+        JournalRecord r = {0};
+        while (off < j->mem.count) {
+            memcpy(&r, &j->mem.data[off], sizeof(r));
+            if (r.first && off >= n)
+                break;
+            off += sizeof(r) + r.len + sizeof(size_t);
+        }
+        // A single group larger than the cap is kept whole
+        if (off >= j->mem.count)
+            return;
+        n = off;
+        j->floor = j->start + n;
+    } else if (pwrite(j->fd, j->mem.data, n, j->start) != (ssize_t) n) {
+        fprintf(stderr, "ERROR: Unable to write the undo journal.\n");
+        exit(1);
+    }
+
+    memmove(j->mem.data, j->mem.data + n, j->mem.count - n);
+    j->mem.count -= n;
+    j->start += n;
+}
+
+// Extends the last record when the edit continues it: typing extends an
+// insert, and `x` or backspace extend a delete
+int journal_merge(Journal *j, JournalKind kind, size_t pos, const char *str, size_t len)
+{
+    if (!j->can_merge || !j->in_group || j->last < j->start)
+        return 0;
+
+    JournalRecord r;
+    memcpy(&r, &j->mem.data[j->last - j->start], sizeof(r));
+    if (r.kind != kind)
+        return 0;
+    int append = kind == JOURNAL_INSERT ? r.pos + r.len == pos : r.pos == pos;
+    int prepend = kind == JOURNAL_DELETE && pos + len == r.pos && r.len + len <= JOURNAL_MERGE_MAX;
+    if (!append && !prepend)
+        return 0;
+
+    j->mem.count -= sizeof(size_t);
+    line_reserve(&j->mem, j->mem.count + len + sizeof(size_t));
+    char *bytes = &j->mem.data[j->last - j->start + sizeof(r)];
+    if (append) {
+        memcpy(bytes + r.len, str, len);
+    } else {
+        memmove(bytes + len, bytes, r.len);
+        memcpy(bytes, str, len);
+        r.pos = pos;
+    }
+    r.len += len;
+    j->mem.count += len;
+    memcpy(&j->mem.data[j->last - j->start], &r, sizeof(r));
+
+    size_t size = sizeof(r) + r.len;
+    line_append_str(&j->mem, (char *) &size, sizeof(size));
+    return 1;
+}
+
+// Appends an edit to the log. Whatever was undone before it can't be redone
+// any more.
+void journal_record(Journal *j, JournalKind kind, size_t pos, const char *str, size_t len)
+{
+    if (len == 0)
+        return;
+
+    // Spilled bytes past the cursor are simply overwritten by later spills
+    if (j->cursor < j->start) {
+        j->start = j->cursor;
+        j->mem.count = 0;
+    } else {
+        j->mem.count = j->cursor - j->start;
+    }
+
+    if (!journal_merge(j, kind, pos, str, len)) {
+        JournalRecord r = { .kind = kind, .first = !j->in_group, .pos = pos, .len = len };
+        size_t size = sizeof(r) + len;
+        j->last = journal_end(j);
+        line_append_str(&j->mem, (char *) &r, sizeof(r));
+        line_append_str(&j->mem, str, len);
+        line_append_str(&j->mem, (char *) &size, sizeof(size));
+    }
+    j->cursor = journal_end(j);
+    j->in_group = 1;
+    j->can_merge = 1;
+    journal_spill(j);
+}
+
+// The next edit starts a new undo group
+void journal_group(Journal *j)
+{
+    j->in_group = 0;
+}
+
+void journal_free(Journal *j)
+{
+    line_free(&j->mem);
+    line_free(&j->scratch);
+    if (j->has_file)
+        close(j->fd);
+    memset(j, 0, sizeof(*j));
+}
+
+// Appends `n` 7 bits a byte, the high bit set on all but the last
+void swap_put_varint(Line *out, size_t n)
+{
+    while (n >= 0x80) {
+        line_append(out, (char) (n | 0x80));
+        n >>= 7;
+    }
+    line_append(out, (char) n);
+}
+
+// Reads a varint from [*p, end), returns 0 when it is cut off
+int swap_get_varint(const char **p, const char *end, size_t *n)
+{
+    size_t value = 0;
+    for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char c = *(*p)++;
+        value |= (size_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *n = value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void swap_header_init(SwapHeader *h, struct stat *st)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SWAP_MAGIC, sizeof(h->magic));
+    h->size = st->st_size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+int swap_write(int fd, const void *data, size_t n)
+{
+    const char *p = data;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+void *swap_run(void *arg)
+{
+    Swap *s = arg;
+    Line batch = {0};
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->pending.count && !s->reset && !s->stop)
+            pthread_cond_wait(&s->changed, &s->lock);
+
+        // Edits made until the time is up go out with the first one
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SWAP_SYNC_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!s->reset && !s->stop && pthread_cond_timedwait(&s->changed, &s->lock, &deadline) == 0)
+            ;
+        if (!s->pending.count && !s->reset)
+            break;
+
+        Line next = batch;
+        batch = s->pending;
+        s->pending = next;
+        s->pending.count = 0;
+        int reset = s->reset;
+        SwapHeader header = s->header;
+        s->reset = 0;
+        pthread_mutex_unlock(&s->lock);
+
+        // The edits before a reset are in the file, only later ones follow
+        // the new header
+        int failed = reset && (ftruncate(s->fd, 0) < 0 || swap_write(s->fd, &header, sizeof(header)) < 0);
+        if (!failed)
+            failed = swap_write(s->fd, batch.data, batch.count) < 0 || fdatasync(s->fd) < 0;
+        batch.count = 0;
+
+        pthread_mutex_lock(&s->lock);
+        // A swap file that can't be written is given up on
+        if (failed)
+            s->failed = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    line_free(&batch);
+    return NULL;
+}
+
+// Opens and locks the swap file of `filename`, which `st` describes.
+// Returns 1 when it holds edits that apply to the file as it is now, a
+// swap file of an older version is moved aside to `<swap>~`. Edits aren't
+// kept when the swap file can't be had, the reason goes in `message`.
+int swap_open(Swap *s, const char *filename, struct stat *st, char *message, size_t message_size)
+{
+    const char *slash = strrchr(filename, '/');
+    int dir = slash ? slash - filename + 1 : 0;
+    size_t n = strlen(filename) + sizeof("..cea~");
+    s->path = malloc(n);
+    if (!s->path) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    snprintf(s->path, n, "%.*s.%s.cea", dir, filename, filename + dir);
+    swap_header_init(&s->header, st);
+
+    for (int moved = 0;; moved = 1) {
+        s->fd = open(s->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (s->fd < 0) {
+            snprintf(message, message_size, "Edits are not kept: %s", strerror(errno));
+            break;
+        }
+        if (flock(s->fd, LOCK_EX | LOCK_NB) < 0) {
+            snprintf(message, message_size, "'%s' is open in another editor, edits are not kept", filename);
+            close(s->fd);
+            break;
+        }
+
+        SwapHeader h;
+        struct stat swap_st;
+        if (moved || fstat(s->fd, &swap_st) < 0 || (size_t) swap_st.st_size <= sizeof(h)
+            || pread(s->fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, SWAP_MAGIC, sizeof(h.magic)) != 0)
+            return 0;
+        if (h.size == s->header.size && h.mtime_sec == s->header.mtime_sec && h.mtime_nsec == s->header.mtime_nsec)
+            return 1;
+
+        char old[n];
+        snprintf(old, n, "%s~", s->path);
+        if (rename(s->path, old) < 0) {
+            snprintf(message, message_size, "Edits are not kept: %s", strerror(errno));
+            close(s->fd);
+            break;
+        }
+        snprintf(message, message_size, "Unsaved edits of an older '%s' were moved to %s", filename, old);
+        close(s->fd);
+    }
+
+    free(s->path);
+    s->path = NULL;
+    return 0;
+}
+
+// Starts the swap file over with the header and keeps edits from here on
+void swap_start(Swap *s)
+{
+    if (!s->path)
+        return;
+    s->reset = 1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->changed, NULL);
+    if (pthread_create(&s->thread, NULL, swap_run, s) != 0) {
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->changed);
+        return;
+    }
+    s->running = 1;
+}
+
+// Adds an edit for the thread to write out, `str` only matters for inserts
+void swap_record(Swap *s, JournalKind kind, size_t pos, const char *str, size_t len)
+{
+    if (!s->running)
+        return;
+    pthread_mutex_lock(&s->lock);
+    if (!s->failed) {
+        int wake = s->pending.count == 0;
+        line_append(&s->pending, (char) kind);
+        swap_put_varint(&s->pending, pos);
+        swap_put_varint(&s->pending, len);
+        if (kind == JOURNAL_INSERT)
+            line_append_str(&s->pending, str, len);
+        // Only the first edit of a batch wakes the thread
+        if (wake)
+            pthread_cond_signal(&s->changed);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// The file was saved as `st`, the edits so far are in it
+void swap_reset(Swap *s, struct stat *st)
+{
+    if (!s->running)
+        return;
+    pthread_mutex_lock(&s->lock);
+    swap_header_init(&s->header, st);
+    s->pending.count = 0;
+    s->reset = 1;
+    pthread_cond_signal(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Stops the thread and removes the swap file, its edits are no longer
+// needed once the editor quits
+void swap_close(Swap *s)
+{
+    if (s->running) {
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_signal(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->changed);
+    }
+    if (s->path) {
+        unlink(s->path);
+        close(s->fd);
+        free(s->path);
+    }
+    line_free(&s->pending);
+    memset(s, 0, sizeof(*s));
+}
+
+void editor_compute_size(Editor *e)
+{
+    struct winsize w;
+    if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &w)) == -1) {
+        fprintf(stderr, "ERROR: Unable to get terminal window size.\n");
+        exit(1);
+    }
+
+    e->width = w.ws_col;
+    e->height = w.ws_row;
+}
+
+// Reads the whole file into memory, for files that can't be mapped
+char *editor_read_contents(const char *filename, int fd, size_t file_size)
+{
+    char *contents = malloc(file_size);
+    if (!contents && file_size > 0) {
+        fprintf(stderr, "ERROR: Unable to load file '%s' to memory.\n", filename);
+        exit(1);
+    }
+
+    size_t bytes_read = 0;
+    while (bytes_read < file_size) {
+        ssize_t n = read(fd, contents + bytes_read, file_size - bytes_read);
+        if (n <= 0) {
+            fprintf(stderr, "ERROR: Only %zu bytes of %zu were read.\n", bytes_read, file_size);
+            exit(1);
+        }
+        bytes_read += n;
+    }
+
+    return contents;
+}
+
+void editor_read_from_file(Editor *e, const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Unable to open file '%s'.\n", filename);
+        exit(1);
+    }
+
+    struct stat statbuf;
+    if ((fstat(fd, &statbuf)) < 0) {
+        fprintf(stderr, "ERROR: Unable to locate file '%s'.\n", filename);
+        exit(1);
+    }
+
+    size_t file_size = statbuf.st_size;
+
+    // The mapping is read-only and private, edited text lives in the add
+    // buffer so pages are only ever read from the page cache. It goes on
+    // past the end of the file for follow mode, the pages there only exist
+    // once the file has grown into them.
+    size_t reserved = file_size + FOLLOW_RESERVE;
+    char *contents = mmap(NULL, reserved, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (contents == MAP_FAILED && file_size > 0) {
+        reserved = file_size;
+        contents = mmap(NULL, reserved, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    int mapped = contents != MAP_FAILED;
+    if (!mapped)
+        contents = file_size > 0 ? editor_read_contents(filename, fd, file_size) : NULL;
+
+    pt_init(&e->text);
+    pt_load(&e->text, contents, file_size, mapped);
+    e->filename = filename;
+
+    if (mapped) {
+        e->text.buffers[BUF_ORIGINAL].fd = fd;
+        e->text.buffers[BUF_ORIGINAL].reserved = reserved;
+    } else {
+        close(fd);
+    }
+
+    // Edits left behind by a session that didn't quit are offered back,
+    // the next key answers
+    if (swap_open(&e->swap, filename, &statbuf, e->message, sizeof(e->message))) {
+        snprintf(e->message, sizeof(e->message), "Recover unsaved edits of '%s'? (y/n)", filename);
+        e->pending = 'r';
+    } else {
+        swap_start(&e->swap);
+    }
+}
+
+// Flushes the directory holding `path` to disk, which makes a rename into
+// it last through a crash. Returns -1 and sets errno on failure.
+int fsync_parent(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : (size_t) (slash - path)) : strdup(".");
+    if (!dir) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0)
+        return -1;
+    int result = fsync(fd);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return result;
+}
+
+// Writes the document to a file next to `filename` and renames it over
+// that, so a crash mid-save leaves one or the other whole. The old file
+// lives on as long as it is mapped, the original buffer and a running
+// search keep reading it.
+void editor_save_to_file(Editor *e, const char *filename)
+{
+    // A link is followed, not replaced by a file of its own
+    char *target = realpath(filename, NULL);
+    const char *path = target ? target : filename;
+    size_t n = strlen(path) + sizeof(".XXXXXX");
+    char *temp = malloc(n);
+    if (!temp) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
+        exit(1);
+    }
+    snprintf(temp, n, "%s.XXXXXX", path);
+
+    int fd = mkstemp(temp);
+    if (fd < 0) {
+        snprintf(e->message, sizeof(e->message), "Unable to save '%s': %s", filename, strerror(errno));
+        free(temp);
+        free(target);
+        return;
+    }
+    // The file keeps the mode of the one it replaces. Where that can't be
+    // set the text is still saved, with the mode mkstemp gave it.
+    struct stat statbuf;
+    mode_t mode;
+    if (stat(path, &statbuf) == 0) {
+        mode = statbuf.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    int chmod_error = fchmod(fd, mode) < 0 ? errno : 0;
+
+    int failed = pt_save(&e->text, fd) < 0 || fsync(fd) < 0;
+    if (close(fd) < 0)
+        failed = 1;
+    if (!failed && rename(temp, path) < 0)
+        failed = 1;
+    if (failed) {
+        snprintf(e->message, sizeof(e->message), "Unable to save '%s': %s", filename, strerror(errno));
+        unlink(temp);
+    } else if (fsync_parent(path) < 0) {
+        // The swap file stays until the new name is known to be on disk
+        snprintf(e->message, sizeof(e->message), "Unable to sync the directory of '%s': %s",
+                filename, strerror(errno));
+    } else {
+        if (chmod_error)
+            snprintf(e->message, sizeof(e->message), "Saved '%s' without its mode %o: %s",
+                    filename, (unsigned) mode, strerror(chmod_error));
+        if (stat(path, &statbuf) == 0)
+            swap_reset(&e->swap, &statbuf);
+    }
+    free(temp);
+    free(target);
+}
+
+size_t editor_line_length(Editor *e, size_t row)
+{
+    return pt_line_length(&e->text, row);
+}
+
+// Where the char holding column `col` of line `row` starts and the display
+// column it is drawn at
+CellPoint editor_cell(Editor *e, size_t row, size_t col)
+{
+    PieceTable *pt = &e->text;
+    return cells_seek(pt, row, pt_line_start(pt, row), pt_line_length(pt, row), col, SIZE_MAX);
+}
+
+// Column of the char of line `row` drawn at display column `cell`, the end
+// of the line when it is shorter
+size_t editor_col_at(Editor *e, size_t row, size_t cell)
+{
+    PieceTable *pt = &e->text;
+    return cells_seek(pt, row, pt_line_start(pt, row), pt_line_length(pt, row), SIZE_MAX, cell).col;
+}
+
+// Column of the char after the one at column `col` of line `row`
+size_t editor_next_col(Editor *e, size_t row, size_t col)
+{
+    PieceTable *pt = &e->text;
+    size_t start = pt_line_start(pt, row), len = pt_line_length(pt, row);
+    return cells_next(pt, start, len, cells_seek(pt, row, start, len, col, SIZE_MAX)).col;
+}
+
+// Column of the char before the one at column `col` of line `row`
+size_t editor_prev_col(Editor *e, size_t row, size_t col)
+{
+    size_t cell = editor_cell(e, row, col).cell;
+    return cell > 0 ? editor_col_at(e, row, cell - 1) : 0;
+}
+
+// Puts the cursor on the char of its line drawn at display column `cell`,
+// or on the last one when the line is shorter. INSERT mode may sit right
+// after the last char.
+void editor_goto_cell(Editor *e, size_t cell)
+{
+    size_t line_len = editor_line_length(e, e->cy);
+    e->cx = editor_col_at(e, e->cy, cell);
+    if (e->mode != INSERT && e->cx >= line_len)
+        e->cx = editor_prev_col(e, e->cy, line_len);
+}
+
+// Every edit goes through these two so it ends up in the journal
+void editor_text_insert(Editor *e, size_t pos, const char *str, size_t len)
+{
+    journal_record(&e->journal, JOURNAL_INSERT, pos, str, len);
+    swap_record(&e->swap, JOURNAL_INSERT, pos, str, len);
+    pt_insert(&e->text, pos, str, len);
+    search_edit(&e->search, &e->text, pos, 0, len);
+}
+
+void editor_text_delete(Editor *e, size_t pos, size_t len)
+{
+    Line *deleted = &e->journal.scratch;
+    line_reserve(deleted, len);
+    pt_read(&e->text, pos, deleted->data, len);
+    journal_record(&e->journal, JOURNAL_DELETE, pos, deleted->data, len);
+    swap_record(&e->swap, JOURNAL_DELETE, pos, NULL, len);
+    pt_delete(&e->text, pos, len);
+    search_edit(&e->search, &e->text, pos, len, 0);
+}
+
+// Inserts `str` at the cursor and moves the cursor past it
+void editor_insert(Editor *e, const char *str, size_t len)
+{
+    size_t pos = pt_line_start(&e->text, e->cy) + e->cx;
+    editor_text_insert(e, pos, str, len);
+    for (size_t i = 0; i < len; ++i) {
+        if (str[i] == '\n') {
+            e->cy++;
+            e->cx = 0;
+        } else {
+            e->cx++;
+        }
+    }
+}
+
+void editor_goto_line(Editor *e, size_t row)
+{
+    size_t line_count = pt_line_count(&e->text);
+    e->cy = row < line_count ? row : line_count - 1;
+    editor_goto_cell(e, e->cx_mem);
 }
 
-void viewport_insert_str(Viewport *v, char *str, size_t len) {
-    for (size_t i = 0; i < len; ++i) {
-        viewport_insert(v, str[i]);
+void editor_remove_char(Editor *e)
+{
+    if (pt_has_line(&e->text, e->cy)) {
+        size_t start = pt_line_start(&e->text, e->cy);
+        if (e->cx == 0) {
+            if (e->cy < 1)
+                return;
+            size_t line_end = editor_line_length(e, e->cy-1);
+            editor_text_delete(e, start - 1, 1);
+            e->cy--;
+            e->cx = line_end;
+        } else {
+            if (e->cx <= editor_line_length(e, e->cy)) {
+                size_t col = editor_prev_col(e, e->cy, e->cx);
+                editor_text_delete(e, start + col, e->cx - col);
+                e->cx = col;
+            }
+        }
     }
 }
 
-int is_whitespace(char c) {
-    return c == ' ' || c == '\n' || c == '\t';
+// Puts the cursor on `pos` after an undo or redo
+void editor_goto_offset(Editor *e, size_t pos)
+{
+    e->cy = pt_line_at(&e->text, pos);
+    e->cx = pos - pt_line_start(&e->text, e->cy);
+    size_t line_len = editor_line_length(e, e->cy);
+    if (e->mode == NORMAL && line_len > 0 && e->cx >= line_len)
+        e->cx = editor_prev_col(e, e->cy, line_len);
+    e->cx_mem = editor_cell(e, e->cy, e->cx).cell;
 }
 
-int match_keyword(const char *keyword, char *str, size_t n) 
+// Reverts the last group of edits, returns 0 when there is nothing to undo.
+// Only the records of the group are read, whatever the size of the file.
+int editor_undo(Editor *e)
 {
-    if (n != strlen(keyword))
+    Journal *j = &e->journal;
+    if (j->cursor <= j->floor)
         return 0;
 
-    if (memcmp(keyword, str, n) != 0)
-        return 0;
+    JournalRecord r;
+    do {
+        size_t size;
+        journal_read(j, j->cursor - sizeof(size), &size, sizeof(size));
+        j->cursor -= sizeof(size) + size;
+        journal_read(j, j->cursor, &r, sizeof(r));
+        if (r.kind == JOURNAL_INSERT) {
+            swap_record(&e->swap, JOURNAL_DELETE, r.pos, NULL, r.len);
+            pt_delete(&e->text, r.pos, r.len);
+            search_edit(&e->search, &e->text, r.pos, r.len, 0);
+        } else {
+            const char *bytes = journal_bytes(j, j->cursor + sizeof(r), r.len);
+            swap_record(&e->swap, JOURNAL_INSERT, r.pos, bytes, r.len);
+            pt_insert(&e->text, r.pos, bytes, r.len);
+            search_edit(&e->search, &e->text, r.pos, 0, r.len);
+        }
+    } while (!r.first && j->cursor > j->floor);
 
-    return n;
+    j->can_merge = 0;
+    journal_group(j);
+    editor_goto_offset(e, r.pos);
+    return 1;
 }
 
-int check_keywords(char *str, size_t n) 
+// Applies the next undone group again, returns 0 when there is none
+int editor_redo(Editor *e)
 {
-    for (size_t i = 0; i < sizeof(keywords) / sizeof(char*); ++i) {
-        int match = match_keyword(keywords[i], str, n);
-        if (match > 0)
-            return match;
+    Journal *j = &e->journal;
+    if (j->cursor >= journal_end(j))
+        return 0;
+
+    JournalRecord r;
+    journal_read(j, j->cursor, &r, sizeof(r));
+    size_t pos = r.pos;
+    for (;;) {
+        if (r.kind == JOURNAL_INSERT) {
+            const char *bytes = journal_bytes(j, j->cursor + sizeof(r), r.len);
+            swap_record(&e->swap, JOURNAL_INSERT, r.pos, bytes, r.len);
+            pt_insert(&e->text, r.pos, bytes, r.len);
+            search_edit(&e->search, &e->text, r.pos, 0, r.len);
+        } else {
+            swap_record(&e->swap, JOURNAL_DELETE, r.pos, NULL, r.len);
+            pt_delete(&e->text, r.pos, r.len);
+            search_edit(&e->search, &e->text, r.pos, r.len, 0);
+        }
+        j->cursor += sizeof(r) + r.len + sizeof(size_t);
+        if (j->cursor >= journal_end(j))
+            break;
+        journal_read(j, j->cursor, &r, sizeof(r));
+        if (r.first)
+            break;
     }
 
-    return 0;
+    j->can_merge = 0;
+    journal_group(j);
+    editor_goto_offset(e, pos);
+    return 1;
 }
 
-int highlight(Line *line, size_t pos)
+// Answers the recovery prompt. The edits in the swap file are made again,
+// as one undo group, when `replay` is set. The swap file then starts over.
+// A swap file cut off by a crash is replayed up to its last whole edit.
+void editor_recover(Editor *e, int replay)
 {
-    size_t i = pos;
-    size_t word_len = 0;
+    Swap *s = &e->swap;
+    Line edits = {0};
+    struct stat st;
+    if (replay && fstat(s->fd, &st) == 0 && (size_t) st.st_size > sizeof(SwapHeader)) {
+        line_reserve(&edits, st.st_size - sizeof(SwapHeader));
+        while (edits.count < edits.capacity) {
+            ssize_t n = pread(s->fd, edits.data + edits.count, edits.capacity - edits.count,
+                              sizeof(SwapHeader) + edits.count);
+            if (n <= 0)
+                break;
+            edits.count += n;
+        }
+    }
+    swap_start(s);
 
-    while (i < line->count && !is_whitespace(line->data[i++])) word_len++;
+    const char *p = edits.data, *end = p + edits.count;
+    size_t count = 0, pos = 0, len;
+    journal_group(&e->journal);
+    while (p < end) {
+        unsigned char kind = *p++;
+        if (kind > JOURNAL_DELETE || !swap_get_varint(&p, end, &pos) || !swap_get_varint(&p, end, &len))
+            break;
+        if (kind == JOURNAL_INSERT) {
+            if (pos > pt_size(&e->text) || len > (size_t) (end - p))
+                break;
+            editor_text_insert(e, pos, p, len);
+            p += len;
+        } else {
+            if (pos > pt_size(&e->text) || len > pt_size(&e->text) - pos)
+                break;
+            editor_text_delete(e, pos, len);
+        }
+        count++;
+    }
+    journal_group(&e->journal);
+    line_free(&edits);
 
-    return check_keywords(&line->data[pos], word_len);
+    if (count > 0) {
+        editor_goto_offset(e, MIN(pos, pt_size(&e->text)));
+        snprintf(e->message, sizeof(e->message), "Recovered %zu edits%s", count,
+                 p < end ? ", the rest of the swap file is damaged" : "");
+    }
 }
 
-void viewport_write(Viewport *v, Lines *lines)
+void editor_follow_stop(Editor *e)
 {
-    v->count = 0;
-    for (size_t i = v->top; i < v->top + v->height && i < lines->count; ++i) {
-        Line *line = &lines->data[i];
-        for (size_t j = v->left; j < v->left + v->width && j < line->count; ++j) {
-            int num_to_highlight = highlight(line, j);
-            if (num_to_highlight > 0) {
-                viewport_insert_cstr(v, "\033[33m");
-                viewport_insert_str(v, &line->data[j], num_to_highlight);
-                viewport_insert_cstr(v, "\033["FG_COLOR"m");
-                j += num_to_highlight;
-            }
-            viewport_insert(v, line->data[j]);
-        }
-        viewport_insert_cstr(v, "\033[K\n");
+    Follow *f = &e->follow;
+    if (f->active) {
+        close(f->fd);
+        f->active = 0;
     }
 }
 
-void viewport_update(Viewport *v, Editor *e)
+// Takes in what was written to the followed file since the last look and
+// returns 1 when the document changed. A cursor on the last line stays on
+// it. A file cut short, as log rotation does, is followed from its start
+// again. Nothing may read the old text past that point, so the search,
+// undo history and swap file are dropped with it.
+int editor_follow_poll(Editor *e)
 {
-    v->width = e->width - SIDEBAR_SZ;
-    v->height = e->height - STATUS_SZ;
+    Follow *f = &e->follow;
+    if (!f->active)
+        return 0;
+    // The events only say that something changed, the size says what
+    char events[4096];
+    while (read(f->fd, events, sizeof(events)) > 0)
+        ;
 
-    if (e->cx <= v->left) {
-        v->left = e->cx;
+    TextBuffer *b = &e->text.buffers[BUF_ORIGINAL];
+    struct stat st;
+    if (fstat(b->fd, &st) < 0 || (size_t) st.st_size == b->count)
+        return 0;
+    if ((size_t) st.st_size < b->count) {
+        search_clear(&e->search);
+        size_t cap = e->journal.cap;
+        journal_free(&e->journal);
+        e->journal.cap = cap;
+        pt_restart(&e->text, st.st_size);
+        swap_reset(&e->swap, &st);
+        editor_goto_line(e, pt_line_count(&e->text) - 1);
+        snprintf(e->message, sizeof(e->message), "'%s' was truncated, following it from the start", e->filename);
+        return 1;
     }
-    if (e->cx >= v->left + v->width - 1) {
-        v->left = e->cx - v->width + 1;
+    if (b->count == b->reserved) {
+        editor_follow_stop(e);
+        snprintf(e->message, sizeof(e->message), "Stopped following '%s', it was too large", e->filename);
+        return 0;
     }
-    if (e->cy <= v->top) {
-        v->top = e->cy;
+
+    // To a search the new text is an insert at the end, which `n` picks up
+    Search *s = &e->search;
+    int at_end = e->cy + 1 >= pt_line_count(&e->text);
+    size_t end = s->active ? pt_size(&e->text) : 0;
+    pt_grow(&e->text, MIN((size_t) st.st_size, b->reserved));
+    if (s->active)
+        search_edit(s, &e->text, end, 0, pt_size(&e->text) - end);
+    if (at_end)
+        editor_goto_line(e, pt_line_count(&e->text) - 1);
+    return 1;
+}
+
+// Starts following the file from its last line. Only a file that was
+// mapped with room to grow and is still the one at its path can be.
+void editor_follow_start(Editor *e)
+{
+    Follow *f = &e->follow;
+    TextBuffer *b = &e->text.buffers[BUF_ORIGINAL];
+    struct stat st, mapped_st;
+    if (f->active)
+        return;
+    if (!b->mapped || b->reserved == b->count) {
+        snprintf(e->message, sizeof(e->message), "'%s' can't be followed", e->filename);
+        return;
     }
-    if (e->cy >= v->top + v->height - 1) {
-        v->top = e->cy - v->height + 1;
+    if (stat(e->filename, &st) < 0 || fstat(b->fd, &mapped_st) < 0
+        || st.st_ino != mapped_st.st_ino || st.st_dev != mapped_st.st_dev) {
+        snprintf(e->message, sizeof(e->message), "'%s' was replaced since it was opened", e->filename);
+        return;
     }
 
-    viewport_write(v, &e->lines);
+    f->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (f->fd < 0 || inotify_add_watch(f->fd, e->filename, IN_MODIFY) < 0) {
+        snprintf(e->message, sizeof(e->message), "Unable to follow '%s': %s", e->filename, strerror(errno));
+        if (f->fd >= 0)
+            close(f->fd);
+        return;
+    }
+    f->active = 1;
+    editor_follow_poll(e);
+    editor_goto_line(e, pt_line_count(&e->text) - 1);
 }
 
-void viewport_free(Viewport *v)
+// Whether the document is followed and can't be edited, which is then
+// said on the message line
+int editor_following(Editor *e)
 {
-    if (v->content) {
-        free(v->content);
-        v->count = 0;
-        v->capacity = 0;
-        v->content = NULL;
+    if (e->follow.active)
+        snprintf(e->message, sizeof(e->message), "Following '%s', :set nofollow to edit", e->filename);
+    return e->follow.active;
+}
+
+// Moves the cursor to the next match in direction `forward`. When the
+// worker hasn't got that far within SEARCH_FRAME_MS the jump is left to
+// editor_search_poll.
+void editor_search_jump(Editor *e, int forward)
+{
+    Search *s = &e->search;
+    size_t pos = pt_line_start(&e->text, e->cy) + e->cx;
+    // Results of an older version of the text or of a cancelled search
+    search_refresh(s, &e->text, pos);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += SEARCH_FRAME_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    size_t match;
+    int found;
+    while ((found = search_find(s, pos, forward, &match)) < 0 && search_wait(s, &deadline))
+        ;
+
+    s->jump = 0;
+    const char *pattern = s->pattern.data;
+    int n = (int) s->pattern.count;
+    if (found < 0) {
+        s->jump = forward ? 1 : -1;
+        snprintf(e->message, sizeof(e->message), "Searching for %.*s...", n, pattern);
+    } else if (found == 0) {
+        snprintf(e->message, sizeof(e->message), "Pattern not found: %.*s", n, pattern);
+    } else {
+        if (forward ? match <= pos : match >= pos)
+            snprintf(e->message, sizeof(e->message), "search hit %s, continuing at %s",
+                    forward ? "BOTTOM" : "TOP", forward ? "TOP" : "BOTTOM");
+        else
+            snprintf(e->message, sizeof(e->message), "%c%.*s", s->forward ? '/' : '?', n, pattern);
+        editor_goto_offset(e, match);
     }
 }
 
-void line_init(Line *line)
+// Keeps a background search in step with the editor: a pending jump is
+// taken once its match is known and the worker is joined when it is done.
+// Edits don't start it over, the next jump does.
+void editor_search_poll(Editor *e)
 {
-    line->count = 0;
-    line->capacity = 0;
-    line->data = NULL;
+    Search *s = &e->search;
+    if (!s->active)
+        return;
+
+    if (s->jump)
+        editor_search_jump(e, s->jump > 0);
+    if (s->running && !search_busy(s))
+        search_stop(s);
 }
 
-void line_append(Line *line, char c)
+// Appends the replacement for a match. & stands for the match, \n and \t
+// for a newline and a tab, and a backslash takes the next byte as it is.
+void substitute_expand(Substitute *sub, Line *out, const char *match, size_t len)
 {
-    if (line->capacity < line->count + 1) {
-        line->capacity = line->capacity == 0 ? INIT_CAP : line->capacity * 2;
-        line->data = realloc(line->data, sizeof(char) * line->capacity);
-        if (!line->data) {
+    const char *r = sub->replacement;
+    size_t n = sub->replacement_len;
+    for (size_t i = 0; i < n; ++i) {
+        if (r[i] == '&') {
+            line_append_str(out, match, len);
+        } else if (r[i] == '\\' && i + 1 < n) {
+            char c = r[++i];
+            line_append(out, c == 'n' ? '\n' : c == 't' ? '\t' : c);
+        } else {
+            line_append(out, r[i]);
+        }
+    }
+}
+
+void substitute_push_edit(SubstituteBlock *b, LineEdit edit)
+{
+    if (b->edit_capacity < b->edit_count + 1) {
+        b->edit_capacity = b->edit_capacity == 0 ? INIT_CAP : b->edit_capacity * 2;
+        b->edits = realloc(b->edits, sizeof(LineEdit) * b->edit_capacity);
+        if (!b->edits) {
             fprintf(stderr, "ERROR: Not enough memory...\n");
             exit(1);
         }
     }
 
-    line->data[line->count++] = c;
+    b->edits[b->edit_count++] = edit;
 }
 
-void line_insert(Line *line, size_t pos, char c)
+// Rebuilds the lines of `b` that have a match. `data` holds the block and
+// `m` its matches. Neighbouring lines end up in one edit.
+void substitute_block(Substitute *sub, SubstituteBlock *b, const char *data, Matches *m)
 {
-    if (pos > line->count) {
-        fprintf(stderr, "ERROR: Insert '%zu' out of bounds.\n", pos);
-        exit(1);
-    }
+    size_t len = b->end - b->start;
+    for (size_t i = 0; i < m->count;) {
+        size_t pos = m->data[i].pos;
+        const char *bol = memrchr(data, '\n', pos);
+        const char *eol = memchr(data + pos, '\n', len - pos);
+        size_t start = bol ? (size_t) (bol - data) + 1 : 0;
+        size_t end = eol ? (size_t) (eol - data) : len;
 
-    if (line->capacity < line->count + 1) {
-        line->capacity = line->capacity == 0 ? INIT_CAP : line->capacity * 2;
-        line->data = realloc(line->data, sizeof(char) * line->capacity);
-        if (!line->data) {
-            fprintf(stderr, "ERROR: Not enough memory...\n");
-            exit(1);
+        LineEdit *last = b->edit_count > 0 ? &b->edits[b->edit_count - 1] : NULL;
+        if (last && last->pos + last->len + 1 == b->start + start) {
+            line_append(&b->text, '\n');
+        } else {
+            substitute_push_edit(b, (LineEdit) { .pos = b->start + start, .offset = b->text.count });
+            last = &b->edits[b->edit_count - 1];
         }
-    }
 
-    if (pos == line->count) {
-        line->data[line->count++] = c;
-    } else {
-        memmove(line->data + pos + 1, line->data + pos, line->count - pos - 1);
-        line->data[pos] = c;
-        line->count++;
+        size_t done = start, replaced = 0;
+        // An empty match at the end of the line is still on it
+        for (; i < m->count && m->data[i].pos <= end; ++i) {
+            Match *match = &m->data[i];
+            // Literal matches can overlap
+            if (match->pos < done || (replaced > 0 && !sub->global))
+                continue;
+            line_append_str(&b->text, data + done, match->pos - done);
+            substitute_expand(sub, &b->text, data + match->pos, match->len);
+            done = match->pos + match->len;
+            replaced++;
+        }
+        line_append_str(&b->text, data + done, end - done);
+
+        last->len = b->start + end - last->pos;
+        last->count = b->text.count - last->offset;
+        b->replaced += replaced;
+        b->lines++;
     }
 }
 
-void line_remove(Line *line, size_t pos)
+void *substitute_run(void *arg)
 {
-    if (pos >= line->count) {
-        fprintf(stderr, "ERROR: Remove '%zu' out of bounds", pos);
-        exit(1);
+    Substitute *sub = arg;
+    SubstringScanner scan = substring_scanner_get();
+    size_t n = sub->pattern_len;
+    Regex re;
+    const char *error;
+    if (sub->is_regex) {
+        regex_compile(&re, sub->pattern, n, &error);
+        re.allow_empty = 1;
     }
 
-    memmove(line->data + pos, line->data + pos + 1, line->count -pos - 1);
-    line->count--;
+    Line buf = {0};
+    Matches m = {0};
+    for (;;) {
+        pthread_mutex_lock(&sub->lock);
+        size_t k = sub->next++;
+        pthread_mutex_unlock(&sub->lock);
+        if (k >= sub->block_count)
+            break;
+
+        // The document is fully indexed, so reading it doesn't change it
+        SubstituteBlock *b = &sub->blocks[k];
+        size_t len = b->end - b->start;
+        line_reserve(&buf, len);
+        piece_read(sub->pt, sub->pt->root, b->start, buf.data, len);
+        m.count = 0;
+        if (sub->is_regex)
+            regex_scan(&re, buf.data, len, 0, &m);
+        else if (len >= n)
+            scan(buf.data, len - n + 1, sub->pattern, n, 0, &m);
+        substitute_block(sub, b, buf.data, &m);
+    }
+
+    if (sub->is_regex)
+        regex_free(&re);
+    line_free(&buf);
+    matches_free(&m);
+    return NULL;
 }
 
-Line line_split_at(Line *line, size_t pos)
+// Replaces matches of `sub->pattern` on lines [first, last], every match
+// or only the first on each line. The lines are rebuilt in parallel and
+// the edits applied from the bottom up, as a single undo group. Returns the
+// number of replacements and sets `lines` to the number of lines changed.
+size_t editor_substitute(Editor *e, Substitute *sub, size_t first, size_t last, size_t *lines)
 {
-    if (pos > line->count) {
-        fprintf(stderr, "ERROR: Split line at '%zu' out of bounds '%zu'.\n", pos, line->count);
+    PieceTable *pt = &e->text;
+    pt_index_all(pt);
+    sub->pt = pt;
+    size_t start = pt_line_start(pt, first);
+    size_t end = pt_line_start(pt, last) + pt_line_length(pt, last);
+
+    // Blocks of whole lines, so no match is cut in two
+    size_t capacity = (end - start) / SUBSTITUTE_BLOCK + 1;
+    sub->blocks = calloc(capacity, sizeof(SubstituteBlock));
+    if (!sub->blocks) {
+        fprintf(stderr, "ERROR: Not enough memory...\n");
         exit(1);
     }
+    for (size_t pos = start; sub->block_count == 0 || pos <= end;) {
+        size_t row = pt_line_at(pt, MIN(pos + SUBSTITUTE_BLOCK, end));
+        size_t block_end = pt_line_start(pt, row) + pt_line_length(pt, row);
+        sub->blocks[sub->block_count++] = (SubstituteBlock) { .start = pos, .end = block_end };
+        pos = block_end + 1;
+    }
 
-    size_t len = line->count - pos;
-    Line new_line = {
-        .count = len,
-        .capacity = len,
-        .data = malloc(sizeof(char) * len),
-    };
-    if (!new_line.data) {
+    substring_scanner_get();
+    pthread_mutex_init(&sub->lock, NULL);
+    size_t threads = MIN(index_threads(), sub->block_count);
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    if (!workers) {
         fprintf(stderr, "ERROR: Not enough memory...\n");
         exit(1);
     }
+    // The calling thread works as well
+    size_t started = 1;
+    while (started < threads && pthread_create(&workers[started], NULL, substitute_run, sub) == 0)
+        started++;
+    substitute_run(sub);
+    for (size_t i = 1; i < started; ++i)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&sub->lock);
+
+    size_t replaced = 0;
+    *lines = 0;
+    journal_group(&e->journal);
+    syntax_truncate(&pt->syntax, first);
+    wrap_truncate(&pt->wrap, first);
+    for (size_t k = sub->block_count; k-- > 0;) {
+        SubstituteBlock *b = &sub->blocks[k];
+        for (size_t i = b->edit_count; i-- > 0;) {
+            LineEdit *edit = &b->edits[i];
+            editor_text_delete(e, edit->pos, edit->len);
+            editor_text_insert(e, edit->pos, b->text.data + edit->offset, edit->count);
+        }
+        replaced += b->replaced;
+        *lines += b->lines;
+    }
 
-    memmove(new_line.data, line->data + pos, len);
-    line->count = pos;
+    // The cursor goes to the start of the last line changed
+    for (size_t k = sub->block_count; k-- > 0;) {
+        SubstituteBlock *b = &sub->blocks[k];
+        if (b->edit_count > 0) {
+            LineEdit *edit = &b->edits[b->edit_count - 1];
+            const char *text = b->text.data + edit->offset;
+            const char *nl = edit->count > 0 ? memrchr(text, '\n', edit->count) : NULL;
+            editor_goto_offset(e, edit->pos + (nl ? (size_t) (nl - text) + 1 : 0));
+            break;
+        }
+    }
 
-    return new_line;
+    for (size_t k = 0; k < sub->block_count; ++k) {
+        line_free(&sub->blocks[k].text);
+        free(sub->blocks[k].edits);
+    }
+    free(sub->blocks);
+    sub->blocks = NULL;
+    sub->block_count = 0;
+    return replaced;
 }
 
-void line_free(Line *line)
+// Reads a line address: a number, . for the cursor line or $ for the last
+size_t command_address(Editor *e, const char **cmd, const char *end, int *found)
 {
-    if (line->data) {
-        free(line->data);
-        line->count = 0;
-        line->capacity = 0;
-        line->data = NULL;
+    const char *p = *cmd;
+    *found = 1;
+    if (p < end && *p == '.') {
+        *cmd = p + 1;
+        return e->cy;
+    }
+    if (p < end && *p == '$') {
+        *cmd = p + 1;
+        return pt_line_count(&e->text) - 1;
     }
+
+    size_t row = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        row = row * 10 + (*p++ - '0');
+    *found = p > *cmd;
+    *cmd = p;
+    return row > 0 ? row - 1 : 0;
 }
 
-void lines_init(Lines *lines)
+// Splits off the next part of s/pattern/replacement/flags. A backslash
+// before the delimiter makes it part of the text.
+const char *command_part(const char **cmd, const char *end, char delim, Line *out)
 {
-    lines->count = 0;
-    lines->capacity = 0;
-    lines->data = NULL;
+    const char *p = *cmd;
+    out->count = 0;
+    for (; p < end && *p != delim; ++p) {
+        if (*p == '\\' && p + 1 < end && p[1] == delim)
+            p++;
+        else if (*p == '\\' && p + 1 < end)
+            line_append(out, *p++);
+        line_append(out, *p);
+    }
+    *cmd = p < end ? p + 1 : p;
+    return out->data;
 }
 
-void lines_append(Lines *lines, Line *line)
+// Sets an option of a :set command
+void editor_set(Editor *e, const char *option, size_t n)
 {
-    if (lines->capacity < lines->count + 1) {
-        lines->capacity = lines->capacity == 0 ? INIT_CAP: lines->capacity * 2;
-        lines->data = realloc(lines->data, sizeof(Line) * lines->capacity);
-        if (!lines->data) {
-            fprintf(stderr, "ERROR: Not enough memory...\n");
-            exit(1);
+    if (n == 4 && memcmp(option, "wrap", 4) == 0) {
+        e->wrap = 1;
+    } else if (n == 6 && memcmp(option, "nowrap", 6) == 0) {
+        e->wrap = 0;
+        // Not kept up to date through every edit while nothing uses it
+        wrap_free(&e->text.wrap);
+    } else if (n == 6 && memcmp(option, "follow", 6) == 0) {
+        editor_follow_start(e);
+    } else if (n == 8 && memcmp(option, "nofollow", 8) == 0) {
+        editor_follow_stop(e);
+    } else {
+        snprintf(e->message, sizeof(e->message), "Unknown option: %.*s", (int) n, option);
+    }
+}
+
+// Runs a command typed at the : prompt. Only [range]s/pattern/replacement/[g],
+// set and a bare line number are known. The range is a line, two lines
+// apart from a comma, or % for the whole file. Without one the cursor line
+// is used.
+void editor_command(Editor *e, const char *cmd, size_t n)
+{
+    const char *p = cmd, *end = cmd + n;
+    size_t first = e->cy, last = e->cy;
+    int found;
+    if (p < end && *p == '%') {
+        p++;
+        first = 0;
+        last = pt_line_count(&e->text) - 1;
+    } else {
+        size_t row = command_address(e, &p, end, &found);
+        if (found) {
+            first = last = row;
+            if (p < end && *p == ',') {
+                p++;
+                last = command_address(e, &p, end, &found);
+            }
+        }
+    }
+
+    if (p == end) {
+        editor_goto_line(e, last);
+        return;
+    }
+    if (end - p > 4 && memcmp(p, "set ", 4) == 0) {
+        editor_set(e, p + 4, end - p - 4);
+        return;
+    }
+    if (*p != 's' || p + 1 == end || (p[1] >= 'a' && p[1] <= 'z') || p[1] == ' ' || p[1] == '\\') {
+        snprintf(e->message, sizeof(e->message), "Not an editor command: %.*s", (int) n, cmd);
+        return;
+    }
+    if (editor_following(e))
+        return;
+
+    size_t line_count = pt_line_count(&e->text);
+    if (first > last) {
+        size_t row = first;
+        first = last;
+        last = row;
+    }
+    if (last >= line_count) {
+        snprintf(e->message, sizeof(e->message), "Invalid range");
+        return;
+    }
+
+    char delim = p[1];
+    p += 2;
+    Line pattern = {0}, replacement = {0};
+    command_part(&p, end, delim, &pattern);
+    command_part(&p, end, delim, &replacement);
+    int global = 0;
+    for (; p < end; ++p) {
+        if (*p != 'g') {
+            snprintf(e->message, sizeof(e->message), "Trailing characters: %.*s", (int) (end - p), p);
+            goto done;
+        }
+        global = 1;
+    }
+
+    // An empty pattern is the last search
+    Search *s = &e->search;
+    if (pattern.count == 0)
+        line_append_str(&pattern, s->pattern.data, s->pattern.count);
+    if (pattern.count == 0) {
+        snprintf(e->message, sizeof(e->message), "No previous search");
+        goto done;
+    }
+    Substitute sub = {
+        .pattern = pattern.data,
+        .pattern_len = pattern.count,
+        .replacement = replacement.data,
+        .replacement_len = replacement.count,
+        .is_regex = !regex_is_literal(pattern.data, pattern.count),
+        .global = global,
+    };
+    const char *error;
+    Regex check;
+    if (sub.is_regex) {
+        if (regex_compile(&check, pattern.data, pattern.count, &error) < 0) {
+            snprintf(e->message, sizeof(e->message), "Invalid pattern: %s", error);
+            goto done;
         }
+        regex_free(&check);
     }
 
-    lines->data[lines->count++] = *line;
+    size_t lines;
+    size_t replaced = editor_substitute(e, &sub, first, last, &lines);
+    if (replaced == 0)
+        snprintf(e->message, sizeof(e->message), "Pattern not found: %.*s", (int) pattern.count, pattern.data);
+    else
+        snprintf(e->message, sizeof(e->message), "%zu substitution%s on %zu line%s",
+                replaced, replaced == 1 ? "" : "s", lines, lines == 1 ? "" : "s");
+
+done:
+    line_free(&pattern);
+    line_free(&replacement);
 }
 
-void lines_insert(Lines *lines, size_t pos, Line *line)
+// Handles a key typed into the /, ? or : prompt
+void editor_prompt_key(Editor *e, Key *key, char prompt)
 {
-    if (pos > lines->count) {
-        fprintf(stderr, "ERROR: Insert '%zu' out of bounds.\n", pos);
-        exit(1);
+    int c = key->code;
+    Line *line = &e->prompt;
+    if (c == ESCAPE || (c == BSPACE && line->count == 0)) {
+        e->message[0] = '\0';
+        return;
     }
 
-    if (lines->capacity < lines->count + 1) {
-        lines->capacity = lines->capacity == 0 ? INIT_CAP : lines->capacity * 2;
-        lines->data = realloc(lines->data, sizeof(Line) * lines->capacity);
-        if (!lines->data) {
-            fprintf(stderr, "ERROR: Not enough memory...\n");
-            exit(1);
+    if (c == ENTER && prompt == ':') {
+        e->message[0] = '\0';
+        editor_command(e, line->data, line->count);
+        return;
+    }
+    if (c == ENTER) {
+        Search *s = &e->search;
+        const char *error = line->count > 0 ? search_compile(s, line->data, line->count) : NULL;
+        if (error) {
+            snprintf(e->message, sizeof(e->message), "Invalid pattern: %s", error);
+            return;
         }
+        e->message[0] = '\0';
+        if (s->pattern.count == 0)
+            return;
+        s->forward = prompt == '/';
+        search_start(s, &e->text, pt_line_start(&e->text, e->cy) + e->cx);
+        editor_search_jump(e, s->forward);
+        return;
     }
 
-    if (pos == lines->count) {
-        lines->data[lines->count++] = *line;
-    } else {
-        memmove(lines->data + pos + 1, lines->data + pos, sizeof(Line) * (lines->count - pos));
-        lines->data[pos+1] = *line;
-        lines->count++;
+    if (c == BSPACE) {
+        // The whole of a multibyte char goes
+        while (line->count > 1 && (line->data[line->count - 1] & 0xc0) == 0x80)
+            line->count--;
+        line->count--;
+    } else if (c >= 32 && c < 127) {
+        line_append(line, c);
+    } else if (c == KEY_CHAR) {
+        line_append_str(line, key->text, key->len);
     }
+    snprintf(e->message, sizeof(e->message), "%c%.*s", prompt, (int) line->count, line->data);
+    e->pending = prompt;
 }
 
-void lines_remove(Lines *lines, size_t pos)
+void editor_free(Editor *e)
 {
-    if (pos >= lines->count) {
-        fprintf(stderr, "ERROR: Remove '%zu' out of bounds '%zu'.\n", pos, lines->count);
-        exit(1);
+    search_clear(&e->search);
+    if (e->search.is_regex) {
+        regex_free(&e->search.regex);
+        regex_free(&e->search.painter);
     }
-
-    Line *line = &lines->data[pos];
-    line_free(line);
-    memmove(line, line + 1, sizeof(Line) * (lines->count - pos));
-    lines->count--;
+    matches_free(&e->search.visible);
+    line_free(&e->search.pattern);
+    line_free(&e->prompt);
+    editor_follow_stop(e);
+    swap_close(&e->swap);
+    pt_free(&e->text);
+    journal_free(&e->journal);
 }
 
-void lines_combine(Lines *lines, size_t pos_a, size_t pos_b)
+void render(FILE *out, Editor *e, Viewport *v, int last)
 {
-    if (pos_a >= lines->count || pos_b >= lines->count) {
-        fprintf(stderr, "ERROR: Combine ('%zu', '%zu') out of bounds", pos_a, pos_b);
-        exit(1);
+    Screen *s = &v->screen;
+    char buf[256];
+
+    size_t *numbers = (size_t *) v->numbers.data;
+    for (size_t row = 0; row < v->height; ++row) {
+        if (numbers[row] == SIZE_MAX)
+            continue;
+        int n = snprintf(buf, sizeof(buf), "%*zu ", (int) v->sidebar - 1, numbers[row] + 1);
+        Style style = e->cy == numbers[row] ? STYLE_LINE_CURRENT : STYLE_LINE_NUMBER;
+        screen_puts(s, 0, row, buf, n, style);
     }
 
-    Line *a = &lines->data[pos_a];
-    Line *b = &lines->data[pos_b];
+    // Output cost of the previous frame and memory in use against reserved
+    size_t used, reserved;
+    pt_memory(&e->text, &used, &reserved);
+    int n = snprintf(buf, sizeof(buf), " | %s | (%zu, %zu) | [%zu, %zu] | {%zu, %zu} | %d | %zuB %zuw | %zuK/%zuK |",
+            mode_to_str(e->mode), e->cx, e->cy, e->width, e->height, v->left, v->top, last,
+            s->frame_bytes, s->frame_syscalls, used >> 10, reserved >> 10);
+    screen_puts(s, 0, v->height, buf, MIN((size_t) n, sizeof(buf) - 1), STYLE_STATUS);
+    screen_fill(s, n, v->height, s->width, ' ', STYLE_STATUS);
 
-    size_t count = a->count + b->count;
-    if (count > a->capacity) {
-        a->capacity = count;
-        a->data = realloc(a->data, sizeof(Line) * a->capacity);
-        if (!a->data) {
-            fprintf(stderr, "ERROR: Not enough memory...\n");
-            exit(1);
-        }
+    size_t message_len = strlen(e->message);
+    screen_puts(s, 0, v->height + 1, e->message, message_len, STYLE_PROMPT);
+    screen_fill(s, message_len, v->height + 1, s->width, ' ', STYLE_TEXT);
+
+    // Small vertical moves reuse the rows already on the terminal
+    if (v->top_row != v->drawn_top) {
+        long delta = (long) v->top_row - (long) v->drawn_top;
+        if ((size_t) labs(delta) < v->height / 2)
+            screen_scroll(s, 0, v->height, delta);
+    }
+    v->drawn_top = v->top_row;
+
+    size_t cx = v->cursor_x + v->sidebar, cy = v->cursor_y;
+    if (v->renderer) {
+        renderer_submit(v->renderer, s, cx, cy);
+        return;
     }
+    TRACE_BEGIN(flush);
+    screen_flush(s, out, cx, cy);
+    TRACE_END(TRACE_FLUSH, flush);
+}
 
-    memcpy(a->data + a->count, b->data, b->count);
-    a->count += b->count;
-    lines_remove(lines, pos_b);
+int terminal_input_pending(void)
+{
+    struct pollfd fds = { .fd = STDIN_FILENO, .events = POLLIN };
+    return poll(&fds, 1, 0) > 0;
 }
 
-void lines_free(Lines *lines)
+// Indexes the rest of the file and lexes it for the syntax cache in the
+// background until a key arrives. A frame whose highlighting was guessed is
+// drawn again once the cache has caught up with it. A running search gets
+// the screen first.
+void editor_index_while_idle(Editor *e, Viewport *v)
 {
-    if (lines && lines->data) {
-        for (size_t i = 0; i < lines->count; ++i) {
-            line_free(&lines->data[i]);
+    if (search_busy(&e->search))
+        return;
+    while (!pt_indexed(&e->text) && !terminal_input_pending())
+        pt_index_step(&e->text);
+    int lexing = 1;
+    while (lexing && !terminal_input_pending()) {
+        lexing = syntax_step(&e->text);
+        if (v->guessed && e->text.syntax.valid > v->top) {
+            viewport_update(v, e);
+            render(stdout, e, v, ' ');
         }
-        free(lines->data);
-        lines->count = 0;
-        lines->capacity = 0;
-        lines->data = NULL;
     }
 }
 
-void editor_compute_size(Editor *e)
+// Compacts the buffer and reads whatever is available within `timeout_ms`
+// (-1 blocks). Returns the number of bytes read, -1 once input is closed.
+ssize_t input_fill(Input *in, int timeout_ms)
 {
-    struct winsize w;
-    if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &w)) == -1) {
-        fprintf(stderr, "ERROR: Unable to get terminal window size.\n");
-        exit(1);
+    if (in->start > 0) {
+        memmove(in->data, in->data + in->start, in->count);
+        in->start = 0;
     }
+    if (in->count == sizeof(in->data))
+        return 0;
 
-    e->width = w.ws_col;
-    e->height = w.ws_row;
+    struct pollfd fds[2] = { { .fd = in->fd, .events = POLLIN }, { .fd = in->watch, .events = POLLIN } };
+    if (poll(fds, in->watch > 0 ? 2 : 1, timeout_ms) <= 0 || fds[0].revents == 0)
+        return 0;
+
+    ssize_t n = read(in->fd, in->data + in->count, sizeof(in->data) - in->count);
+    if (n <= 0)
+        return -1;
+    in->count += n;
+    return n;
 }
 
-void editor_read_from_file(Editor *e, const char* filename)
+// Waits up to `timeout_ms` (-1 blocks) for input and then drains everything
+// that is already available, so a burst of keys or a paste is handled in one
+// go. Returns 0 once input is closed.
+int input_read(Input *in, int timeout_ms)
 {
-    struct stat statbuf;
-    if ((stat(filename, &statbuf)) < 0) {
-        fprintf(stderr, "ERROR: Unable to locate file '%s'.\n", filename);
-        exit(1);
-    }
+    if (input_fill(in, timeout_ms) < 0)
+        return 0;
+    while (in->count < sizeof(in->data) && input_fill(in, 0) > 0)
+        ;
+    return 1;
+}
 
-    size_t file_size = statbuf.st_size;
+void input_consume(Input *in, size_t n)
+{
+    in->start += n;
+    in->count -= n;
+}
 
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "ERROR: Unable to open file '%s'.\n", filename);
-        exit(1);
-    }
+// Collects a bracketed paste up to its end marker into `in->paste`
+void input_read_paste(Input *in)
+{
+    const char *end = PASTE_END;
+    size_t end_len = strlen(end);
+    in->paste.count = 0;
+    // Only the terminal can end the wait for the rest of the paste
+    int watch = in->watch;
+    in->watch = 0;
 
-    char *contents = malloc(file_size);
-    if (!contents) {
-        fprintf(stderr, "ERROR: Unable to load file '%s' to memory.\n", filename);
-        exit(1);
-    }
+    for (;;) {
+        const unsigned char *data = in->data + in->start;
+        const unsigned char *marker = memmem(data, in->count, end, end_len);
+        if (marker) {
+            line_append_str(&in->paste, (const char *) data, marker - data);
+            input_consume(in, marker - data + end_len);
+            break;
+        }
 
-    size_t bytes_read = fread(contents, sizeof(char), file_size/sizeof(char), file);
-    if (bytes_read < file_size) {
-        fprintf(stderr, "ERROR: Only %zu bytes of %zu were read.\n", bytes_read, file_size);
-        exit(1);
+        // Keeps a possibly split end marker in the buffer
+        size_t n = in->count >= end_len ? in->count - end_len + 1 : 0;
+        line_append_str(&in->paste, (const char *) data, n);
+        input_consume(in, n);
+        if (input_fill(in, -1) < 0)
+            break;
     }
 
-    Line l;
-    line_init(&l);
-    char c;
-    for (size_t i = 0; i < file_size; ++i) {
-        c = contents[i];
-        if (c == '\n') {
-            lines_append(&e->lines, &l);
-            line_init(&l);
-        } else {
-            line_append(&l, c);
-        }
-    }
-    e->filename = filename;
+    in->watch = watch;
 
-    free(contents);
-    fclose(file);
+    // Terminals send newlines in pastes as carriage returns
+    for (size_t i = 0; i < in->paste.count; ++i) {
+        if (in->paste.data[i] == '\r')
+            in->paste.data[i] = '\n';
+    }
 }
 
-void editor_save_to_file(Editor *e, const char *filename) 
+// Length of the escape sequence at the start of the buffer, 0 when it
+// isn't complete yet
+size_t input_escape_length(const unsigned char *data, size_t count)
 {
-    FILE *file = fopen(filename, "w");
-    if (!file) {
-        fprintf(stderr, "ERROR: Unable to open file '%s' for saving.\n", filename);
-        exit(1);
-    }
+    if (count < 2)
+        return 0;
+    if (data[1] == 'O')
+        return count >= 3 ? 3 : 0;
+    if (data[1] != '[')
+        return 1;
 
-    for (size_t i = 0; i < e->lines.count; ++i) {
-        Line *line = &e->lines.data[i];
-        fprintf(file, "%.*s\n", (int) line->count, line->data);
+    for (size_t i = 2; i < count; ++i) {
+        if (data[i] >= 0x40 && data[i] <= 0x7e)
+            return i + 1;
     }
-
-    fclose(file);
+    return 0;
 }
 
-void editor_remove_char(Editor *e)
+// Decodes the next key from the buffer. Returns 0 when the buffer is empty.
+int input_next_key(Input *in, Key *key)
 {
-    if (e->cy < e->lines.count) {
-        if (e->cx == 0) {
-            if (e->cy < 1)
-                return;
-            size_t line_end = e->lines.data[e->cy-1].count;
-            lines_combine(&e->lines, e->cy-1, e->cy);
-            e->cy--;
-            e->cx = line_end;
-        } else {
-            Line *line = &e->lines.data[e->cy];
-            if (e->cx <= line->count) {
-                e->cx--;
-                line_remove(line, e->cx);
+    while (in->count > 0) {
+        const unsigned char *data = in->data + in->start;
+        if (data[0] >= 0x80) {
+            // The rest of a multibyte char is on its way unless it follows right away
+            if (utf8_length(data[0]) > in->count && input_fill(in, ESCAPE_TIMEOUT_MS) > 0)
+                continue;
+            uint32_t cp;
+            size_t len = utf8_decode((const char *) data, in->count, &cp);
+            key->code = len > 1 ? KEY_CHAR : KEY_IGNORED;
+            memcpy(key->text, data, len);
+            key->len = len;
+            input_consume(in, len);
+            return 1;
+        }
+        if (data[0] != ESCAPE) {
+            key->code = data[0];
+            input_consume(in, 1);
+            return 1;
+        }
+
+        size_t len = input_escape_length(data, in->count);
+        if (len == 0) {
+            // A lone ESC is a key of its own unless the rest follows right away
+            if (input_fill(in, ESCAPE_TIMEOUT_MS) > 0)
+                continue;
+            len = 1;
+        }
+
+        key->code = KEY_IGNORED;
+        if (len == 1) {
+            key->code = ESCAPE;
+        } else if (len == 3) {
+            switch (data[2]) {
+                case 'A': key->code = KEY_UP; break;
+                case 'B': key->code = KEY_DOWN; break;
+                case 'C': key->code = KEY_RIGHT; break;
+                case 'D': key->code = KEY_LEFT; break;
             }
+        } else if (len == strlen(PASTE_BEGIN) && memcmp(data, PASTE_BEGIN, len) == 0) {
+            input_consume(in, len);
+            input_read_paste(in);
+            key->code = KEY_PASTE;
+            return 1;
         }
+
+        input_consume(in, len);
+        return 1;
     }
+
+    return 0;
 }
 
-void editor_free(Editor *e)
+void editor_move(Editor *e, int code)
 {
-    lines_free(&e->lines);
+    // INSERT mode may sit right after the last char
+    size_t end = e->mode == INSERT ? 0 : 1;
+    switch (code) {
+        case KEY_LEFT:
+            if (e->cx > 0) {
+                e->cx = editor_prev_col(e, e->cy, e->cx);
+                e->cx_mem = editor_cell(e, e->cy, e->cx).cell;
+            }
+            break;
+        case KEY_DOWN:
+            // Up and down keep to the display column, whatever the bytes
+            if (pt_has_line(&e->text, e->cy + 1)) {
+                e->cy++;
+                editor_goto_cell(e, e->cx_mem);
+            }
+            break;
+        case KEY_UP:
+            if (e->cy > 0) {
+                e->cy--;
+                editor_goto_cell(e, e->cx_mem);
+            }
+            break;
+        case KEY_RIGHT: {
+            size_t next = editor_next_col(e, e->cy, e->cx);
+            if (next > e->cx && next + end <= editor_line_length(e, e->cy)) {
+                e->cx = next;
+                e->cx_mem = editor_cell(e, e->cy, e->cx).cell;
+            }
+        } break;
+    }
 }
 
-void render(FILE *out, Editor *e, Viewport *v, char last)
+// Applies one key to the editor. Returns 0 when the editor should quit.
+int editor_handle_key(Editor *e, Key *key, Input *in)
 {
-    size_t
-        i = 0,
-        line_number = 0,
-        line_len = 0;
+    int c = key->code;
+    // Commands and cursor moves end the undo group, so a whole INSERT session
+    // is undone at once
+    if (e->mode == NORMAL || c == KEY_UP || c == KEY_DOWN || c == KEY_LEFT || c == KEY_RIGHT)
+        journal_group(&e->journal);
+    // Nothing is edited before the recovery prompt is answered, and only
+    // y or n answers it
+    if (e->pending == 'r') {
+        if (c != 'y' && c != 'n')
+            return 1;
+        e->pending = 0;
+        e->message[0] = '\0';
+        editor_recover(e, c == 'y');
+        return 1;
+    }
+    if (c == KEY_PASTE) {
+        if (!editor_following(e))
+            editor_insert(e, in->paste.data, in->paste.count);
+        return 1;
+    }
+    if (c == KEY_UP || c == KEY_DOWN || c == KEY_LEFT || c == KEY_RIGHT) {
+        editor_move(e, c);
+        return 1;
+    }
 
-    fprintf(out, "\033["BG_COLOR"m");
-    for (i = 0; i < v->count; ++i) {
-        if (v->content[i] == '\n') {
-            fprintf(out, "\033[%zu;%dH\033[%sm%4zu \033[22;"FG_COLOR"m",
-                    line_number + 1,
-                    1,
-                    e->cy == line_number + v->top ? HL_COLOR : LINE_NUM_COLOR,
-                    line_number + v->top + 1);
-            fwrite(v->content + i - line_len, sizeof(char), line_len, out);
-            line_len = 0;
-            line_number++;
-        } else {
-            line_len++;
+    if (e->mode == NORMAL) {
+        char pending = e->pending;
+        size_t repeat = e->repeat;
+        e->pending = 0;
+        e->repeat = 0;
+
+        if (pending == '/' || pending == '?' || pending == ':') {
+            editor_prompt_key(e, key, pending);
+            return 1;
         }
-    }
 
-    for (;line_number < v->top + v->height; line_number++) {
-        fprintf(out, "\033[%zu;%dH\033["LINE_NUM_COLOR";"PAD_COLOR"m~\033[K", line_number + 1, 1);
+        if (pending == 's') {
+            e->message[0] = '\0';
+            if (c == 'y') {
+                editor_save_to_file(e, e->filename);
+            }
+            return 1;
+        }
+
+        if ((c >= '1' && c <= '9') || (c == '0' && repeat > 0)) {
+            e->repeat = repeat * 10 + (c - '0');
+            return 1;
+        }
+        e->message[0] = '\0';
+        if ((c == 'i' || c == 'a' || c == 'A' || c == 'o' || c == 'x' || c == 's' || c == 'u' || c == CTRL_R)
+            && editor_following(e))
+            return 1;
+
+        switch (c) {
+            case 'q':
+                return 0;
+            case 'g':
+                if (pending == 'g')
+                    editor_goto_line(e, repeat > 0 ? repeat - 1 : 0);
+                else {
+                    e->pending = 'g';
+                    e->repeat = repeat;
+                }
+                break;
+            case 'G':
+                editor_goto_line(e, repeat > 0 ? repeat - 1 : pt_line_count(&e->text) - 1);
+                break;
+            case 'h':
+                editor_move(e, KEY_LEFT);
+                break;
+            case 'j':
+                editor_move(e, KEY_DOWN);
+                break;
+            case 'k':
+                editor_move(e, KEY_UP);
+                break;
+            case 'l':
+                editor_move(e, KEY_RIGHT);
+                break;
+            case 'i':
+                if (e->cx <= editor_line_length(e, e->cy))
+                    e->mode = INSERT;
+                break;
+            case 'a':
+                if (e->cx < editor_line_length(e, e->cy)) {
+                    e->mode = INSERT;
+                    e->cx = editor_next_col(e, e->cy, e->cx);
+                }
+                break;
+            case 'A': {
+                size_t line_len = editor_line_length(e, e->cy);
+                if (e->cx < line_len) {
+                    e->mode = INSERT;
+                    e->cx = line_len;
+                }
+            } break;
+            case 'o':
+                e->cx = editor_line_length(e, e->cy);
+                editor_insert(e, "\n", 1);
+                e->mode = INSERT;
+                break;
+            case 's':
+                // Answered by the next key
+                snprintf(e->message, sizeof(e->message), "Save buffer to: %s", e->filename);
+                e->pending = 's';
+                break;
+            case '/':
+            case '?':
+            case ':':
+                e->prompt.count = 0;
+                snprintf(e->message, sizeof(e->message), "%c", c);
+                e->pending = c;
+                break;
+            case 'n':
+            case 'N':
+                if (!e->search.active && e->search.pattern.count == 0) {
+                    snprintf(e->message, sizeof(e->message), "No previous search");
+                    break;
+                }
+                for (size_t i = 0; i < (repeat > 0 ? repeat : 1); ++i)
+                    editor_search_jump(e, c == 'n' ? e->search.forward : !e->search.forward);
+                break;
+            case ESCAPE:
+                if (search_busy(&e->search)) {
+                    search_stop(&e->search);
+                    e->search.jump = 0;
+                    snprintf(e->message, sizeof(e->message), "Search cancelled");
+                }
+                break;
+            case 'u':
+            case CTRL_R: {
+                int (*apply)(Editor *) = c == 'u' ? editor_undo : editor_redo;
+                size_t done = 0;
+                while (done < (repeat > 0 ? repeat : 1) && apply(e))
+                    done++;
+                if (done == 0)
+                    snprintf(e->message, sizeof(e->message), "Already at %s change", c == 'u' ? "oldest" : "newest");
+            } break;
+#ifdef TRACE
+            case 'T':
+                trace_dump(stderr);
+                snprintf(e->message, sizeof(e->message), "Trace written to stderr");
+                break;
+#endif
+            case 'x':
+                if (e->cx < editor_line_length(e, e->cy)) {
+                    size_t next = editor_next_col(e, e->cy, e->cx);
+                    editor_text_delete(e, pt_line_start(&e->text, e->cy) + e->cx, next - e->cx);
+                }
+                break;
+            default:
+                break;
+        }
+    } else if (e->mode == INSERT) {
+        switch (c) {
+            case ESCAPE:
+                e->mode = NORMAL;
+                if (e->cx > 0) {
+                    e->cx = editor_prev_col(e, e->cy, e->cx);
+                }
+                break;
+            case ENTER:
+                editor_insert(e, "\n", 1);
+                break;
+            case BSPACE:
+                editor_remove_char(e);
+                break;
+            case TAB: {
+                char spaces[TAB_SIZE];
+                size_t tab_size = TAB_SIZE - editor_cell(e, e->cy, e->cx).cell % TAB_SIZE;
+                memset(spaces, ' ', tab_size);
+                editor_insert(e, spaces, tab_size);
+            } break;
+            case KEY_CHAR:
+                if (e->cx <= editor_line_length(e, e->cy))
+                    editor_insert(e, key->text, key->len);
+                break;
+            default:
+                if (c >= 32 && c <= 127) {
+                    if (e->cx <= editor_line_length(e, e->cy)) {
+                        char ch = c;
+                        editor_insert(e, &ch, 1);
+                    }
+                }
+                break;
+        }
     }
 
-    CURSOR_MOVE_TO((size_t) 0, v->top + v->height);
-    fprintf(out, "\033[1;30;42m | %s | (%zu, %zu) | [%zu, %zu] | {%zu, %zu} | %d |\033[K\033[22m", 
-            mode_to_str(e->mode), e->cx, e->cy, e->width, e->height, v->left, v->top, last);
-    CURSOR_MOVE_TO((size_t) 0, v->top + v->height + 1);
-    fprintf(out, "\033["BG_COLOR"m\033[K");
+    return 1;
+}
 
-    CURSOR_MOVE_TO(e->cx + SIDEBAR_SZ - v->left, e->cy - v->top);
-    fflush(out);
+// Picks up search results, scrolls to the cursor and draws one frame
+void editor_frame(Editor *e, Viewport *v, FILE *out, int last)
+{
+    editor_search_poll(e);
+    viewport_update(v, e);
+    TRACE_BEGIN(render);
+    render(out, e, v, last);
+    TRACE_END(TRACE_RENDER, render);
 }
 
 void run(Editor *e, Viewport *v)
 {
+    Input in = { .fd = STDIN_FILENO };
+    Key key = {0};
+    int running = 1;
 
-    int c;
-    while (read(STDIN_FILENO, &c, 1) == 1 && c != 'q') {
-        if (e->mode == NORMAL) {
-            switch (c) {
-                case 'h':
-                    if (e->cx > 0) {
-                        e->cx--;
-                        e->cx_mem = e->cx;
-                    }
-                    break;
-                case 'j':
-                    if (e->cy < e->lines.count - 1) {
-                        e->cy++;
-                        size_t line_len = e->lines.data[e->cy].count;
-                        e->cx = MIN(line_len > 0 ? line_len - 1 : 0, e->cx_mem);
-                    }
-                    break;
-                case 'k':
-                    if (e->cy > 0) {
-                        e->cy--;
-                        size_t line_len = e->lines.data[e->cy].count;
-                        e->cx = MIN(line_len > 0 ? line_len - 1 : 0, e->cx_mem);
-                    }
-                    break;
-                case 'l':
-                    if (e->cx < e->lines.data[e->cy].count - 1) {
-                        e->cx++;
-                        e->cx_mem = e->cx;
-                    }
-                    break;
-                case 'i':
-                    if (e->cy < e->lines.count && e->cx <= e->lines.data[e->cy].count)
-                        e->mode = INSERT;
-                    break;
-                case 'a':
-                    if (e->cy < e->lines.count && e->cx < e->lines.data[e->cy].count) {
-                        e->mode = INSERT;
-                        e->cx++;
-                    }
-                    break;
-                case 'A':
-                    if (e->cy < e->lines.count) {
-                        Line *line = &e->lines.data[e->cy];
-                        if (e->cx < line->count) {
-                            e->mode = INSERT;
-                            e->cx = line->count;
-                        }
-                    }
-                    break;
-                case 'o':
-                    if (e->cy < e->lines.count) {
-                        Line line = {0};
-                        lines_insert(&e->lines, e->cy, &line);
-                        e->cx = 0;
-                        e->cy++;
-                        e->mode = INSERT;
-                    }
-                    break;
-                case 's':
-                    CURSOR_MOVE_TO((size_t) 0, v->top + v->height + 1);
-                    fprintf(stdout, "\033["HL_COLOR"mSave buffer to: %s\033[0m", e->filename);
-                    int yn = getchar();
-                    if (yn == 'y') {
-                        editor_save_to_file(e, e->filename);
-                    }
-                    break;
-                case 'x':
-                    if (e->cy < e->lines.count) {
-                        Line *line = &e->lines.data[e->cy];
-                        if (e->cx < line->count) {
-                            line_remove(line, e->cx);
-                        }
-                    }
-                    break;
-                default:
-                    break;
-            }
-        } else if (e->mode == INSERT) {
-            switch (c) {
-                case ESCAPE:
-                    e->mode = NORMAL;
-                    if (e->cx > 0) {
-                        e->cx--;
-                    }
-                    break;
-                case ENTER:
-                    if (e->cy < e->lines.count) {
-                        Line *line = &e->lines.data[e->cy];
-                        if (e->cx >= 0 && e->cy <= e->lines.count) {
-                            Line new_line = line->count != 0
-                                ? line_split_at(line, e->cx)
-                                : (Line) {0};
-                            lines_insert(&e->lines, e->cy, &new_line);
-                            e->cy++;
-                            e->cx = 0;
-                        }
-                    }
-                    break;
-                case BSPACE:
-                    editor_remove_char(e);
-                    break;
-                case TAB:
-                    if (e->cy < e->lines.count) {
-                        Line *line = &e->lines.data[e->cy];
-                        size_t tab_size = TAB_SIZE - e->cx % TAB_SIZE;
-                        for (size_t i = 0; i < tab_size; ++i) {
-                            line_insert(line, e->cx, ' ');
-                            e->cx++;
-                        }
-                    }
-                    break;
-                default:
-                    if (c >= 32 && c <= 127) {
-                        if (e->cy < e->lines.count) {
-                            Line *line = &e->lines.data[e->cy];
-                            if (e->cx <= line->count) {
-                                line_insert(line, e->cx, c);
-                                e->cx++;
-                            }
-                        }
-                    }
-                    break;
-            }
+    int growing = 0;
+
+    editor_index_while_idle(e, v);
+    while (running) {
+        // A search in the background gets the screen refreshed even without input
+        int timeout = search_busy(&e->search) ? SEARCH_POLL_MS : -1;
+        // A followed file wakes the loop when it is written to. While it
+        // keeps growing it is looked at once a frame instead.
+        in.watch = e->follow.active && !growing ? e->follow.fd : 0;
+        if (e->follow.active && growing)
+            timeout = timeout < 0 ? FOLLOW_POLL_MS : MIN(timeout, FOLLOW_POLL_MS);
+        if (!input_read(&in, timeout))
+            break;
+        growing = editor_follow_poll(e);
+        TRACE_BEGIN(key);
+        // Every key that arrived is applied before a single frame is drawn
+        TRACE_BEGIN(edit);
+        while (running && input_next_key(&in, &key)) {
+            running = editor_handle_key(e, &key, &in);
         }
+        TRACE_END(TRACE_EDIT, edit);
 
-        viewport_update(v, e);
-        render(stdout, e, v, c);
+        editor_frame(e, v, stdout, key.code);
+        TRACE_END(TRACE_KEY, key);
+        editor_index_while_idle(e, v);
     }
+
+    line_free(&in.paste);
 }
 
 #ifndef UNIT_TEST
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
+    int follow = argc == 3 && strcmp(argv[1], "-f") == 0;
+    if (argc != 2 + follow) {
         fprintf(stderr, "Invalid number of arguments provided.\n");
-        fprintf(stdout, "\nUSAGE: cea <filename>\n");
+        fprintf(stdout, "\nUSAGE: cea [-f] <filename>\n");
         exit(1);
     }
 
-    char *filename = argv[1];
+    char *filename = argv[1 + follow];
 
     Editor e = {0};
     Viewport v = {0};
 
     editor_read_from_file(&e, filename);
+    if (follow)
+        editor_follow_start(&e);
     editor_compute_size(&e);
 
     viewport_update(&v, &e);
-    viewport_write(&v, &e.lines);
 
-    CLEAR();
     terminal_enable_raw_mode();
+    Renderer renderer = {0};
+    v.screen.sync = renderer.screen.sync = terminal_query_sync();
+    // Without a thread frames are written in between keys instead
+    if (renderer_start(&renderer, stdout, RENDER_FPS))
+        v.renderer = &renderer;
 
     render(stdout, &e, &v, ' ');
     run(&e, &v);
 
+    if (v.renderer)
+        renderer_stop(&renderer);
     terminal_disable_raw_mode();
+#ifdef TRACE
+    trace_dump(stderr);
+#endif
 
     editor_free(&e);
     viewport_free(&v);
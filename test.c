@@ -1,3 +1,5 @@
+#include <dirent.h>
+#include <regex.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -14,204 +16,2170 @@ void test(void (*f)(void), const char *display_name)
     f();
 }
 
-void test_line_insert(void)
+void test_line_append(void)
 {
     Line line;
     line_init(&line);
 
-    line_insert(&line, 0, 'c');
+    line_append(&line, 'c');
 
-    assert(line.count == 1 && "line_insert gave incorrect count");
-    assert(line.data[0] == 'c' && "line_insert did not insert correct char");
+    assert(line.count == 1 && "line_append gave incorrect count");
+    assert(line.data[0] == 'c' && "line_append did not append correct char");
+    line_free(&line);
 }
 
-void test_line_insert_multiple(void)
+void test_line_append_str(void)
 {
     Line line;
     line_init(&line);
 
-    line_insert(&line, 0, 'a');
-    line_insert(&line, 0, 'e');
-    line_insert(&line, 0, 'c');
-    line_insert(&line, 0, '\0');
+    line_append_str(&line, "cea", 3);
+    line_append_str(&line, "cea", 3);
 
-    assert(line.count == 4 && "line_insert_multiple gave incorrect count");
-    assert(strcmp(line.data, "cea") != 1 && "line_insert_multiple did not insert correct chars");
+    assert(line.count == 6 && "line_append_str gave incorrect count");
+    assert(memcmp(line.data, "ceacea", 6) == 0 && "line_append_str did not append correct chars");
+    line_free(&line);
 }
 
-void lines_fill(Lines *lines) {
-    Line line;
+void text_fill(PieceTable *pt) {
+    size_t size = 10 * 11;
+    char *data = malloc(size);
     for (size_t row = 0; row < 10; ++row) { 
-        line_init(&line);
         for (size_t col = 0; col < 10; ++col) {
-            line_append(&line, 'a' + col);
+            data[row * 11 + col] = 'a' + col;
         }
-        lines_append(lines, &line);
+        data[row * 11 + 10] = '\n';
     }
-
+    pt_init(pt);
+    pt_load(pt, data, size, 0);
 }
 
-void lines_dump(Lines *lines) {
+void text_dump(PieceTable *pt) {
+    Line line = {0};
     printf("==================\n");
-    for (size_t i = 0; i <= lines->count; ++i) { 
-        Line *l = &lines->data[i];
-        printf("%2zu: %.*s (%zu)\n", i, (int) l->count, l->data, l->count);
+    for (size_t i = 0; i < pt_line_count(pt); ++i) { 
+        pt_line(pt, i, &line);
+        printf("%2zu: %.*s (%zu)\n", i, (int) line.count, line.data, line.count);
     }
     printf("==================\n");
+    line_free(&line);
+}
+
+void assert_text(PieceTable *pt, const char *expected)
+{
+    size_t size = pt_size(pt);
+    char *buf = malloc(size + 1);
+    size_t n = pt_read(pt, 0, buf, size);
+    assert(n == size && "pt_read returned incorrect count");
+    assert(size == strlen(expected) && "incorrect document size");
+    assert(memcmp(buf, expected, size) == 0 && "incorrect document contents");
+    free(buf);
+}
+
+void test_pt_load(void)
+{
+    PieceTable pt;
+    text_fill(&pt);
+
+    assert(pt_line_count(&pt) == 10 && "incorrect amount of lines");
+    assert(pt_size(&pt) == 109 && "trailing newline should not be part of the document");
+    assert(pt_line_length(&pt, 9) == 10 && "incorrect line length");
+    assert(pt_line_start(&pt, 3) == 33 && "incorrect line start");
+    pt_free(&pt);
+}
+
+void test_pt_load_empty(void)
+{
+    PieceTable pt;
+    pt_init(&pt);
+    pt_load(&pt, NULL, 0, 0);
+
+    assert(pt_line_count(&pt) == 1 && "empty document should have one line");
+    assert(pt_line_length(&pt, 0) == 0 && "incorrect line length");
+    pt_free(&pt);
+}
+
+void test_pt_insert(void)
+{
+    PieceTable pt;
+    pt_init(&pt);
+
+    pt_insert(&pt, 0, "a", 1);
+    pt_insert(&pt, 0, "e", 1);
+    pt_insert(&pt, 0, "c", 1);
+
+    assert(pt_line_count(&pt) == 1 && "incorrect amount of lines");
+    assert_text(&pt, "cea");
+    pt_free(&pt);
+}
+
+void test_pt_insert_coalesce(void)
+{
+    PieceTable pt;
+    pt_init(&pt);
+
+    pt_insert(&pt, 0, "c", 1);
+    pt_insert(&pt, 1, "e", 1);
+    pt_insert(&pt, 2, "a\n", 2);
+
+    assert(pt.root && !pt.root->left && !pt.root->right && "consecutive inserts should share a piece");
+    assert(pt_line_count(&pt) == 2 && "incorrect amount of lines");
+    assert_text(&pt, "cea\n");
+    pt_free(&pt);
+}
+
+void test_pt_split_line(void)
+{
+    PieceTable pt;
+    text_fill(&pt);
+
+    pt_insert(&pt, pt_line_start(&pt, 2) + 4, "\n", 1);
+
+    assert(pt_line_count(&pt) == 11 && "incorrect amount of lines");
+    assert(pt_line_length(&pt, 2) == 4 && "incorrect line length");
+    assert(pt_line_length(&pt, 3) == 6 && "incorrect line length");
+    assert(pt_line_length(&pt, 4) == 10 && "incorrect line length");
+    pt_free(&pt);
+}
+
+void test_pt_delete(void)
+{
+    PieceTable pt;
+    text_fill(&pt);
+
+    pt_delete(&pt, pt_line_start(&pt, 1), 11);
+
+    assert(pt_line_count(&pt) == 9 && "incorrect amount of lines");
+    assert(pt_line_length(&pt, 1) == 10 && "incorrect line length");
+    pt_free(&pt);
+}
+
+void test_pt_combine(void)
+{
+    PieceTable pt;
+    text_fill(&pt);
+
+    pt_delete(&pt, pt_line_start(&pt, 1) - 1, 1);
+
+    assert(pt_line_count(&pt) == 9 && "incorrect amount of lines");
+    assert(pt_line_length(&pt, 0) == 20 && "incorrect line length");
+    assert(pt_line_length(&pt, 1) == 10 && "incorrect line length");
+    pt_free(&pt);
+}
+
+void test_pt_random_edits(void)
+{
+    PieceTable pt;
+    pt_init(&pt);
+    Line model = {0};
+
+    srand(1);
+    for (size_t i = 0; i < 2000; ++i) {
+        size_t pos = model.count ? (size_t) rand() % (model.count + 1) : 0;
+        if (rand() % 3 == 0 && pos < model.count) {
+            size_t len = (size_t) rand() % 8 + 1;
+            len = MIN(len, model.count - pos);
+            pt_delete(&pt, pos, len);
+            memmove(model.data + pos, model.data + pos + len, model.count - pos - len);
+            model.count -= len;
+        } else {
+            char str[4] = { 'a' + rand() % 26, '\n', 'b', 'c' };
+            size_t len = rand() % 4 + 1;
+            pt_insert(&pt, pos, str, len);
+            line_reserve(&model, model.count + len);
+            memmove(model.data + pos + len, model.data + pos, model.count - pos);
+            memcpy(model.data + pos, str, len);
+            model.count += len;
+        }
+    }
+
+    line_append(&model, '\0');
+    assert_text(&pt, model.data);
+
+    size_t lines = 1;
+    for (size_t i = 0; i + 1 < model.count; ++i) {
+        if (model.data[i] == '\n') {
+            assert(pt_line_start(&pt, lines) == i + 1 && "incorrect line start");
+            lines++;
+        }
+    }
+    assert(pt_line_count(&pt) == lines && "incorrect amount of lines");
+
+    line_free(&model);
+    pt_free(&pt);
+}
+
+size_t piece_count(Piece *p)
+{
+    return p ? 1 + piece_count(p->left) + piece_count(p->right) : 0;
+}
+
+void test_pt_arena(void)
+{
+    PieceTable pt;
+    text_fill(&pt);
+
+    // Splitting and deleting the same range over and over reuses the pieces
+    for (size_t i = 0; i < 10 * PIECE_CHUNK; ++i) {
+        pt_insert(&pt, 5, "x", 1);
+        pt_insert(&pt, 50, "y", 1);
+        pt_delete(&pt, 5, 1);
+        pt_delete(&pt, 49, 1);
+    }
+
+    assert(pt.arena.chunk_count == 1 && "freed pieces should be reused");
+    assert(pt.arena.live == piece_count(pt.root) && "incorrect amount of live pieces");
+
+    size_t used, reserved;
+    pt_memory(&pt, &used, &reserved);
+    assert(used > 109 && used <= reserved && "incorrect memory usage");
+    pt_free(&pt);
+    assert(!pt.arena.chunks && !pt.arena.live && "arena should be released");
+}
+
+void test_pt_iter_read_line(void)
+{
+    PieceTable pt;
+    text_fill(&pt);
+    pt_insert(&pt, pt_line_start(&pt, 4) + 2, "xy\nz", 4);
+    pt_delete(&pt, pt_line_start(&pt, 7), 3);
+
+    PieceIter it = {0};
+    Line expected = {0};
+    Line line = {0};
+    pt_iter_seek(&it, &pt, pt_line_start(&pt, 2));
+    for (size_t row = 2; row < pt_line_count(&pt); ++row) {
+        pt_line(&pt, row, &expected);
+        pt_iter_read_line(&it, &line);
+        assert(line.count == expected.count && "incorrect line length");
+        assert(memcmp(line.data, expected.data, line.count) == 0 && "incorrect line contents");
+    }
+    assert(it.piece == NULL && "iterator should be exhausted");
+
+    pt_iter_free(&it);
+    line_free(&expected);
+    line_free(&line);
+    pt_free(&pt);
+}
+
+// Writes `rows` numbered lines to a temporary file and returns its path
+char *text_file(size_t rows)
+{
+    static char path[] = "/tmp/cea_test_XXXXXX";
+    strcpy(path, "/tmp/cea_test_XXXXXX");
+    int fd = mkstemp(path);
+    assert(fd >= 0 && "unable to create temporary file");
+
+    FILE *file = fdopen(fd, "w");
+    for (size_t row = 0; row < rows; ++row) {
+        fprintf(file, "line %zu\n", row);
+    }
+    fclose(file);
+
+    return path;
+}
+
+void test_editor_read_lazy(void)
+{
+    char *path = text_file(50000);
+    Editor e = {0};
+    editor_read_from_file(&e, path);
+
+    assert(e.text.buffers[BUF_ORIGINAL].mapped && "file should be mapped");
+    assert(e.text.scanned == 0 && "nothing should be indexed before use");
+
+    Line line = {0};
+    pt_line(&e.text, 10, &line);
+    assert(line.count == 7 && memcmp(line.data, "line 10", 7) == 0 && "incorrect line contents");
+    assert(e.text.scanned < e.text.buffers[BUF_ORIGINAL].count && "only the start should be indexed");
+
+    pt_insert(&e.text, pt_line_start(&e.text, 3), "new\n", 4);
+    assert(pt_line_count(&e.text) == 50001 && "incorrect amount of lines");
+    assert(pt_indexed(&e.text) && "file should be fully indexed");
+
+    pt_line(&e.text, 49000, &line);
+    assert(line.count == 10 && memcmp(line.data, "line 48999", 10) == 0 && "incorrect line contents");
+
+    line_free(&line);
+    editor_free(&e);
+    unlink(path);
+}
+
+// Whether the file at `path` holds the document and its final newline
+int file_matches(const char *path, PieceTable *pt)
+{
+    size_t size = pt_size(pt);
+    char *expected = malloc(size + 1), *actual = malloc(size + 2);
+    pt_read(pt, 0, expected, size);
+    expected[size] = '\n';
+    FILE *file = fopen(path, "r");
+    size_t n = fread(actual, 1, size + 2, file);
+    fclose(file);
+    int same = n == size + 1 && memcmp(expected, actual, n) == 0;
+    free(expected);
+    free(actual);
+    return same;
+}
+
+void test_editor_save(void)
+{
+    char *path = text_file(50000);
+    chmod(path, 0640);
+    Editor e = {0};
+    editor_read_from_file(&e, path);
+    struct stat before;
+    stat(path, &before);
+
+    pt_insert(&e.text, pt_line_start(&e.text, 20000), "new\n", 4);
+    pt_delete(&e.text, pt_line_start(&e.text, 30000), 20);
+    editor_save_to_file(&e, path);
+    assert(e.message[0] == '\0' && "save should succeed");
+    assert(file_matches(path, &e.text) && "saved file should hold the document");
+
+    struct stat after;
+    stat(path, &after);
+    assert(after.st_ino != before.st_ino && "file should be replaced, not rewritten");
+    assert((after.st_mode & 07777) == 0640 && "mode should be kept");
+
+    // The original is still read from the file that was replaced
+    Line line = {0};
+    pt_line(&e.text, 40000, &line);
+    assert(line.count == 10 && memcmp(line.data, "line 40000", 10) == 0 && "original should stay readable");
+
+    pt_insert(&e.text, 0, "top\n", 4);
+    editor_save_to_file(&e, path);
+    assert(file_matches(path, &e.text) && "second save should copy from the original, not the last save");
+
+    const char *name = strrchr(path, '/') + 1;
+    size_t len = strlen(name), left = 0;
+    DIR *dir = opendir("/tmp");
+    for (struct dirent *entry; (entry = readdir(dir));)
+        left += strncmp(entry->d_name, name, len) == 0 && entry->d_name[len] == '.';
+    closedir(dir);
+    assert(left == 0 && "no temporary file should be left");
+
+    // The rename is synced through the directory it was made in
+    assert(fsync_parent(path) == 0 && fsync_parent("/tmp") == 0 && fsync_parent("file") == 0);
+    assert(fsync_parent("/missing/file") < 0 && errno == ENOENT && "a missing directory should fail");
+
+    line_free(&line);
+    editor_free(&e);
+    unlink(path);
+}
+
+// Ends the journaling of `e` the way a crash would, after the last batch
+// went out, leaving the swap file behind
+void swap_crash(Editor *e)
+{
+    Swap *s = &e->swap;
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_signal(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    close(s->fd);
+    free(s->path);
+    s->path = NULL;
+    s->running = 0;
+}
+
+char *document(PieceTable *pt)
+{
+    char *text = malloc(pt_size(pt) + 1);
+    text[pt_read(pt, 0, text, pt_size(pt))] = '\0';
+    return text;
+}
+
+void test_editor_swap(void)
+{
+    char *path = text_file(1000);
+    Editor e = {0};
+    editor_read_from_file(&e, path);
+    assert(e.pending == 0 && "a file without a swap file should open as it is");
+
+    editor_text_insert(&e, pt_line_start(&e.text, 10), "lost\n", 5);
+    editor_save_to_file(&e, path);
+    editor_text_insert(&e, pt_line_start(&e.text, 500), "kept\n", 5);
+    editor_text_delete(&e, pt_line_start(&e.text, 20), 300);
+    journal_group(&e.journal);
+    editor_text_insert(&e, 0, "undone", 6);
+    editor_undo(&e);
+    editor_text_insert(&e, 7, "redone", 6);
+    editor_undo(&e);
+    editor_redo(&e);
+    char *expected = document(&e.text);
+    swap_crash(&e);
+    editor_free(&e);
+
+    char swap[64];
+    snprintf(swap, sizeof(swap), "/tmp/.%s.cea", path + 5);
+    // A crash mid-write leaves the last edit cut off
+    int fd = open(swap, O_WRONLY | O_APPEND);
+    assert(fd >= 0 && "edits after the save should be in the swap file");
+    write(fd, "\0\x05\x40" "ab", 5);
+    close(fd);
+
+    Editor r = {0};
+    editor_read_from_file(&r, path);
+    assert(r.pending == 'r' && "recovery should be offered");
+    int ignored[] = { 'j', KEY_DOWN, KEY_PASTE, 'x', ESCAPE };
+    Input in = { .paste = { .data = "pasted", .count = 6 } };
+    for (size_t i = 0; i < sizeof(ignored) / sizeof(ignored[0]); ++i) {
+        Key key = { .code = ignored[i] };
+        editor_handle_key(&r, &key, &in);
+    }
+    assert(r.pending == 'r' && strstr(r.message, "Recover") && "only y or n should answer the prompt");
+    assert(file_matches(path, &r.text) && "nothing should be edited before the answer");
+    struct stat swapped;
+    assert(stat(swap, &swapped) == 0 && swapped.st_size > (off_t) sizeof(SwapHeader) &&
+            "the swap file should be kept until the answer");
+    Key key = {.code = 'y'};
+    editor_handle_key(&r, &key, NULL);
+    char *recovered = document(&r.text);
+    assert(strcmp(recovered, expected) == 0 && "replayed edits should rebuild the buffer");
+    assert(strstr(r.message, "damaged") && "a cut off edit should be reported");
+    editor_undo(&r);
+    assert(file_matches(path, &r.text) && "recovery should undo as one group");
+    editor_redo(&r);
+    swap_crash(&r);
+    editor_free(&r);
+
+    // The swap file no longer applies once the file changes
+    FILE *file = fopen(path, "a");
+    fputs("more\n", file);
+    fclose(file);
+    Editor stale = {0};
+    editor_read_from_file(&stale, path);
+    assert(stale.pending == 0 && strstr(stale.message, "moved") && "an old swap file should be moved aside");
+    editor_free(&stale);
+    assert(access(swap, F_OK) != 0 && "quitting should remove the swap file");
+
+    strcat(swap, "~");
+    unlink(swap);
+    free(expected);
+    free(recovered);
+    unlink(path);
+}
+
+void append_file(const char *path, const char *text)
+{
+    FILE *file = fopen(path, "a");
+    fputs(text, file);
+    fclose(file);
 }
 
-void test_lines_remove(void)
+void test_editor_follow(void)
 {
-    Lines lines;
-    lines_init(&lines);
-    lines_fill(&lines);
+    char *path = text_file(100);
+    Editor e = { .mode = NORMAL };
+    editor_read_from_file(&e, path);
+    editor_command(&e, "set follow", 10);
+    assert(e.follow.active && e.cy == 99 && "following should start on the last line");
 
-    lines_remove(&lines, 1);
+    append_file(path, "line 100\nline 1");
+    struct pollfd fds = { .fd = e.follow.fd, .events = POLLIN };
+    assert(poll(&fds, 1, 0) == 1 && "a write should wake the watch");
+    assert(editor_follow_poll(&e) && "the document should grow");
+    assert(pt_line_count(&e.text) == 102 && e.cy == 101 && "the cursor should stay on the last line");
+    assert(!editor_follow_poll(&e) && "nothing new should be taken in twice");
 
-    assert(lines.count == 9 && "incorrect amount of lines");
-    assert(lines.data[1].count == 10 && "incorrect line length");
-    assert(lines.data[1].data[0] == 'a' && "incorrect data");
+    append_file(path, "01\n");
+    editor_follow_poll(&e);
+    Line line = {0};
+    pt_line(&e.text, 101, &line);
+    assert(pt_line_count(&e.text) == 102 && line.count == 8 && memcmp(line.data, "line 101", 8) == 0
+           && "a line written in parts should be joined");
+
+    // Only a cursor on the last line is moved along
+    e.cy = 50;
+    append_file(path, "line 102\n");
+    editor_follow_poll(&e);
+    assert(e.cy == 50 && pt_line_count(&e.text) == 103 && "the cursor should be left where it is");
+
+    // The rows of a wrapped last line are counted again as it grows
+    append_file(path, "xxxxxxxxxxxxxxxxxxxxxxxxx");
+    editor_follow_poll(&e);
+    assert(wrap_info(&e.text, 10, 103).rows == 3 && "partial line should wrap");
+    append_file(path, "xxxxxxxxxx\n");
+    editor_follow_poll(&e);
+    assert(wrap_info(&e.text, 10, 103).rows == 4 && "the rest of the line should wrap too");
+
+    Key key = { .code = 'x' };
+    editor_handle_key(&e, &key, NULL);
+    assert(strstr(e.message, "Following") && file_matches(path, &e.text) && "a followed file should not be edited");
+
+    // Log rotation copies the file away and cuts it short. The old text is
+    // past the end of the file, a read of it would fault.
+    for (size_t i = 0; i < 2000; ++i)
+        append_file(path, "a longer line of the log to fill some pages\n");
+    editor_follow_poll(&e);
+    journal_group(&e.journal);
+    truncate(path, 0);
+    append_file(path, "rotated\n");
+    assert(editor_follow_poll(&e) && strstr(e.message, "truncated") && "the cut should be noticed");
+    assert(e.follow.active && pt_size(&e.text) == 7 && pt_line_count(&e.text) == 1 &&
+            "the document should start over with the file");
+    Viewport v = {0};
+    e.width = 80;
+    e.height = 24;
+    viewport_update(&v, &e);
+    pt_line(&e.text, 0, &line);
+    assert(line.count == 7 && memcmp(line.data, "rotated", 7) == 0 && e.cy == 0);
+    editor_undo(&e);
+    assert(pt_size(&e.text) == 7 && "nothing from before the cut should be undone");
+    append_file(path, "next\n");
+    editor_follow_poll(&e);
+    assert(pt_line_count(&e.text) == 2 && e.cy == 1 && "following should go on after the cut");
+    viewport_free(&v);
+
+    line_free(&line);
+    editor_free(&e);
+    unlink(path);
+}
+
+void test_substring_scanners(void)
+{
+    size_t len = 4099;
+    char *data = malloc(len + 64);
+    srand(4);
+    for (size_t i = 0; i < len + 64; ++i) {
+        data[i] = "ab\n"[rand() % 3];
+    }
+
+    SubstringScanner scanners[] = {
+        substring_scan_scalar,
+#if defined(__x86_64__) || defined(__i386__)
+        substring_scan_sse2,
+        __builtin_cpu_supports("avx2") ? substring_scan_avx2 : substring_scan_sse2,
+#endif
+    };
+
+    for (size_t n = 1; n < 12; ++n) {
+        const char *pat = data + rand() % len;
+        Matches expected = {0};
+        for (size_t i = 0; i < len; ++i) {
+            if (memcmp(data + i, pat, n) == 0)
+                matches_push(&expected, 100 + i, n);
+        }
+        for (size_t i = 0; i < sizeof(scanners) / sizeof(SubstringScanner); ++i) {
+            Matches found = {0};
+            scanners[i](data, len, pat, n, 100, &found);
+            assert(found.count == expected.count && "scanner found incorrect amount of matches");
+            assert(memcmp(found.data, expected.data, sizeof(Match) * found.count) == 0 && "scanner found incorrect offsets");
+            matches_free(&found);
+        }
+        matches_free(&expected);
+    }
+
+    free(data);
+}
+
+// Writes the matches of `pat` in `text` as "pos:len" pairs
+const char *regex_matches(const char *pat, const char *text)
+{
+    static char buf[256];
+    Regex re;
+    const char *error;
+    if (regex_compile(&re, pat, strlen(pat), &error) < 0)
+        return error;
+
+    Matches m = {0};
+    regex_scan(&re, text, strlen(text), 0, &m);
+    buf[0] = '\0';
+    for (size_t i = 0; i < m.count; ++i)
+        sprintf(buf + strlen(buf), "%s%zu:%zu", i ? " " : "", m.data[i].pos, m.data[i].len);
+    matches_free(&m);
+    regex_free(&re);
+    return buf;
+}
+
+void test_regex(void)
+{
+    const char *cases[][3] = {
+        { "abc", "xabcabc", "1:3 4:3" },
+        { "a.c", "abc a\nc axc", "0:3 8:3" },
+        { "ab*", "a abbb b", "0:1 2:4" },
+        { "ab+", "a abbb b", "2:4" },
+        { "colou?r", "color colour", "0:5 6:6" },
+        { "cat|category", "category", "0:8" },
+        { "(ab)+c", "ababc abc", "0:5 6:3" },
+        { "[a-c]+", "xxabcabdd", "2:5" },
+        { "[^a-c ]+", "ab dd\ncc", "3:2" },
+        { "\\d+\\.\\d*", "v 1.25 and 3.", "2:4 11:2" },
+        { "\\w+", "hi, you_2", "0:2 4:5" },
+        { "^a", "aa\na", "0:1 3:1" },
+        { "a$", "aa\nba", "1:1 4:1" },
+        { "^$", "a\n\nb", "" },
+        { "^.*$", "ab\n\ncd", "0:2 4:2" },
+        { "x*", "axxb", "1:2" },
+        { "(a|ab)(c|bcd)", "abcd", "0:4" },
+        { "(", "", "missing )" },
+        { "a)", "", "unmatched )" },
+        { "*a", "", "nothing to repeat" },
+        { "[ab", "", "missing ]" },
+        { "[z-a]", "", "invalid range" },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        const char *found = regex_matches(cases[i][0], cases[i][1]);
+        if (strcmp(found, cases[i][2]) != 0) {
+            fprintf(stderr, "/%s/ on \"%s\": got \"%s\", expected \"%s\"\n", cases[i][0], cases[i][1], found, cases[i][2]);
+            assert(0 && "incorrect matches");
+        }
+    }
+}
+
+// Random pattern over a, b and c that POSIX extended regexes read alike
+void regex_random(char *out, size_t *n, int depth)
+{
+    int kind = rand() % (depth > 0 ? 7 : 3);
+    if (kind == 0) {
+        out[(*n)++] = "abc."[rand() % 4];
+    } else if (kind == 1) {
+        memcpy(out + *n, "[ab]", 4);
+        *n += 4;
+    } else if (kind == 2) {
+        out[(*n)++] = "ab"[rand() % 2];
+        out[(*n)++] = "*+?"[rand() % 3];
+    } else if (kind <= 4) {
+        regex_random(out, n, depth - 1);
+        regex_random(out, n, depth - 1);
+    } else {
+        out[(*n)++] = '(';
+        regex_random(out, n, depth - 1);
+        if (kind == 6) {
+            out[(*n)++] = '|';
+            regex_random(out, n, depth - 1);
+        }
+        out[(*n)++] = ')';
+        out[(*n)++] = "*+?)"[rand() % 4];
+        if (out[*n - 1] == ')')
+            (*n)--;
+    }
 }
 
-void test_lines_remove_multiple(void)
+// Leftmost longest matches of `posix` line by line, leaving empty ones out
+void regex_expected(regex_t *posix, const char *text, size_t len, Matches *out)
 {
-    Lines lines;
-    lines_init(&lines);
-    lines_fill(&lines);
+    char *line = malloc(len + 1);
+    for (size_t a = 0; a <= len;) {
+        size_t b = a;
+        while (b < len && text[b] != '\n')
+            b++;
+        memcpy(line, text + a, b - a);
+        line[b - a] = '\0';
+        regmatch_t m;
+        for (size_t i = 0; i <= b - a && regexec(posix, line + i, 1, &m, i ? REG_NOTBOL : 0) == 0;) {
+            if (m.rm_eo > m.rm_so) {
+                matches_push(out, a + i + m.rm_so, m.rm_eo - m.rm_so);
+                i += m.rm_eo;
+            } else {
+                i += m.rm_so + 1;
+            }
+        }
+        a = b + 1;
+    }
+    free(line);
+}
 
-    lines_remove(&lines, 1);
-    lines_remove(&lines, 1);
+void assert_regex_posix(Regex *re, const char *pat, const char *text, size_t len)
+{
+    regex_t posix;
+    assert(regcomp(&posix, pat, REG_EXTENDED) == 0);
+    Matches found = {0}, expected = {0};
+    regex_scan(re, text, len, 0, &found);
+    regex_expected(&posix, text, len, &expected);
+    if (found.count != expected.count || (found.count > 0 && memcmp(found.data, expected.data, sizeof(Match) * found.count) != 0)) {
+        fprintf(stderr, "/%s/ on \"%.*s\" disagrees with regexec\n", pat, (int) MIN(len, 80), text);
+        assert(0 && "incorrect matches");
+    }
+    matches_free(&found);
+    matches_free(&expected);
+    regfree(&posix);
+}
+
+void test_regex_posix(void)
+{
+    srand(21);
+    for (size_t round = 0; round < 2000; ++round) {
+        char pat[256];
+        size_t n = 0;
+        if (rand() % 4 == 0)
+            pat[n++] = '^';
+        regex_random(pat, &n, 4);
+        if (rand() % 4 == 0)
+            pat[n++] = '$';
+        pat[n] = '\0';
 
-    assert(lines.count == 8 && "incorrect amount of lines");
+        char text[64];
+        size_t len = rand() % sizeof(text);
+        for (size_t i = 0; i < len; ++i)
+            text[i] = "aabbc\n"[rand() % 6];
+
+        Regex re;
+        const char *error;
+        assert(regex_compile(&re, pat, n, &error) == 0 && "pattern should compile");
+        assert_regex_posix(&re, pat, text, len);
+        regex_free(&re);
+    }
 }
 
-void test_lines_combine(void) 
+void test_regex_cache_flush(void)
 {
-    Lines lines;
-    lines_init(&lines);
-    lines_fill(&lines);
+    // Run backwards this needs a state for every combination of the last
+    // 12 bytes, far more than the cache holds
+    const char *pat = "[ab][ab][ab][ab][ab][ab][ab][ab][ab][ab][ab]a";
+    size_t len = 1 << 16;
+    char *text = malloc(len);
+    srand(4);
+    for (size_t i = 0; i < len; ++i)
+        text[i] = i % 200 == 199 ? '\n' : "ab"[rand() % 2];
 
-    lines_combine(&lines, 0, 1);
- 
-    assert(lines.count == 9 && "incorrect amount of lines");
-    assert(lines.data[0].count == 20 && "incorrect line length");
-    assert(lines.data[1].count == 10 && "incorrect line length");
+    Regex re;
+    const char *error;
+    assert(regex_compile(&re, pat, strlen(pat), &error) == 0);
+    assert_regex_posix(&re, pat, text, len);
+    assert(re.reverse.flushes > 0 && "the cache should have been flushed");
+    regex_free(&re);
+    free(text);
 }
 
-void test_lines_combine_empty(void) 
+void test_regex_long_lines(void)
 {
-    Lines lines;
-    lines_init(&lines);
-    lines_fill(&lines);
-    lines.data[1].count = 0;
+    // Runs from each start go past the next ones, so they meet on the way
+    srand(9);
+    for (size_t round = 0; round < 200; ++round) {
+        char pat[256];
+        size_t n = 0;
+        regex_random(pat, &n, 4);
+        pat[n] = '\0';
 
-    lines_combine(&lines, 0, 1);
+        char text[1024];
+        size_t len = sizeof(text);
+        for (size_t i = 0; i < len; ++i)
+            text[i] = i % 500 == 499 ? '\n' : "aabbc"[rand() % 5];
 
-    assert(lines.count == 9 && "incorrect amount of lines");
-    assert(lines.data[0].count == 10 && "incorrect line length");
-    assert(lines.data[2].count == 10 && "incorrect line length");
-    assert(lines.data[1].count == 10 && "incorrect line length");
+        Regex re;
+        const char *error;
+        assert(regex_compile(&re, pat, n, &error) == 0 && "pattern should compile");
+        assert_regex_posix(&re, pat, text, len);
+        regex_free(&re);
+    }
+
+    // Every run goes on to the end of the line looking for a 'z', which
+    // used to take time in the square of the length
+    const char *pat = "a.*z|a";
+    size_t len = 1 << 18;
+    char *text = malloc(len);
+    memset(text, 'a', len);
+
+    Regex re;
+    const char *error;
+    Matches m = {0};
+    assert(regex_compile(&re, pat, strlen(pat), &error) == 0);
+    clock_t start = clock();
+    regex_scan(&re, text, len, 0, &m);
+    assert(clock() - start < 2 * CLOCKS_PER_SEC && "scan should be linear in the line length");
+    assert(m.count == len && "every 'a' should be a match");
+    assert(m.data[len - 1].pos == len - 1 && m.data[len - 1].len == 1);
+    matches_free(&m);
+    regex_free(&re);
+    free(text);
+}
+
+void test_pt_index_parallel(void)
+{
+    char *path = text_file(200000);
+    Editor seq = {0};
+    Editor par = {0};
+    editor_read_from_file(&seq, path);
+    editor_read_from_file(&par, path);
+
+    while (!pt_indexed(&seq.text))
+        pt_index_chunk(&seq.text);
+    // Leaves an already indexed prefix and odd slice boundaries
+    pt_index_chunk(&par.text);
+    pt_index_parallel(&par.text, par.text.buffers[BUF_ORIGINAL].count, 7);
+
+    TextBuffer *a = &seq.text.buffers[BUF_ORIGINAL];
+    TextBuffer *b = &par.text.buffers[BUF_ORIGINAL];
+    assert(pt_indexed(&par.text) && "file should be fully indexed");
+    assert(a->nl_count == b->nl_count && "incorrect amount of newlines");
+    assert(memcmp(a->newlines, b->newlines, sizeof(size_t) * a->nl_count) == 0 && "incorrect newline offsets");
+    assert(pt_line_count(&seq.text) == pt_line_count(&par.text) && "incorrect amount of lines");
+    assert(pt_size(&seq.text) == pt_size(&par.text) && "incorrect document size");
+    assert(pt_line_start(&seq.text, 123456) == pt_line_start(&par.text, 123456) && "incorrect line start");
+
+    editor_free(&seq);
+    editor_free(&par);
+    unlink(path);
+}
+
+void test_newline_scanners(void)
+{
+    size_t len = 4099;
+    char *data = malloc(len);
+    size_t *expected = malloc(sizeof(size_t) * len);
+    size_t *found = malloc(sizeof(size_t) * len);
+
+    srand(2);
+    for (size_t i = 0; i < len; ++i) {
+        data[i] = rand() % 7 == 0 ? '\n' : 'a' + rand() % 26;
+    }
+
+    NewlineScanner scanners[] = {
+        newline_scan_scalar,
+#if defined(__x86_64__) || defined(__i386__)
+        newline_scan_sse2,
+        __builtin_cpu_supports("avx2") ? newline_scan_avx2 : newline_scan_sse2,
+#endif
+    };
+
+    size_t count = newline_scan_scalar(data, len, 100, expected);
+    for (size_t i = 0; i < sizeof(scanners) / sizeof(NewlineScanner); ++i) {
+        // Unaligned starts exercise the scalar tails
+        for (size_t skip = 0; skip < 3; ++skip) {
+            size_t n = scanners[i](data + skip, len - skip, 100 + skip, found);
+            size_t first = 0;
+            while (first < count && expected[first] < 100 + skip) first++;
+            assert(n == count - first && "scanner found incorrect amount of newlines");
+            assert(memcmp(found, expected + first, sizeof(size_t) * n) == 0 && "scanner found incorrect offsets");
+        }
+    }
+
+    free(data);
+    free(expected);
+    free(found);
+}
+
+void test_newline_table_size(void)
+{
+    size_t len = 1 << 20;
+    char *paste = malloc(len);
+    memset(paste, 'a', len);
+    for (size_t i = 0; i < 10; ++i)
+        paste[i * 100000] = '\n';
+
+    TextBuffer b = {0};
+    text_buffer_append(&b, paste, len);
+    text_buffer_append(&b, paste, len);
+    assert(b.nl_count == 20 && b.newlines[10] == len && "newlines of both pastes should be indexed");
+    assert(b.nl_capacity <= 2 * NEWLINE_BATCH && "the table should grow with the newlines, not the bytes");
+
+    free(paste);
+    free(b.data);
+    free(b.newlines);
 }
 
 void test_editor_remove_char(void)
 {
-    Lines lines;
-    lines_init(&lines);
-    lines_fill(&lines);
+    PieceTable text;
+    text_fill(&text);
 
     Editor e = {
         .cx = 3,
         .cy = 6,
         .width = 10,
         .height = 10,
-        .lines = lines,
+        .text = text,
         .mode = NORMAL,
     };
 
     editor_remove_char(&e);
 
-    assert(e.lines.data[6].count == 9 && "incorrect amount of chars");
-    assert(e.lines.data[6].data[3] == ('a' + 4) && "incorrect amount of chars");
+    Line line = {0};
+    pt_line(&e.text, 6, &line);
+    assert(line.count == 9 && "incorrect amount of chars");
+    assert(line.data[3] == ('a' + 4) && "incorrect amount of chars");
+    line_free(&line);
+    editor_free(&e);
 }
 
 void test_remove_editor_remove_line_start(void)
 {
-    Lines lines = {0};
-    lines_init(&lines);
-    lines_fill(&lines);
+    PieceTable text;
+    text_fill(&text);
 
     Editor e = {
         .cx = 0,
         .cy = 6,
         .width = 10,
         .height = 10,
-        .lines = lines,
+        .text = text,
         .mode = NORMAL,
     };
 
     editor_remove_char(&e);
 
-    assert(e.lines.count == 9 && "incorrect amount of lines");
+    assert(pt_line_count(&e.text) == 9 && "incorrect amount of lines");
     assert(e.cy == 5 && "incorrect mouse placement");
     assert(e.cx == 10 && "incorrect mouse placement");
+    editor_free(&e);
+}
+
+void test_editor_insert_newline(void)
+{
+    PieceTable text;
+    text_fill(&text);
+
+    Editor e = {
+        .cx = 4,
+        .cy = 2,
+        .text = text,
+        .mode = INSERT,
+    };
+
+    editor_insert(&e, "\n", 1);
+
+    assert(pt_line_count(&e.text) == 11 && "incorrect amount of lines");
+    assert(e.cy == 3 && e.cx == 0 && "incorrect mouse placement");
+    assert(editor_line_length(&e, 3) == 6 && "incorrect line length");
+    editor_free(&e);
+}
+
+void test_editor_goto_line(void)
+{
+    PieceTable text;
+    text_fill(&text);
+
+    Editor e = {
+        .cx = 5,
+        .cx_mem = 5,
+        .text = text,
+        .mode = NORMAL,
+    };
+
+    editor_goto_line(&e, 7);
+    assert(e.cy == 7 && e.cx == 5 && "incorrect mouse placement");
+
+    editor_goto_line(&e, 100);
+    assert(e.cy == 9 && "goto past the end should clamp to the last line");
+    editor_free(&e);
+}
+
+// Feeds `keys` to the editor one at a time
+void type(Editor *e, const char *keys)
+{
+    for (; *keys; ++keys) {
+        Key key = { .code = (unsigned char) *keys };
+        editor_handle_key(e, &key, NULL);
+    }
+}
+
+// Full contents of the editor, valid until the next call
+char *text_contents(Editor *e)
+{
+    static Line contents = {0};
+    size_t size = pt_size(&e->text);
+    line_reserve(&contents, size + 1);
+    pt_read(&e->text, 0, contents.data, size);
+    contents.data[size] = '\0';
+    return contents.data;
+}
+
+void test_editor_utf8(void)
+{
+    const char *lines = "\xe4\xb8\xad\xe6\x96\x87" "ab\n\tx\ne\xcc\x81z\n";
+    PieceTable text;
+    pt_init(&text);
+    pt_insert(&text, 0, lines, strlen(lines));
+    Editor e = { .text = text, .mode = NORMAL };
+
+    type(&e, "ll");
+    assert(e.cx == 6 && editor_cell(&e, 0, e.cx).cell == 4 && "moving right should step over whole chars");
+    type(&e, "j");
+    assert(e.cy == 1 && e.cx == 1 && "moving down should keep to the display column");
+    type(&e, "kh");
+    assert(e.cy == 0 && e.cx == 3 && "moving left should step over whole chars");
+    type(&e, "x");
+    assert(editor_line_length(&e, 0) == 5 && "x should delete the whole char");
+    type(&e, "j");
+    assert(e.cy == 1 && e.cx == 0 && "a display column inside a tab is the tab");
+    type(&e, "j");
+    assert(e.cy == 2 && e.cx == 3 && "cursor should stop at the last char");
+    type(&e, "hl");
+    assert(e.cx == 3 && "combining marks should go along with their char");
+
+    e.cy = e.cx = 0;
+    type(&e, "i");
+    Key key = { .code = KEY_CHAR, .text = "\xc3\xa9", .len = 2 };
+    editor_handle_key(&e, &key, NULL);
+    assert(e.cx == 2 && memcmp(text_contents(&e), "\xc3\xa9\xe4\xb8\xad", 5) == 0 && "typed char should be inserted");
+    type(&e, "\x7f");
+    assert(e.cx == 0 && memcmp(text_contents(&e), "\xe4\xb8\xad" "ab", 5) == 0 && "backspace should remove the whole char");
+    type(&e, "\033a\t");
+    assert(memcmp(text_contents(&e), "\xe4\xb8\xad  ab", 7) == 0 && "tab should fill up to the next tab stop");
+
+    editor_free(&e);
+}
+
+void test_editor_undo(void)
+{
+    PieceTable text;
+    text_fill(&text);
+    Editor e = { .text = text, .mode = NORMAL };
+    char *original = strdup(text_contents(&e));
+
+    type(&e, "ixy\nz\033x");
+    char *edited = strdup(text_contents(&e));
+    assert(strncmp(edited, "xy\nabcdefghij\nabcdefghij\n", 25) == 0 && "incorrect edit");
+
+    type(&e, "u");
+    assert(strncmp(text_contents(&e), "xy\nzabcdefghij\nabcdefghij\n", 26) == 0 && "x should be undone on its own");
+    type(&e, "u");
+    assert(strcmp(text_contents(&e), original) == 0 && "the insert session should be undone at once");
+    assert(e.cy == 0 && e.cx == 0 && "cursor should be on the undone change");
+    type(&e, "u");
+    assert(strcmp(e.message, "Already at oldest change") == 0 && "nothing should be left to undo");
+
+    type(&e, "2\x12");
+    assert(strcmp(text_contents(&e), edited) == 0 && "redo should apply both groups");
+
+    // A new edit drops what could be redone
+    type(&e, "uuix\033\x12");
+    assert(text_contents(&e)[0] == 'x' && text_contents(&e)[1] == 'a' && "redo should be gone");
+
+    free(original);
+    free(edited);
+    editor_free(&e);
+}
+
+void test_editor_undo_spill(void)
+{
+    for (int drop = 0; drop < 2; ++drop) {
+        PieceTable text;
+        text_fill(&text);
+        Editor e = { .text = text, .mode = NORMAL };
+        e.journal.cap = 256;
+        e.journal.drop_oldest = drop;
+        char *original = strdup(text_contents(&e));
+
+        for (size_t i = 0; i < 50; ++i)
+            type(&e, i % 2 ? "jx" : "Aab\bc\033");
+        char *edited = strdup(text_contents(&e));
+        assert(e.journal.mem.count <= 256 && "journal should stay under its cap");
+
+        while (editor_undo(&e));
+        if (drop) {
+            assert(e.journal.floor > 0 && "the oldest groups should be dropped");
+            assert(strcmp(text_contents(&e), original) != 0 && "dropped groups can't be undone");
+        } else {
+            assert(e.journal.has_file && "the oldest groups should be spilled");
+            assert(strcmp(text_contents(&e), original) == 0 && "every group should be undone");
+        }
+
+        while (editor_redo(&e));
+        assert(strcmp(text_contents(&e), edited) == 0 && "every group should be redone");
+
+        free(original);
+        free(edited);
+        editor_free(&e);
+    }
+}
+
+// Waits for the search worker to get through the whole document
+void search_finish(Search *s)
+{
+    while (search_busy(s))
+        usleep(1000);
+}
+
+void test_editor_search(void)
+{
+    PieceTable text;
+    text_fill(&text);
+    Editor e = { .text = text, .mode = NORMAL };
+
+    // The second match spans an original piece and an inserted one
+    type(&e, "5Gaxy\033gg");
+    type(&e, "/cd\n");
+    assert(e.cy == 0 && e.cx == 2 && "should jump to the next match");
+    type(&e, "/axyb\n");
+    assert(e.cy == 4 && e.cx == 0 && "should find a match across pieces");
+    type(&e, "n");
+    assert(e.cy == 4 && e.cx == 0 && strncmp(e.message, "search hit BOTTOM", 17) == 0 && "should wrap around");
+
+    type(&e, "?ij\n");
+    assert(e.cy == 3 && e.cx == 8 && "should search backwards");
+    type(&e, "2N");
+    assert(e.cy == 5 && e.cx == 8 && "N should search forwards");
+    type(&e, "/zz\n");
+    assert(strcmp(e.message, "Pattern not found: zz") == 0 && "nothing should be found");
+    editor_free(&e);
+
+    // Large enough for the worker to go through several chunks
+    char *path = text_file(200000);
+    Editor big = {0};
+    editor_read_from_file(&big, path);
+    big.mode = NORMAL;
+    type(&big, "/line 1\n");
+    search_finish(&big.search);
+    size_t count = 0;
+    for (size_t k = 0; k < big.search.chunk_count; ++k)
+        count += big.search.chunks[k].matches.count;
+    assert(big.search.chunk_count > 2 && "search should be split in chunks");
+    assert(count == 111111 && "incorrect amount of matches");
+
+    size_t match;
+    assert(search_find(&big.search, 0, 0, &match) == 1 && "should wrap backwards");
+    assert(match == pt_line_start(&big.text, 199999) && "should find the last match");
+    editor_free(&big);
+    unlink(path);
+}
+
+// Every match of the search, in document order
+void search_collect(Search *s, Matches *out)
+{
+    out->count = 0;
+    for (size_t k = 0; k < s->chunk_count; ++k)
+        for (size_t j = 0; j < s->chunks[k].matches.count; ++j)
+            matches_push(out, s->chunks[k].matches.data[j].pos, s->chunks[k].matches.data[j].len);
+}
+
+void test_editor_search_edits(void)
+{
+    char *path = text_file(200000);
+    const char *patterns[] = { "/line 1\n", "/ne 1[0-9]+$\n" };
+    for (size_t i = 0; i < 2; ++i) {
+        Editor e = {0};
+        editor_read_from_file(&e, path);
+        e.mode = NORMAL;
+        type(&e, patterns[i]);
+        search_finish(&e.search);
+        editor_search_poll(&e);
+
+        // Edits only note where they were, nothing is searched again yet
+        size_t start = pt_line_start(&e.text, 150000);
+        editor_text_insert(&e, start, "line 1x\nline 2\n", 16);
+        editor_text_delete(&e, start + 20, 12);
+        editor_text_insert(&e, start + 3, "1", 1);
+        journal_group(&e.journal);
+        editor_undo(&e);
+        editor_search_poll(&e);
+        assert(!e.search.running && e.search.edited && "an edit should not start the search over");
+
+        type(&e, "n");
+        Matches found = {0}, expected = {0};
+        search_collect(&e.search, &found);
+        assert(!e.search.running && e.search.copy == NULL && "only the edited lines should be searched");
+        search_start(&e.search, &e.text, 0);
+        search_finish(&e.search);
+        search_collect(&e.search, &expected);
+        assert(found.count == expected.count && memcmp(found.data, expected.data, sizeof(Match) * found.count) == 0
+               && "matches should be those of a full search");
+
+        matches_free(&found);
+        matches_free(&expected);
+        editor_free(&e);
+    }
+    unlink(path);
+}
+
+void test_editor_follow_search(void)
+{
+    char *path = text_file(1000);
+    Editor e = { .mode = NORMAL };
+    editor_read_from_file(&e, path);
+    type(&e, "/ERROR\n");
+    search_finish(&e.search);
+    editor_search_poll(&e);
+    assert(strstr(e.message, "not found") && "nothing should match yet");
+
+    // What the file takes in is searched like an insert at its end
+    editor_command(&e, "set follow", 10);
+    e.cy = 0;
+    append_file(path, "ERROR here\nline 1001\n");
+    editor_follow_poll(&e);
+    assert(e.search.edited && !e.search.running && "growing should not start the search over");
+    type(&e, "n");
+    assert(e.cy == 1000 && e.cx == 0 && "n should find the new text");
+    assert(e.search.copy == NULL && "only the new lines should be searched");
+
+    editor_free(&e);
+    unlink(path);
+}
+
+void test_editor_search_regex(void)
+{
+    PieceTable text;
+    text_fill(&text);
+    Editor e = { .text = text, .mode = NORMAL };
+
+    type(&e, "/c.e\n");
+    assert(e.cy == 0 && e.cx == 2 && "should jump to the regex match");
+    type(&e, "/[ij]+$\n");
+    assert(e.cy == 0 && e.cx == 8 && "should match at the end of the line");
+    type(&e, "/(\n");
+    assert(strcmp(e.message, "Invalid pattern: missing )") == 0 && "should report the error");
+    type(&e, "n");
+    assert(e.cy == 1 && e.cx == 8 && "the previous pattern should be kept");
+    type(&e, "/^d\n");
+    assert(strcmp(e.message, "Pattern not found: ^d") == 0 && "nothing should be found");
+    editor_free(&e);
+
+    // One line runs through several chunks, its matches belong to the
+    // chunk it begins in
+    size_t size = 3 * SEARCH_CHUNK;
+    char *data = malloc(size);
+    memset(data, 'a', size);
+    memcpy(data, "x\n", 2);
+    memcpy(data + 5 * SEARCH_CHUNK / 2, "QQ", 2);
+    memcpy(data + size - 6, "\nQQ b\n", 6);
+    Search s = {0};
+    pt_init(&text);
+    pt_load(&text, data, size, 0);
+    assert(search_compile(&s, "Q+", 2) == NULL);
+    search_start(&s, &text, 0);
+    search_finish(&s);
+
+    size_t match;
+    assert(s.chunks[1].reach == SIZE_MAX && "the middle chunk has no line of its own");
+    assert(search_find(&s, 3 * SEARCH_CHUNK / 2, 1, &match) == 1 && match == 5 * SEARCH_CHUNK / 2 &&
+            "should find the match further on the line");
+    assert(search_find(&s, size - 10, 0, &match) == 1 && match == 5 * SEARCH_CHUNK / 2 &&
+            "should find the match earlier on the line");
+    assert(search_find(&s, 5 * SEARCH_CHUNK / 2, 1, &match) == 1 && match == size - 5 &&
+            "should find the match on the next line");
+
+    search_clear(&s);
+    regex_free(&s.regex);
+    regex_free(&s.painter);
+    line_free(&s.pattern);
+    pt_free(&text);
+}
+
+void test_editor_substitute(void)
+{
+    PieceTable text;
+    text_fill(&text);
+    Editor e = { .text = text, .mode = NORMAL };
+    char *original = strdup(text_contents(&e));
+
+    type(&e, ":%s/c.e/X/\n");
+    assert(strcmp(e.message, "10 substitutions on 10 lines") == 0 && "every line should be changed");
+    assert(strncmp(text_contents(&e), "abXfghij\nabXfghij\n", 18) == 0 && "incorrect substitution");
+    assert(e.cy == 9 && e.cx == 0 && "cursor should be on the last changed line");
+    type(&e, "u");
+    assert(strcmp(text_contents(&e), original) == 0 && "substitute should be undone at once");
+
+    type(&e, ":2,3s/[aeiou]/_/g\n");
+    assert(strcmp(e.message, "6 substitutions on 2 lines") == 0 && "only the range should be changed");
+    type(&e, ":s/^/# /\n");
+    type(&e, ":$s/j$/&\\n/\n");
+    assert(strncmp(text_contents(&e), "abcdefghij\n_bcd_fgh_j\n# _bcd_fgh_j\nabcdefghij\n", 44) == 0 &&
+            "incorrect substitution");
+    assert(pt_line_count(&e.text) == 11 && "the replacement should add a line");
+
+    type(&e, ":%s/zz/y/\n");
+    assert(strcmp(e.message, "Pattern not found: zz") == 0 && "nothing should be replaced");
+    type(&e, ":%s/(/x/\n");
+    assert(strcmp(e.message, "Invalid pattern: missing )") == 0 && "should report the error");
+    type(&e, ":foo\n");
+    assert(strcmp(e.message, "Not an editor command: foo") == 0 && "should report the command");
+    type(&e, ":5\n");
+    assert(e.cy == 4 && "a line number should move the cursor");
+    type(&e, "0iaaaa\033:s/aa/b/g\n");
+    assert(strncmp(text_contents(&e) + 46, "bbabcdefghij\n", 13) == 0 && "literal matches shouldn't overlap");
+    editor_free(&e);
+    free(original);
+
+    // Spread over several blocks and threads
+    char *path = text_file(200000);
+    Editor big = { .mode = NORMAL };
+    editor_read_from_file(&big, path);
+    original = strdup(text_contents(&big));
+    type(&big, ":%s/ine /_/g\n");
+    assert(strcmp(big.message, "200000 substitutions on 200000 lines") == 0 && "every line should be changed");
+    Line line = {0};
+    pt_line(&big.text, 123456, &line);
+    assert(line.count == 8 && memcmp(line.data, "l_123456", 8) == 0 && "incorrect substitution");
+    type(&big, "u");
+    assert(strcmp(text_contents(&big), original) == 0 && "substitute should be undone at once");
+    line_free(&line);
+    free(original);
+    editor_free(&big);
+    unlink(path);
+}
+
+// Renders a frame of `e` and returns how many bytes were sent to the terminal
+size_t render_bytes(Editor *e, Viewport *v)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buf, &size);
+    viewport_update(v, e);
+    render(out, e, v, ' ');
+    fclose(out);
+    free(buf);
+    return size;
+}
+
+void test_render_status_key(void)
+{
+    PieceTable text;
+    text_fill(&text);
+    Editor e = { .width = 120, .height = 24, .text = text, .mode = NORMAL };
+    Viewport v = {0};
+
+    char *frame = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&frame, &size);
+    editor_frame(&e, &v, out, KEY_UP);
+    fclose(out);
+    char expected[16];
+    snprintf(expected, sizeof(expected), "| %d |", KEY_UP);
+    assert(memmem(frame, size, expected, strlen(expected)) && "the status line should show the decoded key");
+
+    free(frame);
+    editor_free(&e);
+    viewport_free(&v);
+}
+
+void test_render_search_matches(void)
+{
+    PieceTable text;
+    text_fill(&text);
+    Editor e = { .width = 80, .height = 24, .text = text, .mode = NORMAL };
+    Viewport v = {0};
+
+    type(&e, "/def\n");
+    render_bytes(&e, &v);
+    Cell *row = &v.screen.front[2 * v.screen.width + v.sidebar];
+    assert(row[2].style == STYLE_TEXT && row[3].style == STYLE_MATCH && row[5].style == STYLE_MATCH &&
+            row[6].style == STYLE_TEXT && "matches should be highlighted");
+
+    // Lines the worker hasn't got to are searched while drawing
+    type(&e, "/c[de]+\n");
+    search_finish(&e.search);
+    e.search.chunks[0].done = 0;
+    render_bytes(&e, &v);
+    assert(row[1].style == STYLE_TEXT && row[2].style == STYLE_MATCH && row[4].style == STYLE_MATCH &&
+            row[5].style == STYLE_TEXT && "unscanned lines should be highlighted");
+    e.search.chunks[0].done = 1;
+
+    // Matches of an older version of the text aren't used, the visible
+    // lines are searched while drawing until the next jump
+    type(&e, "x");
+    e.search.version = 0;
+    e.search.chunks[0].matches.count = 0;
+    render_bytes(&e, &v);
+    assert(row[1].style == STYLE_TEXT && row[2].style == STYLE_MATCH && row[4].style == STYLE_MATCH &&
+            "lines should be searched while the matches are stale");
+
+    editor_free(&e);
+    viewport_free(&v);
+}
+
+void test_render_damage(void)
+{
+    PieceTable text;
+    text_fill(&text);
+
+    Editor e = {
+        .cx = 3,
+        .cy = 4,
+        .width = 80,
+        .height = 24,
+        .text = text,
+        .mode = INSERT,
+    };
+    Viewport v = {0};
+
+    size_t full = render_bytes(&e, &v);
+    size_t none = render_bytes(&e, &v);
+    editor_insert(&e, "x", 1);
+    size_t one = render_bytes(&e, &v);
+
+    Cell *row = &v.screen.front[4 * v.screen.width + v.sidebar];
+    assert(row[3].ch[0] == 'x' && row[4].ch[0] == 'd' && "front buffer should hold the new frame");
+    assert(full > 24 * 10 && "first frame should draw the whole screen");
+    assert(none < 64 && "unchanged frame should only redraw the frame counters");
+    assert(one < 128 && "a typed char should only redraw the changed spans");
+
+    editor_free(&e);
+    viewport_free(&v);
+}
+
+// UTF-8 of a code point from the Basic Multilingual Plane past U+07FF
+void utf8_encode3(uint32_t cp, char *out)
+{
+    out[0] = 0xe0 | cp >> 12;
+    out[1] = 0x80 | (cp >> 6 & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+}
+
+void test_utf8_width(void)
+{
+    uint32_t cp;
+    assert(utf8_decode("a", 1, &cp) == 1 && cp == 'a' && "ASCII should decode");
+    assert(utf8_decode("\xc3\xa9", 2, &cp) == 2 && cp == 0xe9 && "two byte char should decode");
+    assert(utf8_decode("\xe4\xb8\xad", 3, &cp) == 3 && cp == 0x4e2d && "three byte char should decode");
+    assert(utf8_decode("\xf0\x9f\x98\x80", 4, &cp) == 4 && cp == 0x1f600 && "four byte char should decode");
+    assert(utf8_decode("\xc0\x80", 2, &cp) == 1 && cp == UTF8_INVALID && "overlong form should be invalid");
+    assert(utf8_decode("\xed\xa0\x80", 3, &cp) == 1 && cp == UTF8_INVALID && "surrogate should be invalid");
+    assert(utf8_decode("\xe4\xb8", 2, &cp) == 1 && cp == UTF8_INVALID && "cut off char should be invalid");
+    assert(utf8_decode("\x80", 1, &cp) == 1 && cp == UTF8_INVALID && "stray continuation byte should be invalid");
+
+    assert(char_width('a') == 1 && char_width(0xe9) == 1 && "latin chars should be one column");
+    assert(char_width(0x301) == 0 && char_width(0x200b) == 0 && "combining marks should take no column");
+    assert(char_width(0x4e2d) == 2 && char_width(0xac00) == 2 && char_width(0x1f600) == 2 &&
+            "wide chars should be two columns");
+
+    const char *line = "a\t\xe4\xb8\xad" "e\xcc\x81\tz";
+    size_t n = strlen(line), i = 0;
+    assert(cell_walk(line, n, n, &i, 0, SIZE_MAX, SIZE_MAX) == 9 && i == n && "incorrect display width");
+    i = 0;
+    assert(cell_walk(line, n, n, &i, 0, SIZE_MAX, 5) == 4 && i == 2 && "column inside a wide char is the char");
+    i = 0;
+    assert(cell_walk(line, n, n, &i, 0, 3, SIZE_MAX) == 4 && i == 2 && "byte inside a char is the char");
+    i = 0;
+    assert(cell_walk(line, n, n, &i, 0, SIZE_MAX, 7) == 7 && i == 8 && "combining mark is part of its char");
+}
+
+void test_render_utf8(void)
+{
+    const char *first = "a\t\xe4\xb8\xad\xc3\xa9" "e\xcc\x81" "x\xffz\n";
+    Line lines = {0};
+    line_append_str(&lines, first, strlen(first));
+    for (size_t k = 0; k < 100; ++k) {
+        char ch[3];
+        utf8_encode3(0x4e00 + k, ch);
+        line_append_str(&lines, ch, 3);
+    }
+    line_append(&lines, '\n');
+
+    PieceTable text;
+    pt_init(&text);
+    pt_insert(&text, 0, lines.data, lines.count);
+    Editor e = { .width = 40, .height = 6, .text = text, .mode = NORMAL };
+    Viewport v = {0};
+
+    char *frame = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&frame, &size);
+    viewport_update(&v, &e);
+    render(out, &e, &v, ' ');
+    fflush(out);
+
+    Cell *row = &v.screen.back[v.sidebar];
+    const char *cells[] = { "a", " ", " ", " ", "\xe4\xb8\xad", "\xff", "\xc3\xa9", "e\xcc\x81", "x", "?", "z", " " };
+    for (size_t x = 0; x < sizeof(cells) / sizeof(cells[0]); ++x)
+        assert(strncmp(row[x].ch, cells[x], CELL_BYTES) == 0 && "incorrect cell");
+    assert(memmem(frame, size, "\xe4\xb8\xad\xc3\xa9", 5) && "the right half of a wide char should not be sent");
+
+    // Scrolled so far right that a wide char is cut by the left edge
+    e.cy = 1;
+    e.cx = 3 * 60;
+    viewport_update(&v, &e);
+    assert(v.cell == 120 && v.left == 120 + 2 - v.width && "cursor should be in view");
+    row = &v.screen.back[v.screen.width + v.sidebar];
+    char head[3];
+    utf8_encode3(0x4e00 + (v.left + 1) / 2, head);
+    assert(row[0].ch[0] == ' ' && "half a wide char should be blank");
+    assert(memcmp(row[1].ch, head, 3) == 0 && row[2].ch[0] == CELL_WIDE && "incorrect wide char");
+    assert(row[v.width - 1].ch[0] == CELL_WIDE && "cursor char should fit at the right edge");
+
+    fclose(out);
+    free(frame);
+    line_free(&lines);
+    editor_free(&e);
+    viewport_free(&v);
+}
+
+void test_cell_map(void)
+{
+    const char *chars[] = { "a", "b", " ", "\t", "\xe4\xb8\xad", "\xc3\xa9", "e\xcc\x81", "\xff", "\xf0\x9f\x98\x80" };
+    size_t count = sizeof(chars) / sizeof(chars[0]);
+    PieceTable pt;
+    pt_init(&pt);
+    srand(13);
+    while (pt_size(&pt) < 5 * CELL_STRIDE) {
+        const char *ch = chars[rand() % count];
+        pt_insert(&pt, pt_size(&pt), ch, strlen(ch));
+    }
+    pt_insert(&pt, pt_size(&pt), "\nnext\n", 6);
+
+    Line line = {0};
+    for (size_t round = 0; round < 200; ++round) {
+        if (round > 0) {
+            size_t len = pt_line_length(&pt, 0);
+            size_t pos = rand() % len;
+            if (rand() % 2) {
+                pt_delete(&pt, pos, MIN((size_t) rand() % 6 + 1, len - pos));
+            } else {
+                const char *ch = chars[rand() % count];
+                pt_insert(&pt, pos, ch, strlen(ch));
+            }
+        }
+
+        pt_line(&pt, 0, &line);
+        for (size_t k = 0; k < 8; ++k) {
+            size_t col = rand() % (line.count + 1), i = 0;
+            size_t cell = cell_walk(line.data, line.count, line.count, &i, 0, col, SIZE_MAX);
+            CellPoint p = cells_seek(&pt, 0, 0, line.count, col, SIZE_MAX);
+            assert(p.col == i && p.cell == cell && "incorrect display column of a byte");
+
+            size_t to = rand() % (cell + 8);
+            i = 0;
+            cell = cell_walk(line.data, line.count, line.count, &i, 0, SIZE_MAX, to);
+            p = cells_seek(&pt, 0, 0, line.count, SIZE_MAX, to);
+            assert(p.col == i && p.cell == cell && "incorrect byte of a display column");
+        }
+    }
+    assert(cells_get(&pt, 0)->count > 1 && "points should be kept along the line");
+
+    pt_insert(&pt, 10, "\n", 1);
+    assert(cells_get(&pt, 0)->count == 1 && "a split line should be walked afresh");
+
+    line_free(&line);
+    pt_free(&pt);
+}
+
+// Rows every line takes at `width`, walked from scratch
+size_t wrap_rows_walked(PieceTable *pt, size_t width, size_t *rows, Line *line)
+{
+    size_t total = 0, count = pt_line_count(pt);
+    for (size_t row = 0; row < count; ++row) {
+        pt_line(pt, row, line);
+        WrapPoint at = {0};
+        size_t i = 0;
+        wrap_walk(&at, line->data, line->count, line->count, &i, width, SIZE_MAX);
+        rows[row] = wrap_rows(&at, width);
+        total += rows[row];
+    }
+    return total;
+}
+
+void test_wrap_index(void)
+{
+    const char *chars[] = { "a", "b", " ", "\t", "\n", "\xe4\xb8\xad", "e\xcc\x81" };
+    size_t count = sizeof(chars) / sizeof(chars[0]);
+    PieceTable pt;
+    pt_init(&pt);
+    srand(17);
+    while (pt_size(&pt) < 4000) {
+        const char *ch = chars[rand() % count];
+        size_t n = rand() % 40 + 1;
+        for (size_t k = 0; k < n; ++k)
+            pt_insert(&pt, pt_size(&pt), ch, strlen(ch));
+    }
+
+    Line line = {0};
+    size_t *rows = NULL;
+    for (size_t round = 0; round < 300; ++round) {
+        size_t size = pt_size(&pt);
+        size_t pos = rand() % size;
+        if (rand() % 2) {
+            pt_delete(&pt, pos, MIN((size_t) rand() % 12 + 1, size - pos));
+        } else {
+            const char *ch = chars[rand() % count];
+            pt_insert(&pt, pos, ch, strlen(ch));
+        }
+        if (round % 3)
+            continue;
+
+        size_t width = round % 30 < 15 ? 7 : 12;
+        rows = realloc(rows, sizeof(size_t) * pt_line_count(&pt));
+        size_t total = wrap_rows_walked(&pt, width, rows, &line);
+        // A look far down measures every line
+        size_t row = rand() % pt_line_count(&pt), skip;
+        size_t before = wrap_row(&pt, width, row);
+        for (size_t k = 0; k < row; ++k)
+            before -= rows[k];
+        assert(before == 0 && "incorrect screen row of a line");
+        assert(wrap_info(&pt, width, row).rows == rows[row] && "incorrect rows of a line");
+
+        size_t r = rand() % (total + 2), k = 0;
+        size_t found = wrap_line(&pt, width, r, &skip);
+        if (r >= total)
+            r = total - 1;
+        while (r >= rows[k])
+            r -= rows[k++];
+        assert(found == k && skip == r && "incorrect line at a screen row");
+    }
+    assert(pt.wrap.gap < wrap_count(&pt.wrap) && "edits should have moved the gap off the end");
+
+    wrap_truncate(&pt.wrap, 5);
+    assert(wrap_count(&pt.wrap) == 5 && "lines past the truncation should be forgotten");
+    assert(wrap_row(&pt, 12, 9) == rows[5] + rows[6] + rows[7] + rows[8] + wrap_row(&pt, 12, 5) && "lines should be measured again");
+
+    free(rows);
+    line_free(&line);
+    pt_free(&pt);
+}
+
+void test_render_wrap(void)
+{
+    PieceTable text;
+    pt_init(&text);
+    const char *content = "first\n0123456789abcdefghij012345678\xe4\xb8\xad" "56789\nlast\n";
+    pt_insert(&text, 0, content, strlen(content));
+    // 10 columns of text beside the line numbers
+    Editor e = { .width = 10 + SIDEBAR_SZ, .height = 6 + STATUS_SZ, .text = text, .mode = NORMAL };
+    Viewport v = {0};
+    editor_command(&e, "set wrap", 8);
+    assert(e.wrap && "wrap should be set");
+
+    e.cy = 1;
+    e.cx = 32;
+    viewport_update(&v, &e);
+    Screen *s = &v.screen;
+    Cell *row = &s->back[2 * s->width];
+    assert(row[0].ch[0] == ' ' && row[SIDEBAR_SZ].ch[0] == 'a' && "a wrapped row should go on without a number");
+    // The wide char doesn't fit the last column, it starts the next row
+    row = &s->back[3 * s->width + SIDEBAR_SZ];
+    assert(row[-1].ch[0] == ' ' && row[0].ch[0] == '0' && row[8].ch[0] == '8' && row[9].ch[0] == ' ' && "wide char should not be cut");
+    row = &s->back[4 * s->width + SIDEBAR_SZ];
+    assert(row[0].ch[0] == '\xe4' && row[1].ch[0] == CELL_WIDE && row[2].ch[0] == '5' && "wide char should start a row");
+    assert(v.cursor_x == 2 && v.cursor_y == 4 && "cursor should be on its wrapped row");
+    assert(((size_t *) v.numbers.data)[5] == 2 && "line after should follow its rows");
+
+    // Scrolled by screen rows down into the wrapped line
+    e.cy = 2;
+    e.cx = 0;
+    e.height = 2 + STATUS_SZ;
+    viewport_update(&v, &e);
+    assert(v.top == 1 && v.skip == 3 && v.cursor_y == 1 && "viewport should follow the cursor by rows");
+
+    editor_command(&e, "set nowrap", 10);
+    assert(!e.wrap && e.text.wrap.capacity == 0 && "the index should go with wrapping");
+    viewport_update(&v, &e);
+    assert(v.skip == 0 && v.top_row == v.top && v.cursor_y == e.cy - v.top && "lines should not wrap");
+
+    editor_free(&e);
+    viewport_free(&v);
+}
+
+void test_render_scroll(void)
+{
+    char *path = text_file(1000);
+    Editor e = {
+        .width = 80,
+        .height = 24,
+    };
+    editor_read_from_file(&e, path);
+    Viewport v = {0};
+
+    render_bytes(&e, &v);
+    e.cy = 30;
+    size_t jump = render_bytes(&e, &v);
+    e.cy = 31;
+    size_t step = render_bytes(&e, &v);
+
+    assert(v.top == 10 && "viewport should follow the cursor");
+    assert(step < 400 && "scrolling a line should only draw the new row");
+    assert(jump > 22 * 10 && "jumping should redraw the screen");
+
+    Cell *last = &v.screen.front[21 * v.screen.width + v.sidebar];
+    assert(last[0].ch[0] == 'l' && last[5].ch[0] == '3' && last[6].ch[0] == '1' && "front buffer should hold the new row");
+
+    editor_free(&e);
+    viewport_free(&v);
+    unlink(path);
+}
+
+void test_render_thread(void)
+{
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buf, &size);
+    Renderer r = {0};
+    assert(renderer_start(&r, out, 1) && "render thread should start");
+
+    // Frames come faster than the cap allows, only the newest is kept
+    Screen s = {0};
+    screen_resize(&s, 8, 4);
+    for (char ch = 'a'; ch <= 'e'; ++ch) {
+        for (size_t y = 0; y < 4; ++y)
+            screen_fill(&s, 0, y, 8, ch, STYLE_TEXT);
+        renderer_submit(&r, &s, 1, 2);
+        // The first frame goes out right away
+        for (size_t drawn = 0; ch == 'a' && drawn == 0; usleep(1000)) {
+            pthread_mutex_lock(&r.lock);
+            drawn = r.drawn;
+            pthread_mutex_unlock(&r.lock);
+        }
+    }
+    assert(s.clear == 0 && "the clear should move to the render thread");
+
+    // Scrolls of dropped frames add up
+    screen_scroll(&s, 0, 4, 1);
+    renderer_submit(&r, &s, 1, 2);
+    screen_scroll(&s, 0, 4, 1);
+    renderer_submit(&r, &s, 1, 2);
+    pthread_mutex_lock(&r.lock);
+    int scroll = r.scroll;
+    pthread_mutex_unlock(&r.lock);
+    assert(scroll == 2 && "pending scrolls should combine");
+
+    renderer_stop(&r);
+    fclose(out);
+    assert(r.drawn == 2 && r.dropped == 5 && "frames within the frame time should be dropped");
+    assert(memcmp(buf + size - 6, "\033[3;2H", 6) == 0 && "last frame should end at the cursor");
+    assert(strchr(buf, 'e') && !strchr(buf, 'c') && "the newest frame should be drawn");
+    char *region = strstr(buf, "\033[1;4r");
+    assert(region && memcmp(strstr(region, INDEX), INDEX INDEX, 4) == 0 && "the combined scroll should be sent");
+
+    screen_free(&s);
+    free(buf);
+}
+
+void test_render_single_write(void)
+{
+    PieceTable text;
+    text_fill(&text);
+
+    Editor e = {
+        .width = 80,
+        .height = 24,
+        .text = text,
+    };
+    Viewport v = {0};
+    viewport_update(&v, &e);
+    v.screen.sync = 1;
+
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buf, &size);
+    render(out, &e, &v, ' ');
+    fclose(out);
+
+    assert(size == v.screen.frame_bytes && "frame bytes should match what was written");
+    assert(v.screen.frame_syscalls == 1 && "frame should be written at once");
+    assert(memcmp(buf, SYNC_BEGIN, strlen(SYNC_BEGIN)) == 0 && "frame should start synchronized output");
+    assert(memcmp(buf + size - strlen(SYNC_END), SYNC_END, strlen(SYNC_END)) == 0 && "frame should end synchronized output");
+
+    free(buf);
+    editor_free(&e);
+    viewport_free(&v);
 }
 
-void test_match_keyword_matches(void) 
+// Input reading from a pipe that already holds `bytes`
+Input input_pipe(const char *bytes)
 {
-    int matches = match_keyword("for", "for", 3);
-    assert(matches == 3 && "Words don't match");
+    int fds[2];
+    assert(pipe(fds) == 0 && "unable to create pipe");
+    assert(write(fds[1], bytes, strlen(bytes)) == (ssize_t) strlen(bytes) && "unable to write to pipe");
+    close(fds[1]);
+
+    Input in = { .fd = fds[0] };
+    return in;
 }
 
-void test_match_keyword_no_matches(void) 
+void test_input_keys(void)
 {
-    int matches = match_keyword("for", "while", 5);
-    assert(matches == 0 && "Words shouldn't match");
+    Input in = input_pipe("j\033[A\033OD\033[?2026;2$yx\033");
+    Key key;
+    int expected[] = { 'j', KEY_UP, KEY_LEFT, KEY_IGNORED, 'x', ESCAPE };
+
+    assert(input_read(&in, -1) && "input should be read");
+    for (size_t i = 0; i < sizeof(expected) / sizeof(int); ++i) {
+        assert(input_next_key(&in, &key) && "key should be decoded");
+        assert(key.code == expected[i] && "incorrect key decoded");
+    }
+    assert(!input_next_key(&in, &key) && "input should be drained");
+
+    close(in.fd);
+    line_free(&in.paste);
 }
 
-void test_match_keyword_almost_matches(void) 
+void test_input_utf8(void)
 {
-    int matches = match_keyword("return", "returners", 9);
-    assert(matches == 0 && "Words shouldn't match");
+    // The last char never gets its second byte
+    Input in = input_pipe("\xe4\xb8\xadj\xff\xc3");
+    Key key;
+    assert(input_read(&in, -1) && "input should be read");
+    assert(input_next_key(&in, &key) && key.code == KEY_CHAR && "multibyte char should be one key");
+    assert(key.len == 3 && memcmp(key.text, "\xe4\xb8\xad", 3) == 0 && "incorrect char decoded");
+    assert(input_next_key(&in, &key) && key.code == 'j' && "keys after the char should follow");
+    assert(input_next_key(&in, &key) && key.code == KEY_IGNORED && "invalid byte should be ignored");
+    assert(input_next_key(&in, &key) && key.code == KEY_IGNORED && "cut off char should be ignored");
+    assert(!input_next_key(&in, &key) && "input should be drained");
+
+    close(in.fd);
+    line_free(&in.paste);
+}
+
+void test_input_paste(void)
+{
+    PieceTable text;
+    text_fill(&text);
+    Editor e = {
+        .cy = 1,
+        .text = text,
+        .mode = NORMAL,
+    };
+
+    Input in = input_pipe("\033[200~one\rtwo\033[201~j");
+    Key key;
+    assert(input_read(&in, -1) && "input should be read");
+    assert(input_next_key(&in, &key) && key.code == KEY_PASTE && "paste should be one key");
+    assert(in.paste.count == 7 && memcmp(in.paste.data, "one\ntwo", 7) == 0 && "incorrect paste contents");
+    editor_handle_key(&e, &key, &in);
+    assert(input_next_key(&in, &key) && key.code == 'j' && "keys after the paste should follow");
+
+    assert(pt_line_count(&e.text) == 11 && "incorrect amount of lines");
+    assert(e.cy == 2 && e.cx == 3 && "incorrect mouse placement");
+    assert(editor_line_length(&e, 2) == 13 && "incorrect line length");
+
+    close(in.fd);
+    line_free(&in.paste);
+    editor_free(&e);
+}
+
+void test_keyword_matches(void) 
+{
+    assert(keyword_match("for", 3) == 3 && "Words don't match");
+    assert(keyword_match("sizeof", 6) == 6 && "Words don't match");
+    assert(keyword_match("#include", 8) == 8 && "Words don't match");
+}
+
+void test_keyword_no_matches(void) 
+{
+    assert(keyword_match("while", 4) == 0 && "Words shouldn't match");
+    assert(keyword_match("sizeon", 6) == 0 && "Words shouldn't match");
+}
+
+void test_keyword_almost_matches(void) 
+{
+    assert(keyword_match("returners", 9) == 0 && "Words shouldn't match");
+}
+
+// Styles of the first `n` cells of row `y`: 'k' keyword, 'c' comment,
+// 's' string, 'p' preprocessor and '.' for plain text
+char *styles(Screen *s, size_t y, size_t n)
+{
+    static char buf[64];
+    for (size_t i = 0; i < n; ++i) {
+        switch (s->back[y * s->width + i].style) {
+        case STYLE_KEYWORD: buf[i] = 'k'; break;
+        case STYLE_COMMENT: buf[i] = 'c'; break;
+        case STYLE_STRING:  buf[i] = 's'; break;
+        case STYLE_PREPROC: buf[i] = 'p'; break;
+        default:            buf[i] = '.'; break;
+        }
+    }
+    buf[n] = '\0';
+    return buf;
 }
 
 void test_highlight(void) 
 {
+    Screen s = {0};
+    screen_resize(&s, 20, 2);
     Line line = {0};
-    line_append(&line, 'a');
-    line_append(&line, 'b');
-    line_append(&line, 'c');
-    line_append(&line, ' ');
-    line_append(&line, 'f');
-    line_append(&line, 'o');
-    line_append(&line, 'r');
-    line_append(&line, ' ');
-    line_append(&line, 'f');
-    line_append(&line, 'o');
+    line_append_str(&line, "abc for(fo xfor_if", 18);
+
+    highlight(&s, 0, 0, &line, 0, 20, LEX_CODE);
+    assert(strcmp(styles(&s, 0, 18), "....kkk...........") == 0 && "Should only highlight whole words");
+
+    // Scrolled into the middle of a keyword and cut off by the right edge
+    highlight(&s, 0, 1, &line, 5, 6, LEX_CODE);
+    assert(strcmp(styles(&s, 1, 1), "k") == 0 && "Should highlight a partly visible keyword");
+    line_free(&line);
 
-    int num_to_hl = highlight(&line, 4);
-    assert(num_to_hl == 3 && "Should highlight 3 chars");
+    line_append_str(&line, "return if", 9);
+    highlight(&s, 0, 0, &line, 3, 20, LEX_CODE);
+    assert(strcmp(styles(&s, 0, 6), "kkk.kk") == 0 && "Should highlight a scrolled keyword");
+    line_free(&line);
+    screen_free(&s);
+}
+
+void test_highlight_state(void)
+{
+    struct {
+        const char *text;
+        const char *styles;
+        LexState end;
+    } lines[] = {
+        { "x /* a",        "..cccc",      LEX_COMMENT },
+        { "b */ if",       "cccc.kk",     LEX_CODE },
+        { "s = \"a\\",    "....sss",     LEX_STRING },
+        { "b\" if 'c'",    "ss.kk.sss",   LEX_CODE },
+        { "#define X \\", "ppppppppppp",  LEX_PREPROC },
+        { "  1 // c",      "ppppcccc",    LEX_CODE },
+    };
+
+    Screen s = {0};
+    screen_resize(&s, 20, 1);
+    Line line = {0};
+    LexState state = LEX_CODE;
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); ++i) {
+        line.count = 0;
+        line_append_str(&line, lines[i].text, strlen(lines[i].text));
+        state = highlight(&s, 0, 0, &line, 0, 20, state);
+        assert(strcmp(styles(&s, 0, strlen(lines[i].styles)), lines[i].styles) == 0 && "incorrect styles");
+        assert(state == lines[i].end && "incorrect state at the end of the line");
+    }
+    line_free(&line);
+    screen_free(&s);
+}
+
+void test_syntax_cache_edit(void)
+{
+    PieceTable pt;
+    text_fill(&pt);
+    syntax_update(&pt, 9);
+    assert(pt.syntax.valid == 10 && "every line should be cached");
+
+    // A new line that leaves the state alone only relexes up to the next line
+    pt_insert(&pt, pt_line_start(&pt, 2), "x\n", 2);
+    assert(pt.syntax.valid == 3 && "lines below the edit should be invalidated");
+    syntax_update(&pt, 4);
+    assert(pt.syntax.valid == 11 && "states below the edit should be reused");
+
+    // Opening a comment changes every line below
+    pt_insert(&pt, pt_line_start(&pt, 5), "/*", 2);
+    syntax_update(&pt, 10);
+    assert(pt.syntax.states[4] == LEX_CODE && "lines above the edit shouldn't change");
+    assert(pt.syntax.states[10] == LEX_COMMENT && "lines below the edit should be in the comment");
+
+    pt_delete(&pt, pt_line_start(&pt, 1), pt_line_start(&pt, 7) - pt_line_start(&pt, 1));
+    syntax_update(&pt, 4);
+    assert(pt.syntax.valid == 5 && "incorrect amount of cached lines");
+    for (size_t row = 1; row < 5; ++row)
+        assert(pt.syntax.states[row] == LEX_CODE && "the comment should be gone");
+
+    pt_free(&pt);
+}
+
+// Draws the window of the long first line of `e` around column `col` and
+// compares it with lexing the whole line
+void assert_long_line(Editor *e, Viewport *v, size_t col)
+{
+    e->cx = col;
+    viewport_update(v, e);
+
+    Line full = {0};
+    pt_line(&e->text, 0, &full);
+    Screen ref = {0};
+    screen_resize(&ref, v->width, 1);
+    LexState end = highlight(&ref, 0, 0, &full, v->left, v->left + v->width, LEX_CODE);
+    size_t i = 0;
+    size_t width = cell_walk(full.data, full.count, full.count, &i, 0, SIZE_MAX, SIZE_MAX);
+    screen_fill(&ref, width > v->left ? width - v->left : 0, 0, v->width, ' ', STYLE_TEXT);
+
+    Cell *row = &v->screen.back[v->sidebar];
+    for (size_t x = 0; x < v->width; ++x)
+        assert(cell_equal(row[x], ref.back[x]) && "window should match lexing the whole line");
+    assert(column_end_state(&e->text, 0, LEX_CODE, 0, full.count) == end && "incorrect state at the end of the line");
+
+    line_free(&full);
+    screen_free(&ref);
+}
+
+void test_render_long_line(void)
+{
+    const char alphabet[] = "ab if  /**/\"'\\#\t\tx";
+    size_t len = 300000;
+    const char *tail = "\nint x; // tail\n";
+    char *data = malloc(len + strlen(tail));
+    srand(21);
+    for (size_t i = 0; i < len; ++i)
+        data[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+    memcpy(data + len, tail, strlen(tail));
+
+    PieceTable pt;
+    pt_init(&pt);
+    pt_load(&pt, data, len + strlen(tail), 0);
+    Editor e = { .width = 100, .height = 6, .text = pt, .mode = NORMAL };
+    Viewport v = {0};
+
+    size_t cols[] = { 0, 50, 4095, 4096, 70000, 131072, len - 1 };
+    for (size_t i = 0; i < sizeof(cols) / sizeof(cols[0]); ++i)
+        assert_long_line(&e, &v, cols[i]);
+
+    // Edits anywhere on the line, drawn around where they happened
+    const char *inserts[] = { "/*", "*/", "\"", "'", "\\", "#", " ", "if", "//" };
+    for (size_t i = 0; i < 300; ++i) {
+        size_t line_len = pt_line_length(&e.text, 0);
+        size_t pos = rand() % line_len;
+        if (rand() % 3 == 0) {
+            pt_delete(&e.text, pos, MIN((size_t) rand() % 4 + 1, line_len - pos));
+        } else {
+            const char *str = inserts[rand() % (sizeof(inserts) / sizeof(inserts[0]))];
+            pt_insert(&e.text, pos, str, strlen(str));
+        }
+        assert_long_line(&e, &v, rand() % 2 ? pos : rand() % pt_line_length(&e.text, 0));
+    }
+
+    // Following lines take the state the long line ends in
+    e.cx = 0;
+    viewport_update(&v, &e);
+    LexState state = column_end_state(&e.text, 0, LEX_CODE, 0, pt_line_length(&e.text, 0));
+    Line next = { .data = "int x; // tail", .count = 14 };
+    Screen ref = {0};
+    screen_resize(&ref, v.width, 1);
+    highlight(&ref, 0, 0, &next, 0, v.width, state);
+    for (size_t x = 0; x < next.count; ++x)
+        assert(cell_equal(v.screen.back[v.screen.width + v.sidebar + x], ref.back[x]) &&
+                "the next line should start in the end state of the long line");
+    screen_free(&ref);
+
+    editor_free(&e);
+    viewport_free(&v);
+}
+
+void test_column_reuse(void)
+{
+    size_t len = 300000;
+    char *data = malloc(len);
+    for (size_t i = 0; i < len; i += 2)
+        memcpy(data + i, "a ", 2);
+
+    PieceTable pt;
+    pt_init(&pt);
+    pt_load(&pt, data, len, 0);
+    column_end_state(&pt, 0, LEX_CODE, 0, len);
+    ColumnIndex *ci = column_get(&pt, 0, LEX_CODE);
+    size_t points = column_count(ci);
+    assert(points > len / COLUMN_STRIDE && "the whole line should have points");
+
+    // An edit that leaves the state alone only relexes up to the next point
+    pt_insert(&pt, 1000, "b", 1);
+    assert(ci->stale && ci->gap == 1 && "points past the edit should go stale");
+    column_end_state(&pt, 0, LEX_CODE, 0, len + 1);
+    assert(!ci->stale && column_count(ci) == points && "points past the edit should be reused");
+    assert(column_at(ci, points - 1).col == len + 1 && "the end point should move along");
+
+    // Splitting the line drops its index
+    pt_insert(&pt, 10, "\n", 1);
+    assert(!ci->used && "the index of a split line should be dropped");
+    pt_free(&pt);
+}
+
+void test_column_screen(void)
+{
+    // More long lines on screen than the caches keep off it
+    size_t lines = 2 * COLUMN_LINES + 8, len = LONG_LINE + 1000;
+    char *data = malloc(lines * (len + 1));
+    for (size_t i = 0; i < lines * (len + 1); ++i)
+        data[i] = i % (len + 1) == len ? '\n' : "a /* b */ "[i % 10];
+
+    PieceTable pt;
+    pt_init(&pt);
+    pt_load(&pt, data, lines * (len + 1), 0);
+    Editor e = { .width = 80, .height = lines + 2, .text = pt, .mode = NORMAL };
+    Viewport v = {0};
+    viewport_update(&v, &e);
+
+    // The next frame finds every line where the last one left it, lexed
+    // to its end for the state of the line below
+    ColumnIndex *indexes[2 * COLUMN_LINES + 8] = {0};
+    for (size_t frame = 0; frame < 2; ++frame) {
+        for (size_t row = 0; row + 1 < lines; ++row) {
+            ColumnIndex *ci = NULL;
+            for (size_t k = 0; k < e.text.columns.count; ++k)
+                if (e.text.columns.lines[k].used && e.text.columns.lines[k].row == row)
+                    ci = &e.text.columns.lines[k];
+            assert(ci && "every long line on screen should keep its index");
+            assert(column_at(ci, column_right(ci) - 1).col == len && "the index should reach the end of the line");
+            assert((frame == 0 || indexes[row] == ci) && "the index shouldn't be made again");
+            indexes[row] = ci;
+
+            CellMap *m = NULL;
+            for (size_t k = 0; k < e.text.cells.count; ++k)
+                if (e.text.cells.lines[k].used && e.text.cells.lines[k].row == row)
+                    m = &e.text.cells.lines[k];
+            assert(m && "every line on screen should keep its display columns");
+        }
+        viewport_update(&v, &e);
+    }
+
+    editor_free(&e);
+    viewport_free(&v);
+}
+
+void test_syntax_jump(void)
+{
+    char *path = text_file(100000);
+    Editor e = {0};
+    editor_read_from_file(&e, path);
+
+    int guessed;
+    syntax_state(&e.text, 50000, 40, &guessed);
+    assert(guessed && "state far past the cache should be guessed");
+    assert(e.text.syntax.valid <= 1 && "a jump shouldn't lex the lines above");
+
+    syntax_state(&e.text, 30, 40, &guessed);
+    assert(!guessed && "state close to the cache should be exact");
+    assert(e.text.syntax.valid == 31 && "lines up to the row should be cached");
+
+    while (syntax_step(&e.text));
+    assert(e.text.syntax.valid == 100000 && "every line should be cached");
+
+    editor_free(&e);
+    unlink(path);
 }
 
 int main(void) 
 {
     printf("Running tests\n");
     printf("  Line\n");
-    test(test_line_insert, "line_insert");
-    test(test_line_insert_multiple, "multiple line_insert");
-    printf("  Lines\n");
-    test(test_lines_remove, "lines_remove");
-    test(test_lines_remove_multiple, "lines_remove multiple");
-    test(test_lines_combine, "lines_combine");
-    test(test_lines_combine_empty, "lines_combine empty second line");
+    test(test_line_append, "line_append");
+    test(test_line_append_str, "line_append_str");
+    printf("  PieceTable\n");
+    test(test_pt_load, "pt_load");
+    test(test_pt_load_empty, "pt_load empty file");
+    test(test_pt_insert, "pt_insert");
+    test(test_pt_insert_coalesce, "pt_insert coalesces consecutive inserts");
+    test(test_pt_split_line, "pt_insert split line");
+    test(test_pt_delete, "pt_delete line");
+    test(test_pt_combine, "pt_delete combine lines");
+    test(test_pt_random_edits, "random edits match model");
+    test(test_pt_arena, "pieces are recycled through the arena");
+    test(test_pt_iter_read_line, "iterate lines");
+    test(test_editor_read_lazy, "mapped file is indexed lazily");
+    test(test_newline_scanners, "newline scanners agree");
+    test(test_newline_table_size, "a long paste keeps the newline table small");
+    test(test_pt_index_parallel, "parallel indexing matches sequential");
+    test(test_substring_scanners, "substring scanners agree");
+    test(test_regex, "regex matches");
+    test(test_regex_posix, "regex agrees with regexec");
+    test(test_regex_cache_flush, "regex DFA cache is flushed when full");
+    test(test_regex_long_lines, "regex scans long lines in linear time");
     printf("  Editor\n");
     test(test_editor_remove_char, "remove char");
-    test(test_editor_remove_char, "remove char");
     test(test_remove_editor_remove_line_start, "remove char at beginning of line");
+    test(test_editor_insert_newline, "insert newline");
+    test(test_editor_goto_line, "goto line");
+    test(test_editor_utf8, "cursor moves over whole chars and keeps to display columns");
+    test(test_editor_undo, "undo and redo insert sessions");
+    test(test_editor_undo_spill, "undo journal spills past its cap");
+    test(test_editor_search, "search forwards and backwards");
+    test(test_editor_search_edits, "edits only search the lines they touched again");
+    test(test_editor_search_regex, "regex search");
+    test(test_editor_substitute, ":s replaces matches in one undo group");
+    test(test_editor_save, "save replaces the file whole");
+    test(test_editor_swap, "unsaved edits are recovered from the swap file");
+    test(test_editor_follow, "a followed file takes in what is appended to it");
+    test(test_editor_follow_search, "a search finds text appended to a followed file");
+    test(test_input_keys, "decode keys");
+    test(test_input_utf8, "decode multibyte chars");
+    test(test_input_paste, "bracketed paste");
+    printf("  Render\n");
+    test(test_render_damage, "only damaged cells are redrawn");
+    test(test_render_single_write, "frame is written at once and synchronized");
+    test(test_render_scroll, "small scrolls use a scroll region");
+    test(test_render_search_matches, "search matches are highlighted");
+    test(test_render_status_key, "the status line shows the last key as decoded");
+    test(test_render_thread, "render thread keeps only the newest frame");
+    test(test_render_long_line, "long lines are drawn from the nearest lexer point");
+    test(test_utf8_width, "UTF-8 decoding and display width");
+    test(test_render_utf8, "wide chars, tabs and combining marks are laid out in cells");
+    test(test_cell_map, "display columns follow edits");
+    test(test_wrap_index, "wrapped rows follow edits and width changes");
+    test(test_render_wrap, "long lines wrap onto the next screen rows");
     printf("  Highlight\n");
-    test(test_match_keyword_matches, "keyword matches");
-    test(test_match_keyword_no_matches, "keyword doesn't match");
-    test(test_match_keyword_almost_matches, "keyword almost matches");
+    test(test_keyword_matches, "keyword matches");
+    test(test_keyword_no_matches, "keyword doesn't match");
+    test(test_keyword_almost_matches, "keyword almost matches");
     test(test_highlight, "highlight");
+    test(test_highlight_state, "comments, strings and preprocessor lines");
+    test(test_syntax_cache_edit, "edits only relex until the state matches");
+    test(test_syntax_jump, "jumping far ahead guesses the state");
+    test(test_column_reuse, "lexer points of a long line are reused after an edit");
+    test(test_column_screen, "every long line on screen keeps its lexer points");
     printf("Completed %zu tests\n", num_tests);
 
     return 0;